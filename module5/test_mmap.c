@@ -4,14 +4,35 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "vfifo_uapi.h"
 
 #define DEVICE_PATH "/dev/vfifo0"
 #define BUFFER_SIZE 4096
 
+/* Copy into a reserved span, wrapping at the end of the buffer */
+static void fill_span(char *map, const struct vfifo_reservation *res, const char *src)
+{
+    unsigned int first = res->len;
+
+    if (res->offset + first > BUFFER_SIZE)
+        first = BUFFER_SIZE - res->offset;
+    memcpy(map + res->offset, src, first);
+    memcpy(map, src + first, res->len - first);
+}
+
 int main() {
     int fd;
     char *map;
     char write_msg[] = "Hello via Memory Map!";
+    const char *parts[] = { "first ", "second ", "third" };
+    struct vfifo_reservation res[3];
+    struct vfifo_span span;
+    unsigned int new_size;
+    char buf[64];
+    ssize_t ret;
+    int i;
 
     fd = open(DEVICE_PATH, O_RDWR);
     if (fd < 0) {
@@ -35,8 +56,59 @@ int main() {
     printf("2. Verifying data in memory...\n");
     printf("   Mapped Content: \"%s\"\n", map);
 
-    /* Clean up */
+    printf("3. Reserving three spans, filling them in place...\n");
+    ioctl(fd, VFIFO_CLEAR);
+    for (i = 0; i < 3; i++) {
+        memset(&res[i], 0, sizeof(res[i]));
+        res[i].len = strlen(parts[i]);
+        if (ioctl(fd, VFIFO_RESERVE, &res[i]) < 0) {
+            perror("IOCTL Reserve failed");
+            return 1;
+        }
+        fill_span(map, &res[i], parts[i]);
+    }
+
+    printf("4. Committing out of order (third, first, second)...\n");
+    ioctl(fd, VFIFO_COMMIT, &res[2].pos);
+    ioctl(fd, VFIFO_COMMIT, &res[0].pos);
+    ioctl(fd, VFIFO_COMMIT, &res[1].pos);
+
+    printf("5. Peeking at the data in place (nothing is consumed)...\n");
+    if (ioctl(fd, VFIFO_PEEK, &span) < 0) {
+        perror("IOCTL Peek failed");
+        return 1;
+    }
+    printf("   %u bytes at offset %u: \"%.*s\"\n", span.len, span.offset,
+           (int)span.len, map + span.offset);
+
+    printf("6. Releasing the first span, then reading the rest...\n");
+    if (ioctl(fd, VFIFO_CONSUME, &res[0].len) < 0) {
+        perror("IOCTL Consume failed");
+        return 1;
+    }
+
+    /* Readers only see committed spans, and always in reservation order */
+    memset(buf, 0, sizeof(buf));
+    ret = read(fd, buf, sizeof(buf) - 1);
+    printf("   Read %zd bytes: \"%s\"\n", ret, buf);
+
+    printf("7. Growing the live ring to 16 KiB with data queued...\n");
+    write(fd, write_msg, strlen(write_msg));
     munmap(map, BUFFER_SIZE);
+    new_size = 4 * BUFFER_SIZE;
+    if (ioctl(fd, VFIFO_RESIZE, &new_size) < 0) {
+        perror("IOCTL Resize failed");
+        return 1;
+    }
+    memset(buf, 0, sizeof(buf));
+    ret = read(fd, buf, sizeof(buf) - 1);
+    printf("   Still queued after resize: \"%s\"\n", buf);
+
+    /* Shrink back so the next run starts from the default size */
+    new_size = BUFFER_SIZE;
+    ioctl(fd, VFIFO_RESIZE, &new_size);
+
+    /* Clean up */
     close(fd);
     return 0;
 }
@@ -0,0 +1,407 @@
+/*
+ * test_ring.c - user-space tests for the ring core (vfifo_ring.h)
+ *
+ * No module, no root: this runs the driver's own bookkeeping code in a
+ * normal process, so it can be built with sanitizers or as a fuzzer.
+ *
+ *   make test_ring && ./test_ring            # model check + threaded stress
+ *   make test_ring SANITIZE=thread           # the same under TSan
+ *   make ring_fuzz && ./ring_fuzz            # libFuzzer (needs clang)
+ *
+ * The model check replays a sequence of operations (random, or the fuzzer's
+ * input) against the ring and against a simple model of what readers must
+ * see. The stress test runs producer and consumer threads with one lock
+ * per side, the same locking the driver uses.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+
+#include "vfifo_ring.h"
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            abort(); \
+        } \
+    } while (0)
+
+/* Copy into or out of a span, wrapping at the end of the buffer */
+static void ring_copy(struct vfifo_ring *r, uint8_t *buf, u32 pos, void *data, u32 len, int to_ring)
+{
+    u32 off = vfifo_ring_offset(r, pos), first = len;
+
+    if (off + first > r->capacity)
+        first = r->capacity - off;
+    if (to_ring) {
+        memcpy(buf + off, data, first);
+        memcpy(buf, (uint8_t *)data + first, len - first);
+    } else {
+        memcpy(data, buf + off, first);
+        memcpy((uint8_t *)data + first, buf, len - first);
+    }
+}
+
+/* --- Model Check --- */
+
+#define MODEL_CAP   64
+#define MODEL_SPAN  (4 * VFIFO_MAX_RESV)
+
+/* What a reader must find at each position, indexed like the ring (0: nothing) */
+struct model {
+    struct vfifo_ring ring;
+    uint8_t buf[MODEL_CAP];
+    uint8_t expect[MODEL_CAP];
+    struct vfifo_resv wr[MODEL_SPAN], rd[MODEL_SPAN];   /* Claims we hold */
+    int nwr, nrd;
+    uint8_t tag;
+};
+
+static void model_invariants(struct model *m)
+{
+    struct vfifo_ring *r = &m->ring;
+
+    /* tail <= cons <= head <= reserve, all within one capacity */
+    CHECK(r->reserve - r->tail <= r->capacity);
+    CHECK(r->cons - r->tail <= r->reserve - r->tail);
+    CHECK(r->head - r->tail <= r->reserve - r->tail);
+    CHECK(r->cons - r->tail <= r->head - r->tail);
+    CHECK(r->wspans.count >= (unsigned int)m->nwr && r->rspans.count >= (unsigned int)m->nrd);
+    CHECK(vfifo_ring_used(r) + vfifo_ring_free(r) <= r->capacity);
+}
+
+static void model_step(struct model *m, uint8_t op, uint8_t arg)
+{
+    struct vfifo_ring *r = &m->ring;
+    struct vfifo_resv res;
+    uint8_t data[MODEL_CAP];
+    u32 len = arg % (MODEL_CAP + 2), i, pos, n;
+    int ret, k;
+
+    switch (op % 6) {
+    case 0:     /* Reserve and fill */
+        ret = vfifo_ring_reserve(r, len, arg & 0x80, NULL, &res);
+        if (len == 0 || len > MODEL_CAP) {
+            CHECK(ret == -EINVAL);
+            break;
+        }
+        if (ret)
+            break;
+        CHECK(res.len <= len && res.len > 0);
+        memset(data, ++m->tag ? m->tag : ++m->tag, res.len);
+        ring_copy(r, m->buf, res.pos, data, res.len, 1);
+        for (i = 0; i < res.len; i++)
+            m->expect[vfifo_ring_offset(r, res.pos + i)] = m->tag;
+        m->wr[m->nwr++] = res;
+        break;
+
+    case 1:     /* Commit one of ours, in any order */
+        if (!m->nwr)
+            break;
+        k = arg % m->nwr;
+        CHECK(vfifo_ring_commit(r, m->wr[k].pos, NULL) >= 0);
+        m->wr[k] = m->wr[--m->nwr];
+        break;
+
+    case 2:     /* Discard one: no reader may ever see its bytes */
+        if (!m->nwr)
+            break;
+        k = arg % m->nwr;
+        CHECK(vfifo_ring_discard(r, m->wr[k].pos, NULL) >= 0);
+        for (i = 0; i < m->wr[k].len; i++)
+            m->expect[vfifo_ring_offset(r, m->wr[k].pos + i)] = 0;
+        m->wr[k] = m->wr[--m->nwr];
+        break;
+
+    case 3:     /* Claim and check the bytes */
+        n = vfifo_ring_peek(r, &pos);
+        ret = vfifo_ring_claim(r, len, arg & 0x80, &res);
+        if (len == 0) {
+            CHECK(ret == -EINVAL);
+            break;
+        }
+        if (ret)
+            break;
+        CHECK(res.pos == pos && res.len <= n);
+        ring_copy(r, m->buf, res.pos, data, res.len, 0);
+        for (i = 0; i < res.len; i++)
+            CHECK(data[i] && data[i] == m->expect[vfifo_ring_offset(r, res.pos + i)]);
+        m->rd[m->nrd++] = res;
+        break;
+
+    case 4:     /* Release one, possibly short: only the newest gives the rest back */
+        if (!m->nrd)
+            break;
+        k = arg % m->nrd;
+        n = arg % (m->rd[k].len + 1);
+        i = m->rd[k].pos + m->rd[k].len == r->cons ? 0 : m->rd[k].len - n;
+        pos = r->lost;
+        CHECK(vfifo_ring_release(r, m->rd[k].pos, n) >= 0);
+        CHECK(r->lost - pos == i);
+        m->rd[k] = m->rd[--m->nrd];
+        break;
+
+    case 5:     /* Bogus positions are rejected */
+        CHECK(vfifo_ring_commit(r, r->reserve + 1, NULL) == -EINVAL);
+        CHECK(vfifo_ring_release(r, r->cons + 1, 0) == -EINVAL);
+        break;
+    }
+    /* Readers made room for a waiting hole: the driver publishes again */
+    if (r->hole_wait)
+        vfifo_ring_publish(r);
+    CHECK(m->nwr < MODEL_SPAN && m->nrd < MODEL_SPAN);
+    model_invariants(m);
+}
+
+/* Positions start near the u32 wrap when the input asks for it */
+static void model_run(const uint8_t *ops, size_t size)
+{
+    struct model *m = calloc(1, sizeof(*m));
+    size_t i;
+
+    CHECK(m);
+    vfifo_ring_init(&m->ring, MODEL_CAP, size && (ops[0] & 1) ? UINT32_MAX - MODEL_CAP : 0);
+    for (i = 1; i + 1 < size; i += 2)
+        model_step(m, ops[i], ops[i + 1]);
+    free(m);
+}
+
+#ifdef FUZZ
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    model_run(data, size);
+    return 0;
+}
+#else
+
+/* --- Discarded Reservations --- */
+
+/* Reserve @len bytes and fill them with @c */
+static u32 put_span(struct vfifo_ring *r, uint8_t *buf, uint8_t c, u32 len)
+{
+    struct vfifo_resv res;
+    uint8_t data[16];
+
+    CHECK(vfifo_ring_reserve(r, len, false, NULL, &res) == 0);
+    memset(data, c, len);
+    ring_copy(r, buf, res.pos, data, len, 1);
+    return res.pos;
+}
+
+/* Claim everything up to the next hole and check it is all @c */
+static u32 get_span(struct vfifo_ring *r, uint8_t *buf, uint8_t c)
+{
+    struct vfifo_resv res;
+    uint8_t data[16];
+    u32 i;
+
+    if (vfifo_ring_claim(r, sizeof(data), true, &res))
+        return 0;
+    ring_copy(r, buf, res.pos, data, res.len, 0);
+    for (i = 0; i < res.len; i++)
+        CHECK(data[i] == c);
+    CHECK(vfifo_ring_release(r, res.pos, res.len) >= 0);
+    return res.len;
+}
+
+static void test_discard(void)
+{
+    static uint8_t buf[1024];
+    struct vfifo_ring r;
+    u32 a, b, c, pos;
+    int i;
+
+    /* A discarded span between two committed ones is skipped, not read */
+    vfifo_ring_init(&r, sizeof(buf), UINT32_MAX - 4);
+    a = put_span(&r, buf, 'a', 3);
+    b = put_span(&r, buf, 'b', 5);
+    c = put_span(&r, buf, 'c', 2);
+    CHECK(vfifo_ring_discard(&r, b, NULL) == 0);
+    CHECK(vfifo_ring_commit(&r, c, NULL) == 0);
+    CHECK(vfifo_ring_commit(&r, a, NULL) == 1);
+    CHECK(vfifo_ring_peek(&r, &pos) == 3 && pos == a);
+    CHECK(get_span(&r, buf, 'a') == 3);
+    CHECK(vfifo_ring_peek(&r, &pos) == 2 && pos == c);
+    CHECK(get_span(&r, buf, 'c') == 2);
+    CHECK(get_span(&r, buf, 0) == 0);
+    CHECK(vfifo_ring_used(&r) == 0 && vfifo_ring_free(&r) == sizeof(buf));
+
+    /* The newest one is handed back */
+    a = put_span(&r, buf, 'a', 4);
+    CHECK(vfifo_ring_discard(&r, a, NULL) == 0 && r.reserve == a);
+
+    /* More holes than the queue holds: the rest wait until readers skip some */
+    for (i = 0; i <= VFIFO_MAX_RESV; i++) {
+        a = put_span(&r, buf, 'x', 1);
+        b = put_span(&r, buf, 'y', 1);
+        CHECK(vfifo_ring_discard(&r, a, NULL) == (i < VFIFO_MAX_RESV));
+        CHECK(vfifo_ring_commit(&r, b, NULL) == (i < VFIFO_MAX_RESV));
+    }
+    CHECK(r.hole_wait && r.head == a);
+    for (i = 0; i <= VFIFO_MAX_RESV; i++) {
+        CHECK(get_span(&r, buf, 'y') == 1);
+        if (r.hole_wait)
+            CHECK(vfifo_ring_publish(&r) == 1);
+    }
+    CHECK(!r.hole_wait && vfifo_ring_used(&r) == 0);
+}
+
+/* --- Short Releases --- */
+
+static void test_short_release(void)
+{
+    static uint8_t buf[64];
+    struct vfifo_ring r;
+    struct vfifo_resv a, b;
+    u32 pos;
+
+    vfifo_ring_init(&r, sizeof(buf), UINT32_MAX - 8);
+    pos = put_span(&r, buf, 'a', 16);
+    CHECK(vfifo_ring_commit(&r, pos, NULL) == 1);
+
+    /* The newest claim gives its unread rest back */
+    CHECK(vfifo_ring_claim(&r, 8, false, &a) == 0);
+    CHECK(vfifo_ring_release(&r, a.pos, 3) == 1);
+    CHECK(r.cons == a.pos + 3 && r.lost == 0);
+
+    /* So does one whose later claim read nothing and went back */
+    CHECK(vfifo_ring_claim(&r, 4, false, &a) == 0);
+    CHECK(vfifo_ring_claim(&r, 4, false, &b) == 0);
+    CHECK(vfifo_ring_release(&r, b.pos, 0) == 0);
+    CHECK(vfifo_ring_release(&r, a.pos, 1) == 1);
+    CHECK(r.cons == a.pos + 1 && r.lost == 0);
+
+    /* One with a later claim behind it cannot: the rest is counted as lost */
+    CHECK(vfifo_ring_claim(&r, 8, false, &a) == 0);
+    CHECK(vfifo_ring_claim(&r, 4, false, &b) == 0);
+    CHECK(vfifo_ring_release(&r, a.pos, 2) == 1);
+    CHECK(r.lost == 6 && r.tail == b.pos);
+    CHECK(vfifo_ring_release(&r, b.pos, 4) == 1);
+    CHECK(vfifo_ring_avail(&r) == 0 && vfifo_ring_used(&r) == 0);
+}
+
+/* --- Threaded Stress --- */
+
+#define STRESS_CAP      4096
+#define STRESS_THREADS  4
+#define STRESS_RECORDS  100000
+
+struct rec {
+    u32 producer;
+    u32 seq;
+};
+
+static struct vfifo_ring stress_ring;
+static uint8_t stress_buf[STRESS_CAP];
+static pthread_mutex_t wlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t rlock = PTHREAD_MUTEX_INITIALIZER;
+static u32 consumed;
+
+static void *producer(void *arg)
+{
+    struct rec rec = { .producer = (u32)(uintptr_t)arg };
+    struct vfifo_resv res;
+    int ret;
+
+    for (rec.seq = 0; rec.seq < STRESS_RECORDS; rec.seq++) {
+        do {
+            pthread_mutex_lock(&wlock);
+            ret = vfifo_ring_reserve(&stress_ring, sizeof(rec), false, NULL, &res);
+            pthread_mutex_unlock(&wlock);
+            if (ret == -EAGAIN)
+                sched_yield();
+        } while (ret == -EAGAIN);
+        CHECK(ret == 0);
+
+        ring_copy(&stress_ring, stress_buf, res.pos, &rec, sizeof(rec), 1);
+
+        pthread_mutex_lock(&wlock);
+        CHECK(vfifo_ring_commit(&stress_ring, res.pos, NULL) >= 0);
+        pthread_mutex_unlock(&wlock);
+    }
+    return NULL;
+}
+
+/* Each consumer must see each producer's records in order */
+static void *consumer(void *arg)
+{
+    u32 next[STRESS_THREADS] = { 0 };
+    struct vfifo_resv res;
+    struct rec rec;
+    int ret;
+
+    (void)arg;
+    while (__atomic_load_n(&consumed, __ATOMIC_RELAXED) < STRESS_THREADS * STRESS_RECORDS) {
+        pthread_mutex_lock(&rlock);
+        ret = vfifo_ring_claim(&stress_ring, sizeof(rec), false, &res);
+        pthread_mutex_unlock(&rlock);
+        if (ret) {
+            sched_yield();
+            continue;
+        }
+
+        ring_copy(&stress_ring, stress_buf, res.pos, &rec, sizeof(rec), 0);
+        CHECK(rec.producer < STRESS_THREADS && rec.seq >= next[rec.producer]);
+        next[rec.producer] = rec.seq + 1;
+
+        pthread_mutex_lock(&rlock);
+        CHECK(vfifo_ring_release(&stress_ring, res.pos, res.len) >= 0);
+        pthread_mutex_unlock(&rlock);
+        __atomic_add_fetch(&consumed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t tids[2 * STRESS_THREADS];
+    uint8_t ops[4096];
+    unsigned int seed = argc > 1 ? atoi(argv[1]) : time(NULL);
+    double t0;
+    int i, run;
+    size_t j;
+
+    printf("1. Model check, seed %u...\n", seed);
+    srand(seed);
+    for (run = 0; run < 2000; run++) {
+        for (j = 0; j < sizeof(ops); j++)
+            ops[j] = rand();
+        model_run(ops, sizeof(ops));
+    }
+    printf("   2000 random sequences OK\n");
+
+    printf("2. Discarded reservations...\n");
+    test_discard();
+    printf("   OK\n");
+
+    printf("3. Short releases...\n");
+    test_short_release();
+    printf("   OK\n");
+
+    printf("4. %d producers, %d consumers, %d records each...\n",
+           STRESS_THREADS, STRESS_THREADS, STRESS_RECORDS);
+    vfifo_ring_init(&stress_ring, STRESS_CAP, UINT32_MAX - STRESS_CAP / 2);
+    t0 = now();
+    for (i = 0; i < STRESS_THREADS; i++) {
+        pthread_create(&tids[i], NULL, producer, (void *)(uintptr_t)i);
+        pthread_create(&tids[STRESS_THREADS + i], NULL, consumer, NULL);
+    }
+    for (i = 0; i < 2 * STRESS_THREADS; i++)
+        pthread_join(tids[i], NULL);
+    CHECK(vfifo_ring_used(&stress_ring) == 0);
+    printf("   OK, %.0f records/s\n", STRESS_THREADS * STRESS_RECORDS / (now() - t0));
+    return 0;
+}
+#endif
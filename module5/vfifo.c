@@ -10,50 +10,465 @@
 #include <linux/wait.h>
 #include <linux/sched.h>
 #include <linux/ioctl.h>
-#include <linux/timer.h>
-#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/sched/types.h>
 #include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/spinlock.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/rwsem.h>
+#include <linux/list.h>
+#include <linux/eventfd.h>
+#include <linux/atomic.h>
+#include <linux/kref.h>
+#include <linux/idr.h>
+#include <linux/configfs.h>
+#include <linux/lz4.h>
+#include <linux/percpu.h>
+#include <linux/local_lock.h>
+#include <linux/seqlock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/shmem_fs.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/random.h>
+#include <linux/pid.h>
+
+#include "vfifo_uapi.h"
+#include "vfifo.h"
+#include "vfifo_ring.h"
 
 /* Metadata */
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("anonymous");
 MODULE_DESCRIPTION("Module 5: Virtual FIFO with mmap & sysfs");
 MODULE_VERSION("0.5");
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("DMA_BUF");
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
 
 /* Module Parameter: Buffer Size */
-/* Note: For mmap, buffer size should be page aligned preferably */
-static int buffer_size = 4096; 
-module_param(buffer_size, int, 0644);
-MODULE_PARM_DESC(buffer_size, "Size of the internal FIFO buffer in bytes");
+/*
+ * Note: Rounded up to a power of two (and at least a page) at load time.
+ * This is only the initial size; resize a live device through its
+ * 'capacity' sysfs attribute or VFIFO_RESIZE.
+ */
+static int buffer_size = 4096;
+module_param(buffer_size, int, 0444);
+MODULE_PARM_DESC(buffer_size, "Initial size of the internal FIFO buffer in bytes");
+
+/* Module Parameter: Number of Instances (vfifo0, vfifo1, ...) */
+static int nr_devices = 1;
+module_param(nr_devices, int, 0444);
+MODULE_PARM_DESC(nr_devices, "Number of FIFO instances to create");
+
+/* Module Parameter: Per-CPU Sharding (see "Per-CPU Shards" below) */
+static char *sharding = "off";
+module_param(sharding, charp, 0444);
+MODULE_PARM_DESC(sharding, "Per-CPU producer rings: off, unordered, timestamp or sequence");
+
+/* Module Parameter: Multi-Queue (see "Multi-Queue" below) */
+static int nr_queues;
+module_param(nr_queues, int, 0444);
+MODULE_PARM_DESC(nr_queues, "Queues behind each device node, steered by flow key (0: one ring)");
+
+/* Module Parameter: Priority Lanes (see "Priority Lanes" below) */
+static int nr_lanes;
+module_param(nr_lanes, int, 0444);
+MODULE_PARM_DESC(nr_lanes, "Priority lanes per device, 0 highest (0: one ring)");
+
+/* Module Parameter: Tee (see "Tee" below) */
+static int tee_sinks;
+module_param(tee_sinks, int, 0444);
+MODULE_PARM_DESC(tee_sinks, "Deliver every write to vfifo0 to vfifo1..N by reference (0: off)");
+
+/* Module Parameter: LZ4 (see "Compression" below) */
+static bool compress;
+module_param(compress, bool, 0444);
+MODULE_PARM_DESC(compress, "Store queued data LZ4-compressed (default: off)");
+
+/* Module Parameter: Sessions (see "Sessions" below) */
+static char *sessions = "off";
+module_param(sessions, charp, 0444);
+MODULE_PARM_DESC(sessions, "Private ring per open: off, fd or pgrp (one per process group)");
+
+static int session_size = 4096;
+module_param(session_size, int, 0444);
+MODULE_PARM_DESC(session_size, "Bytes of each session's ring; buffer_size is then the pool for all of them");
+
+/* Module Parameters: Ring Memory (see "Ring Storage" below) */
+static unsigned long mem_limit;
+module_param(mem_limit, ulong, 0644);
+MODULE_PARM_DESC(mem_limit, "Bytes of ring memory all instances may hold together (0: no limit)");
+
+static unsigned int pool_keep = 1024;
+module_param(pool_keep, uint, 0644);
+MODULE_PARM_DESC(pool_keep, "Freed ring pages kept per NUMA node for reuse");
+
+/* IOCTL Definitions live in vfifo_uapi.h, the in-kernel API in vfifo.h */
+
+/* Minors reserved for instances */
+#define VFIFO_MAX_DEVICES 16
+
+/* Most queues a multi-queue instance may have, and lanes */
+#define VFIFO_MAX_QUEUES 64
+#define VFIFO_MAX_LANES 8
+
+/* Largest ring VFIFO_RESIZE will allocate */
+#define VFIFO_MAX_CAPACITY (1U << 28)
+
+/*
+ * An eventfd registered for one readiness condition. Signals are edge
+ * triggered: one per crossing of 'watermark', re-armed once the level has
+ * dropped back below it.
+ */
+struct vfifo_evt {
+    struct eventfd_ctx *ctx;    /* Changed under evt_lock */
+    struct file *owner;         /* Registration is dropped when it closes */
+    u32 watermark;              /* 0: nothing registered */
+    atomic_t armed;
+    u64 fired;                  /* Crossings signalled, under evt_lock */
+};
+
+/*
+ * A token bucket (see "Rate Shaping" below). Tokens are bytes scaled by
+ * NSEC_PER_SEC, so a refill is one multiplication and nothing is lost to
+ * rounding; a negative count is debt.
+ */
+struct vfifo_bucket {
+    spinlock_t lock;
+    u64 rate;           /* Bytes per second; 0: unlimited */
+    u32 burst;          /* Bytes; 0: one second's worth */
+    s64 tokens;
+    u64 stamp;          /* ktime_get_ns() of the last refill */
+};
+
+/* How a sharded instance's readers merge the per-CPU rings */
+enum vfifo_sharding {
+    VFIFO_SHARD_OFF,        /* One shared ring */
+    VFIFO_SHARD_UNORDERED,  /* Whatever is there, round robin over CPUs */
+    VFIFO_SHARD_TIMESTAMP,  /* Oldest ktime_get_ns() first */
+    VFIFO_SHARD_SEQUENCE,   /* Global sequence number: exact, one shared counter */
+};
+
+static const char * const vfifo_sharding_names[] = {
+    [VFIFO_SHARD_OFF] = "off",
+    [VFIFO_SHARD_UNORDERED] = "unordered",
+    [VFIFO_SHARD_TIMESTAMP] = "timestamp",
+    [VFIFO_SHARD_SEQUENCE] = "sequence",
+};
+
+enum vfifo_session_mode {
+    VFIFO_SESSION_OFF,      /* All opens share the device's ring */
+    VFIFO_SESSION_FD,       /* Each open gets a ring of its own */
+    VFIFO_SESSION_PGRP,     /* Opens from one process group share one */
+};
+
+static const char * const vfifo_session_names[] = {
+    [VFIFO_SESSION_OFF] = "off",
+    [VFIFO_SESSION_FD] = "fd",
+    [VFIFO_SESSION_PGRP] = "pgrp",
+};
+
+/*
+ * How an instance is laid out and set up: from the module parameters for
+ * vfifo0..N-1, or from a configfs item (see "Configfs") for the others
+ */
+struct vfifo_config {
+    u32 capacity;
+    int node;                       /* NUMA node of the ring, or NUMA_NO_NODE */
+    enum vfifo_sharding sharding;
+    u32 nr_queues;
+    u32 nr_lanes;
+    bool compress;
+    enum vfifo_session_mode sessions;
+    u32 session_size;
+    bool auto_generate;
+    u32 gen_interval_ms;
+};
+
+/*
+ * Sub-rings hold records rather than a byte stream, so readers can take
+ * whole writes from any of them, in any order. Each record is this header
+ * plus the payload, padded to 8 bytes.
+ */
+struct vfifo_rec {
+    u32 len;                /* Payload bytes */
+    u32 flags;              /* VFIFO_REC_* */
+    u64 key;                /* Merge order: timestamp or sequence number */
+};
+
+/* Never filled (the writer faulted): readers drop it */
+#define VFIFO_REC_SKIP  (1 << 0)
+
+static inline u32 vfifo_rec_size(u32 len)
+{
+    return ALIGN(sizeof(struct vfifo_rec) + len, 8);
+}
+
+/* One ring of a sharded or multi-queue instance (see "Record Rings") */
+struct vfifo_subring {
+    spinlock_t lock;                /* Producer side */
+    spinlock_t *cons_lock;          /* Consumer side: shared by shards, a queue's own */
+    wait_queue_head_t *read_wq;     /* Where this ring's readers and writers sleep */
+    wait_queue_head_t *write_wq;
+    struct vfifo_ring ring;
+    unsigned char *buffer;          /* Double-mapped, like dev->buffer */
+    struct page **pages;
+
+    /* Statistics, each updated under the lock of its side */
+    u64 enqueued, bytes_in, full;
+    u64 dequeued, bytes_out;
+    u64 lost;                       /* Ring bytes of records dropped after a failed copy */
+    u64 lat_sum, lat_max;           /* Enqueue to dequeue, ns, when keys are times */
+};
+
+/*
+ * A queue of a multi-queue instance, or a priority lane: a sub-ring with
+ * wait queues of its own. Queues have their own consumer lock too; lanes
+ * share dev->cons_lock, since readers pick among them.
+ */
+struct vfifo_queue {
+    struct vfifo_subring sub;
+    spinlock_t cons_lock;
+    wait_queue_head_t read_queue;
+    wait_queue_head_t write_queue;
+    u32 weight;                     /* Lanes: records per weighted round robin turn */
+    struct kobject kobj;            /* queues/qN/ or lanes/laneN/; owns the memory */
+};
+
+/* What a tee sink's ring holds instead of bytes: a piece of a shared page */
+struct vfifo_tref {
+    struct page *page;      /* The entry holds a reference */
+    u32 off;
+    u32 len;
+} __aligned(16);
+
+/* Most pages (and so trefs per sink) a single tee'd write takes */
+#define VFIFO_TEE_MAX_PAGES 16
+
+/* Where the device's locks are taken (see "Lock Statistics" below) */
+enum vfifo_lock_site {
+    VFIFO_LS_RESERVE,       /* resv_lock */
+    VFIFO_LS_COMMIT,
+    VFIFO_LS_DISCARD,
+    VFIFO_LS_CLAIM,         /* cons_lock */
+    VFIFO_LS_RELEASE,
+    VFIFO_LS_PEEK,
+    VFIFO_LS_FILES,         /* lock: open and close */
+    VFIFO_LS_RESIZE,        /* lock: resize, held throughout */
+    VFIFO_LS_CTRL,          /* lock: first mmap of the control page */
+    VFIFO_LS_DMABUF,        /* lock: dma-buf export */
+    VFIFO_LS_SESSION,       /* lock: session create, join and free */
+    VFIFO_LS_NR,
+};
 
-/* IOCTL Definitions */
-#define VFIFO_IOC_MAGIC 'k'
-#define VFIFO_CLEAR     _IO(VFIFO_IOC_MAGIC, 1)
-#define VFIFO_SET_MODE  _IOW(VFIFO_IOC_MAGIC, 2, int)
+#if IS_ENABLED(CONFIG_VFIFO_LOCK_STAT)
+/* Bucket i counts times in [2^i, 2^(i+1)) ns; the last one everything longer */
+#define VFIFO_LS_BUCKETS 32
+
+/* One site's histograms, updated with the lock held, so plain counters do */
+struct vfifo_lock_stat {
+    u64 count;
+    u64 wait[VFIFO_LS_BUCKETS], wait_max;
+    u64 hold[VFIFO_LS_BUCKETS], hold_max;
+    u64 since;              /* When the current holder got the lock */
+};
+#endif
 
 /* Device Structure */
 struct vfifo_dev {
-    struct cdev cdev;
+    /*
+     * The cdev is allocated apart: an inode that was opened keeps it until
+     * it is evicted, possibly long after the device is freed. Opens find
+     * the device through vfifo_minor_devs[] instead.
+     */
+    struct cdev *cdev;
+    dev_t devt;
+    int minor;              /* Freed with the device, or -1 */
+    char name[32];
+    struct kref ref;
+    struct list_head node;  /* On vfifo_list */
+
+    /*
+     * Ring storage. 'buffer' maps 'pages' twice back to back, so any span
+     * of up to 'capacity' bytes is virtually contiguous in the kernel.
+     */
     unsigned char *buffer;
-    int head;
-    int tail;
-    int size;
-    
-    struct mutex lock;
+    struct page **pages;
+
+    /*
+     * Memory accounting (see "Ring Storage" below). Every ring page of the
+     * device, its shards and queues is charged to 'pool_acct': the device
+     * itself, or for a session its device. Accounts are on vfifo_accounts.
+     */
+    struct vfifo_dev *pool_acct;
+    struct list_head pool_node;
+    unsigned long pool_pages;       /* Account: pages charged, under vfifo_accounts_lock */
+
+    /*
+     * Positions and claims (vfifo_ring.h). Claim owners are the struct file,
+     * or NULL for kernel-side and syscall-scoped claims.
+     */
+    struct vfifo_ring ring;
+
+    /* Producer side: only the claim/publish bookkeeping runs under this lock */
+    spinlock_t resv_lock;
+
+    /* Consumer side, the mirror image */
+    spinlock_t cons_lock;
+
+    bool resizing;          /* New claims wait while set (set under both locks) */
+
+    /*
+     * Status snapshot (see "Status" below). Each side moves its position
+     * and counts the bytes inside its own seqcount, under its own lock, so
+     * readers get a consistent view of a side without taking either lock.
+     */
+    seqcount_t prod_seq;            /* capacity, head, bytes_in, commits */
+    u64 bytes_in, commits;
+    seqcount_t cons_seq;            /* tail, bytes_out, releases */
+    u64 bytes_out, releases;
+    u64 lost;                       /* Claimed, not read, and not given back (cons_lock) */
+
+    /*
+     * Sharded and multi-queue instances keep their data in 'nr_subs'
+     * record rings instead, indexed by CPU (NULL for impossible CPUs) or by
+     * queue number. 'ring' above then stays empty.
+     */
+    enum vfifo_sharding sharding;
+    u32 nr_queues;                  /* Multi-queue: number of queues, or 0 */
+    u32 nr_lanes;                   /* Priority lanes: number of lanes, or 0 */
+    bool lane_wrr;                  /* Lanes: weighted round robin, not strict */
+    u32 lane_credit;                /* Lanes, WRR: records left in this turn */
+    struct vfifo_subring **subs;
+    unsigned int nr_subs;
+    unsigned int sub_next;          /* Round robin: where to look first */
+    struct kobject *subs_kobj;      /* queues/ or lanes/ in sysfs */
+    atomic64_t shard_seq ____cacheline_aligned_in_smp;
+
+    /*
+     * Tee: a source's writes go by reference to every one of its 'tee'
+     * sinks, whose 'ring' holds struct vfifo_tref entries instead of bytes.
+     */
+    struct vfifo_dev **tee;         /* Source: its sinks, each holding a reference */
+    unsigned int nr_tee;
+    bool tee_sink;
+    bool tee_drop;                  /* Sink: when full, miss writes rather than block them */
+    atomic_long_t tee_bytes;        /* Sink: payload bytes its trefs point to */
+    u64 tee_dropped;                /* Sink: writes missed (under resv_lock) */
+
+    /*
+     * Compression: 'ring' holds LZ4 blocks of up to 'lz4_block' raw bytes.
+     * Readers decompress a block at a time, and whatever does not fit in
+     * their buffer, or could not be copied to it, waits in 'lz4_out' for
+     * the next read.
+     */
+    bool lz4;
+    u32 lz4_block;
+    u8 *lz4_out;                    /* Two blocks' worth, under cons_lock */
+    u32 lz4_out_pos, lz4_out_len;
+    atomic_long_t lz4_queued;       /* Raw bytes readers have still to get */
+    u64 lz4_raw, lz4_stored, lz4_comp_ns;  /* Under resv_lock */
+    u64 lz4_decomp_ns;              /* Under cons_lock */
+
+    u32 stream_threshold;           /* write() spans this big bypass the caches; 0: never */
+
+    struct vfifo_bucket rate;       /* All fds' writes together */
+    atomic_long_t throttled;        /* Writes held back or refused by a rate limit */
+
+    struct mutex lock;      /* Serialises control operations and 'files' */
+    struct rw_semaphore buf_sem;    /* Held for write while 'buffer' is swapped */
+    struct list_head files;         /* Open files, for unmapping on resize */
+
+    spinlock_t evt_lock;
+    struct vfifo_evt data_evt;      /* Readable bytes >= watermark */
+    struct vfifo_evt space_evt;     /* Free bytes >= watermark */
     wait_queue_head_t read_queue;
     wait_queue_head_t write_queue;
 
-    struct timer_list data_timer;
-    struct work_struct data_work;
+    /* Generator (see "Generator" below); the settings are under gen_lock */
+    struct mutex gen_lock;
+    struct task_struct *gen_task;   /* Running while auto_generate */
     bool auto_generate;
-    
+    u32 gen_interval_ms;            /* Generator period */
+    int gen_cpu;                    /* Pinned to this CPU, or -1 */
+    int gen_rt_prio;                /* SCHED_FIFO priority, 0: SCHED_NORMAL */
+    int gen_nice;                   /* Nice level under SCHED_NORMAL */
+    u64 gen_late_max_ns;            /* Worst wakeup lateness since started */
+
+    /*
+     * Control page (see "Futex Wait Words" below), made on its first mmap.
+     * 'ctrl' is its kernel address, published once the page is ready.
+     */
+    struct vfifo_ctrl *ctrl;
+    struct file *ctrl_file;
+    struct page *ctrl_page;
+
+    atomic_t dmabufs;               /* Live dma-buf exports; no resize meanwhile */
+
+    /*
+     * Sessions (see "Sessions" below): every open gets a private ring of
+     * 'session_size' bytes, all of them within 'session_pool' bytes. Each
+     * session is a vfifo_dev of its own that is never listed, pointing back
+     * at its device through 'session_of'. The device's fields are under
+     * 'lock'; a session's are set before anyone else can see it.
+     */
+    enum vfifo_session_mode sessions;
+    u32 session_size;
+    u32 session_pool;
+    u32 session_used;               /* Bytes of the pool in sessions */
+    struct idr session_ids;         /* Live sessions by id */
+    unsigned int nr_sessions;
+    struct vfifo_dev *session_of;   /* Session: its device, referenced */
+    u32 session_id;
+    u64 session_token;              /* Session: JOIN must present this */
+    struct pid *session_pgrp;       /* Session, pgrp mode: its process group */
+
+    struct dentry *debugfs;         /* vfifo/<name>/ in debugfs */
+#if IS_ENABLED(CONFIG_VFIFO_LOCK_STAT)
+    struct vfifo_lock_stat lockstat[VFIFO_LS_NR];
+#endif
+    int numa_node;                  /* NUMA node of the ring(s) */
+
     struct device *dev; /* Pointer to device struct for sysfs */
 };
 
+/* Per-open state, stored in filp->private_data */
+struct vfifo_file {
+    struct vfifo_dev *dev;
+    struct file *filp;
+    struct list_head node;  /* On dev->files */
+
+    /* Multi-queue and lanes only */
+    u32 key;                /* This fd's writes: flow key, or lane number */
+    bool key_in_header;     /* ...unless each write starts with its own */
+    int queue;              /* The only queue this fd reads, or -1 for all */
+
+    /* VFIFO_SET_STREAM: this fd's own threshold instead of the device's */
+    bool stream_own;
+    u32 stream_threshold;
+
+    struct vfifo_bucket rate;       /* VFIFO_SET_RATE: this fd's writes */
+
+    /* Sessions: the one this fd left by VFIFO_JOIN_SESSION, kept until close */
+    struct vfifo_dev *parked;
+};
+
 /* Global Variables */
 static dev_t dev_num;
 static struct class *vfifo_class;
-static struct vfifo_dev *vfifo_device;
+static struct dentry *vfifo_debugfs_root;
+static LIST_HEAD(vfifo_list);
+static DEFINE_MUTEX(vfifo_list_lock);
+static DEFINE_IDA(vfifo_minors);
+static struct vfifo_dev *vfifo_minor_devs[VFIFO_MAX_DEVICES];   /* Under vfifo_list_lock */
 
 /* Prototypes */
 static int vfifo_open(struct inode *inode, struct file *filp);
@@ -62,6 +477,8 @@ static ssize_t vfifo_read(struct file *filp, char __user *buf, size_t count, lof
 static ssize_t vfifo_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
 static long vfifo_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 static int vfifo_mmap(struct file *filp, struct vm_area_struct *vma);
+static struct vfifo_dev *vfifo_dev_alloc_node(u32 capacity, int node, struct vfifo_dev *acct);
+static void vfifo_publish_held(struct vfifo_dev *dev);
 
 static struct file_operations vfifo_fops = {
     .owner = THIS_MODULE,
@@ -73,325 +490,4958 @@ static struct file_operations vfifo_fops = {
     .mmap = vfifo_mmap,
 };
 
-/* --- Sysfs Attributes --- */
+/* --- Ring Storage --- */
 
-/* Show current data size */
-static ssize_t size_show(struct device *dev, struct device_attribute *attr, char *buf)
-{
-    struct vfifo_dev *vdev = dev_get_drvdata(dev);
-    return sprintf(buf, "%d\n", vdev->size);
-}
-static DEVICE_ATTR_RO(size);
+/*
+ * Ring pages are shared out among all instances rather than owned for
+ * good. Each account (a device, together with its shards, queues and
+ * sessions) is charged for the pages it holds and hands them back when
+ * its ring shrinks or goes away, so an idle ring can be sized down and a
+ * busy one grown with VFIFO_RESIZE.
+ *
+ * With mem_limit set, all accounts together stay under it, and each is
+ * guaranteed a fair share of limit / accounts: a ring grows past its own
+ * share only into memory that no account still below its share could
+ * claim. A resize holds the old and the new ring at once while it copies,
+ * so it needs room for both.
+ *
+ * Freed pages go on a per-node free list (up to pool_keep of them) and are
+ * handed out again last in, first out: the next ring built on that node
+ * gets the pages most likely to still be in its caches. They are zeroed
+ * on the way out, as fresh pages are.
+ */
+static LIST_HEAD(vfifo_accounts);
+static DEFINE_MUTEX(vfifo_accounts_lock);
+static unsigned int vfifo_nr_accounts;
+static unsigned long vfifo_pages_used;
 
-/* Show buffer capacity */
-static ssize_t capacity_show(struct device *dev, struct device_attribute *attr, char *buf)
+/* Statically initialised: the KUnit suite may allocate before vfifo_init() */
+static struct {
+    struct page *top;       /* Linked through page_private(), newest first */
+    unsigned int nr;
+} vfifo_pool[MAX_NUMNODES];
+static DEFINE_SPINLOCK(vfifo_pool_lock);
+
+/* Make @dev an account of its own; until then it may not allocate */
+static void vfifo_account_add(struct vfifo_dev *dev)
 {
-    return sprintf(buf, "%d\n", buffer_size);
+    dev->pool_acct = dev;
+    mutex_lock(&vfifo_accounts_lock);
+    list_add_tail(&dev->pool_node, &vfifo_accounts);
+    vfifo_nr_accounts++;
+    mutex_unlock(&vfifo_accounts_lock);
 }
-static DEVICE_ATTR_RO(capacity);
 
-/* Show/Set auto-generate mode */
-static ssize_t mode_show(struct device *dev, struct device_attribute *attr, char *buf)
+/* Once everything charged to @dev has been uncharged */
+static void vfifo_account_del(struct vfifo_dev *dev)
 {
-    struct vfifo_dev *vdev = dev_get_drvdata(dev);
-    return sprintf(buf, "%d\n", vdev->auto_generate);
+    if (dev->pool_acct != dev)
+        return;
+    WARN_ON(dev->pool_pages);
+    mutex_lock(&vfifo_accounts_lock);
+    list_del(&dev->pool_node);
+    vfifo_nr_accounts--;
+    mutex_unlock(&vfifo_accounts_lock);
 }
 
-static ssize_t mode_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+static int vfifo_charge(struct vfifo_dev *acct, unsigned long nr)
 {
-    struct vfifo_dev *vdev = dev_get_drvdata(dev);
-    int val;
-    
-    if (kstrtoint(buf, 10, &val))
-        return -EINVAL;
+    unsigned long limit = READ_ONCE(mem_limit) >> PAGE_SHIFT;
+    unsigned long fair, held = 0;
+    struct vfifo_dev *other;
+    int ret = 0;
 
-    vdev->auto_generate = (val != 0);
-    if (vdev->auto_generate) {
-        mod_timer(&vdev->data_timer, jiffies + msecs_to_jiffies(1000));
-    } else {
-        del_timer(&vdev->data_timer);
+    mutex_lock(&vfifo_accounts_lock);
+    if (limit) {
+        /* What the others may still claim of their shares is not ours */
+        fair = vfifo_nr_accounts ? limit / vfifo_nr_accounts : limit;
+        list_for_each_entry(other, &vfifo_accounts, pool_node)
+            if (other != acct && other->pool_pages < fair)
+                held += fair - other->pool_pages;
+        if (vfifo_pages_used + held + nr > limit) {
+            ret = -ENOMEM;
+            goto out;
+        }
     }
-    return count;
+    acct->pool_pages += nr;
+    vfifo_pages_used += nr;
+out:
+    mutex_unlock(&vfifo_accounts_lock);
+    return ret;
 }
-static DEVICE_ATTR_RW(mode);
-
-static struct attribute *vfifo_attrs[] = {
-    &dev_attr_size.attr,
-    &dev_attr_capacity.attr,
-    &dev_attr_mode.attr,
-    NULL,
-};
-ATTRIBUTE_GROUPS(vfifo);
-
-/* --- Deferred Work Implementation --- */
 
-static void vfifo_work_handler(struct work_struct *work)
+static void vfifo_uncharge(struct vfifo_dev *acct, unsigned long nr)
 {
-    struct vfifo_dev *dev = container_of(work, struct vfifo_dev, data_work);
-    char *gen_data = "AUTO ";
-    int len = 5;
-    int i;
+    mutex_lock(&vfifo_accounts_lock);
+    acct->pool_pages -= nr;
+    vfifo_pages_used -= nr;
+    mutex_unlock(&vfifo_accounts_lock);
+}
 
-    if (mutex_lock_interruptible(&dev->lock))
-        return;
+/* A zeroed page, on @node if it has one to spare (NUMA_NO_NODE: the local node) */
+static struct page *vfifo_page_get(int node)
+{
+    int nid = node == NUMA_NO_NODE ? numa_mem_id() : node;
+    struct page *page;
 
-    if (buffer_size - dev->size >= len) {
-        for (i = 0; i < len; i++) {
-            dev->buffer[dev->head] = gen_data[i];
-            dev->head = (dev->head + 1) % buffer_size;
-            dev->size++;
-        }
-        wake_up_interruptible(&dev->read_queue);
+    spin_lock(&vfifo_pool_lock);
+    page = vfifo_pool[nid].top;
+    if (page) {
+        vfifo_pool[nid].top = (struct page *)page_private(page);
+        vfifo_pool[nid].nr--;
     }
+    spin_unlock(&vfifo_pool_lock);
 
-    mutex_unlock(&dev->lock);
+    if (!page)
+        return alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+    set_page_private(page, 0);
+    page_ref_unfreeze(page, 1);
+    clear_highpage(page);   /* The last ring's data is not the next one's business */
+    return page;
 }
 
-static void vfifo_timer_func(struct timer_list *t)
+static void vfifo_page_put(struct page *page)
 {
-    struct vfifo_dev *dev = container_of(t, struct vfifo_dev, data_timer);
-    schedule_work(&dev->data_work);
-    if (dev->auto_generate) {
-        mod_timer(&dev->data_timer, jiffies + msecs_to_jiffies(1000));
+    int nid = page_to_nid(page);
+
+    /*
+     * Pooled only if ours is the last reference; otherwise (get_user_pages(),
+     * a tee sink) whoever holds the page frees it. The count stays frozen at
+     * zero while it is pooled, so speculative references cannot take it.
+     */
+    if (page_ref_freeze(page, 1)) {
+        spin_lock(&vfifo_pool_lock);
+        if (vfifo_pool[nid].nr < READ_ONCE(pool_keep)) {
+            set_page_private(page, (unsigned long)vfifo_pool[nid].top);
+            vfifo_pool[nid].top = page;
+            vfifo_pool[nid].nr++;
+            page = NULL;
+        }
+        spin_unlock(&vfifo_pool_lock);
+        if (!page)
+            return;
+        page_ref_unfreeze(page, 1);
     }
+    __free_page(page);
 }
 
-/* --- File Operations --- */
-
-static int vfifo_mmap(struct file *filp, struct vm_area_struct *vma)
+/* At unload; every ring is gone by then */
+static void vfifo_pool_drain(void)
 {
-    struct vfifo_dev *dev = filp->private_data;
-    unsigned long pfn;
-    
-    /* We only support mapping the whole buffer */
-    if (vma->vm_end - vma->vm_start > buffer_size)
-        return -EINVAL;
-
-    /* Get Physical Frame Number of our kernel buffer */
-    /* virt_to_phys works for kzalloc/kmalloc memory */
-    pfn = virt_to_phys(dev->buffer) >> PAGE_SHIFT;
+    struct page *page;
+    int nid;
 
-    /* Remap the physical page to user space vma */
-    if (remap_pfn_range(vma, vma->vm_start, pfn, 
-                        vma->vm_end - vma->vm_start, 
-                        vma->vm_page_prot)) {
-        return -EAGAIN;
+    for_each_node(nid) {
+        while ((page = vfifo_pool[nid].top)) {
+            vfifo_pool[nid].top = (struct page *)page_private(page);
+            set_page_private(page, 0);
+            page_ref_unfreeze(page, 1);
+            __free_page(page);
+        }
+        vfifo_pool[nid].nr = 0;
     }
-
-    return 0;
 }
 
-static long vfifo_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+/*
+ * Allocate @capacity bytes of zeroed pages (on @node, or anywhere with
+ * NUMA_NO_NODE), charged to @dev's account, and map them twice, back to
+ * back. Copies then never split at the wrap, and vfifo_reserve() can hand
+ * kernel producers a plain pointer (the same trick as the BPF ring buffer).
+ */
+static unsigned char *vfifo_buf_alloc(struct vfifo_dev *dev, u32 capacity, int node,
+                                      struct page ***pagesp)
 {
-    struct vfifo_dev *dev = filp->private_data;
-    int ret = 0;
-    int val;
-
-    switch (cmd) {
-    case VFIFO_CLEAR:
-        if (mutex_lock_interruptible(&dev->lock))
-            return -ERESTARTSYS;
-        dev->head = 0;
-        dev->tail = 0;
-        dev->size = 0;
-        mutex_unlock(&dev->lock);
-        break;
+    unsigned int i, n = capacity >> PAGE_SHIFT;
+    struct page **pages;
+    unsigned char *vaddr;
 
-    case VFIFO_SET_MODE:
-        if (copy_from_user(&val, (int __user *)arg, sizeof(val)))
-            return -EFAULT;
-        dev->auto_generate = (val != 0);
-        if (dev->auto_generate)
-            mod_timer(&dev->data_timer, jiffies + msecs_to_jiffies(1000));
-        else
-            del_timer(&dev->data_timer);
-        break;
+    if (vfifo_charge(dev->pool_acct, n))
+        return NULL;
+    pages = kvzalloc_node(array_size(2 * n, sizeof(*pages)), GFP_KERNEL, node);
+    if (!pages)
+        goto uncharge;
 
-    default:
-        return -ENOTTY;
+    for (i = 0; i < n; i++) {
+        pages[i] = vfifo_page_get(node);
+        if (!pages[i])
+            goto fail;
+        pages[n + i] = pages[i];
     }
-    return ret;
+
+    vaddr = vmap(pages, 2 * n, VM_MAP, PAGE_KERNEL);
+    if (!vaddr)
+        goto fail;
+
+    *pagesp = pages;
+    return vaddr;
+
+fail:
+    while (i--)
+        vfifo_page_put(pages[i]);
+    kvfree(pages);
+uncharge:
+    vfifo_uncharge(dev->pool_acct, n);
+    return NULL;
 }
 
-static int vfifo_open(struct inode *inode, struct file *filp)
+static void vfifo_buf_free(struct vfifo_dev *dev, unsigned char *vaddr, struct page **pages,
+                           u32 capacity)
 {
-    struct vfifo_dev *dev = container_of(inode->i_cdev, struct vfifo_dev, cdev);
-    filp->private_data = dev;
-    return 0;
+    unsigned int i, n = capacity >> PAGE_SHIFT;
+
+    if (!vaddr)
+        return;
+    vunmap(vaddr);
+    for (i = 0; i < n; i++)
+        vfifo_page_put(pages[i]);
+    kvfree(pages);
+    vfifo_uncharge(dev->pool_acct, n);
 }
 
-static int vfifo_release(struct inode *inode, struct file *filp)
+/* Kernel address of ring position @pos; valid for up to 'capacity' bytes */
+static inline unsigned char *vfifo_ptr(struct vfifo_dev *dev, u32 pos)
 {
-    return 0;
+    return dev->buffer + vfifo_ring_offset(&dev->ring, pos);
 }
 
-static ssize_t vfifo_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
-{
-    struct vfifo_dev *dev = filp->private_data;
-    int i;
-    int ret = 0;
+/* --- Ring Helpers --- */
 
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+static inline u32 vfifo_used(struct vfifo_dev *dev)
+{
+    return vfifo_ring_used(&dev->ring);
+}
 
-    while (dev->size == 0) {
-        mutex_unlock(&dev->lock);
-        if (filp->f_flags & O_NONBLOCK)
-            return -EAGAIN;
-        if (wait_event_interruptible(dev->read_queue, (dev->size > 0)))
-            return -ERESTARTSYS;
-        if (mutex_lock_interruptible(&dev->lock))
-            return -ERESTARTSYS;
-    }
+static inline u32 vfifo_free(struct vfifo_dev *dev)
+{
+    return vfifo_ring_free(&dev->ring);
+}
 
-    if (count > dev->size)
-        count = dev->size;
+/* Queued (or free) bytes summed over all sub-rings, record headers included */
+static u32 vfifo_subs_level(struct vfifo_dev *dev, bool used)
+{
+    struct vfifo_subring *s;
+    unsigned int i;
+    u32 sum = 0;
 
-    for (i = 0; i < count; i++) {
-        if (copy_to_user(buf + i, &dev->buffer[dev->tail], 1)) {
-            ret = -EFAULT;
-            goto out;
-        }
-        dev->tail = (dev->tail + 1) % buffer_size;
-        dev->size--;
+    for (i = 0; i < dev->nr_subs; i++) {
+        s = dev->subs[i];
+        if (s)
+            sum += used ? vfifo_ring_used(&s->ring) : vfifo_ring_free(&s->ring);
     }
-    ret = count;
-    wake_up_interruptible(&dev->write_queue);
+    return sum;
+}
 
-out:
-    mutex_unlock(&dev->lock);
-    return ret;
+/* What 'size' and the eventfd watermarks measure, whatever the layout */
+static u32 vfifo_level(struct vfifo_dev *dev, bool used)
+{
+    if (dev->subs)
+        return vfifo_subs_level(dev, used);
+    /* Sinks: payload bytes, and free trefs as the pages they could hold */
+    if (dev->tee_sink)
+        return used ? atomic_long_read(&dev->tee_bytes) :
+                      vfifo_free(dev) / sizeof(struct vfifo_tref) * PAGE_SIZE;
+    /* Compressed: raw bytes queued, and free bytes of the compressed ring */
+    if (dev->lz4 && used)
+        return atomic_long_read(&dev->lz4_queued);
+    return used ? vfifo_used(dev) : vfifo_free(dev);
 }
 
-static ssize_t vfifo_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+/* One byte ring, exposed as is: mmap, the span ioctls and resize need this */
+static inline bool vfifo_is_plain(struct vfifo_dev *dev)
 {
-    struct vfifo_dev *dev = filp->private_data;
-    int free_space;
-    int i;
-    int ret = 0;
+    return !dev->subs && !dev->tee && !dev->tee_sink && !dev->lz4;
+}
 
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+/* Could a reservation of @len bytes succeed right now? (Wait condition) */
+static bool vfifo_can_reserve(struct vfifo_dev *dev, u32 len)
+{
+    return !READ_ONCE(dev->resizing) &&
+           READ_ONCE(dev->ring.wspans.count) < VFIFO_MAX_RESV &&
+           vfifo_free(dev) >= len;
+}
 
-    free_space = buffer_size - dev->size;
-    while (free_space == 0) {
-        mutex_unlock(&dev->lock);
-        if (filp->f_flags & O_NONBLOCK)
-            return -EAGAIN;
-        if (wait_event_interruptible(dev->write_queue, (buffer_size - dev->size) > 0))
-            return -ERESTARTSYS;
-        if (mutex_lock_interruptible(&dev->lock))
-            return -ERESTARTSYS;
-        free_space = buffer_size - dev->size;
-    }
+/* Could a reader claim @len bytes right now? (Wait condition) */
+static bool vfifo_can_claim(struct vfifo_dev *dev, u32 len)
+{
+    return !READ_ONCE(dev->resizing) &&
+           READ_ONCE(dev->ring.rspans.count) < VFIFO_MAX_RESV &&
+           vfifo_ring_avail(&dev->ring) >= len;
+}
 
-    if (count > free_space)
-        count = free_space;
+/* --- Futex Wait Words --- */
 
-    for (i = 0; i < count; i++) {
-        if (copy_from_user(&dev->buffer[dev->head], buf + i, 1)) {
-            ret = -EFAULT;
-            goto out;
-        }
-        dev->head = (dev->head + 1) % buffer_size;
-        dev->size++;
-    }
-    ret = count;
-    wake_up_interruptible(&dev->read_queue);
+/*
+ * The control page holds a data and a space sequence word that processes
+ * FUTEX_WAIT on (vfifo_uapi.h). Every commit and release moves the matching
+ * word on, after the positions moved: a consumer that read the old value
+ * and then found the ring empty fails its FUTEX_WAIT instead of sleeping
+ * through our data. Waking is left to user space, which is the only side
+ * that can issue FUTEX_WAKE; modules have no way to.
+ */
+static void vfifo_ctrl_bump(struct vfifo_dev *dev, bool data)
+{
+    struct vfifo_ctrl *ctrl = smp_load_acquire(&dev->ctrl);
 
-out:
-    mutex_unlock(&dev->lock);
-    return ret;
+    if (!ctrl)
+        return;
+    /* Ordered after the position update, and before the producer's return */
+    smp_mb__before_atomic();
+    atomic_inc((atomic_t *)(data ? &ctrl->data_seq : &ctrl->space_seq));
+    smp_mb__after_atomic();
 }
 
-/* --- Init and Exit --- */
+/* --- Readiness Notification (eventfd) --- */
 
-static int __init vfifo_init(void)
+static u32 vfifo_evt_level(struct vfifo_dev *dev, struct vfifo_evt *evt)
 {
-    int ret;
+    return vfifo_level(dev, evt == &dev->data_evt);
+}
 
-    printk(KERN_INFO "vfifo: Initializing Module 5 (Mmap & Sysfs)...\n");
+/*
+ * The level may have risen to the watermark: signal once if armed. Callers
+ * have just moved head or tail; the barrier orders that store against our
+ * read of 'armed', mirroring vfifo_evt_rearm(), so a crossing that races
+ * with re-arming is seen by at least one side.
+ */
+static void vfifo_evt_check(struct vfifo_dev *dev, struct vfifo_evt *evt)
+{
+    unsigned long flags;
 
-    ret = alloc_chrdev_region(&dev_num, 0, 1, "vfifo");
-    if (ret < 0) return ret;
+    smp_mb();
+    if (!atomic_read(&evt->armed) ||
+        vfifo_evt_level(dev, evt) < READ_ONCE(evt->watermark))
+        return;
+    if (!atomic_xchg(&evt->armed, 0))
+        return;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
-    vfifo_class = class_create("vfifo_class");
+    spin_lock_irqsave(&dev->evt_lock, flags);
+    evt->fired++;
+    if (evt->ctx)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+        eventfd_signal(evt->ctx);
 #else
-    vfifo_class = class_create(THIS_MODULE, "vfifo_class");
+        eventfd_signal(evt->ctx, 1);
 #endif
-    if (IS_ERR(vfifo_class)) {
-        unregister_chrdev_region(dev_num, 1);
-        return PTR_ERR(vfifo_class);
-    }
+    spin_unlock_irqrestore(&dev->evt_lock, flags);
+}
 
-    vfifo_device = kzalloc(sizeof(struct vfifo_dev), GFP_KERNEL);
-    if (!vfifo_device) {
-        class_destroy(vfifo_class);
-        unregister_chrdev_region(dev_num, 1);
-        return -ENOMEM;
-    }
+/* The level may have dropped below the watermark: arm the next signal */
+static void vfifo_evt_rearm(struct vfifo_dev *dev, struct vfifo_evt *evt)
+{
+    if (!READ_ONCE(evt->watermark) || atomic_read(&evt->armed))
+        return;
+    if (vfifo_evt_level(dev, evt) >= READ_ONCE(evt->watermark))
+        return;
+    atomic_set(&evt->armed, 1);
+    /* Re-check: the other side may have crossed back before seeing 'armed' */
+    vfifo_evt_check(dev, evt);
+}
 
-    /* Use PAGE_ALIGN to ensure buffer size is a multiple of page size for mmap */
-    buffer_size = PAGE_ALIGN(buffer_size);
-    vfifo_device->buffer = kzalloc(buffer_size, GFP_KERNEL);
-    if (!vfifo_device->buffer) {
-        kfree(vfifo_device);
-        class_destroy(vfifo_class);
-        unregister_chrdev_region(dev_num, 1);
-        return -ENOMEM;
-    }
+/* Committed data grew: wake blocked readers and data-available eventfd */
+static void vfifo_notify_readers(struct vfifo_dev *dev)
+{
+    vfifo_ctrl_bump(dev, true);
+    wake_up_interruptible(&dev->read_queue);
+    vfifo_evt_check(dev, &dev->data_evt);
+}
 
-    mutex_init(&vfifo_device->lock);
-    init_waitqueue_head(&vfifo_device->read_queue);
-    init_waitqueue_head(&vfifo_device->write_queue);
+/* Space was freed: wake blocked writers and space-available eventfd */
+static void vfifo_notify_writers(struct vfifo_dev *dev)
+{
+    if (READ_ONCE(dev->ring.hole_wait))
+        vfifo_publish_held(dev);
+    vfifo_ctrl_bump(dev, false);
+    wake_up_interruptible(&dev->write_queue);
+    vfifo_evt_check(dev, &dev->space_evt);
+}
 
-    timer_setup(&vfifo_device->data_timer, vfifo_timer_func, 0);
-    INIT_WORK(&vfifo_device->data_work, vfifo_work_handler);
-    vfifo_device->auto_generate = false;
+/*
+ * Swap in @ctx and arm it at @watermark (0: unregister); returns the
+ * eventfd it replaced, for the caller to put. A registration is live while
+ * its watermark is non-zero, so the re-arm path never looks at 'ctx'.
+ */
+static struct eventfd_ctx *vfifo_evt_register(struct vfifo_dev *dev, struct vfifo_evt *evt,
+                                              struct eventfd_ctx *ctx, struct file *filp,
+                                              u32 watermark)
+{
+    struct eventfd_ctx *old;
+    unsigned long flags;
 
-    cdev_init(&vfifo_device->cdev, &vfifo_fops);
-    vfifo_device->cdev.owner = THIS_MODULE;
+    spin_lock_irqsave(&dev->evt_lock, flags);
+    old = evt->ctx;
+    WRITE_ONCE(evt->ctx, ctx);
+    evt->owner = ctx ? filp : NULL;
+    WRITE_ONCE(evt->watermark, watermark);
+    atomic_set(&evt->armed, !!watermark);
+    spin_unlock_irqrestore(&dev->evt_lock, flags);
 
-    ret = cdev_add(&vfifo_device->cdev, dev_num, 1);
-    if (ret < 0) {
-        kfree(vfifo_device->buffer);
-        kfree(vfifo_device);
-        class_destroy(vfifo_class);
-        unregister_chrdev_region(dev_num, 1);
-        return ret;
+    /* The condition may hold already */
+    vfifo_evt_check(dev, evt);
+    return old;
+}
+
+static int vfifo_set_eventfd(struct vfifo_dev *dev, struct file *filp,
+                             const struct vfifo_eventfd *req)
+{
+    struct eventfd_ctx *ctx = NULL, *old;
+    struct vfifo_evt *evt;
+
+    if (req->event == VFIFO_EVENT_DATA)
+        evt = &dev->data_evt;
+    else if (req->event == VFIFO_EVENT_SPACE)
+        evt = &dev->space_evt;
+    else
+        return -EINVAL;
+
+    if (req->fd >= 0) {
+        ctx = eventfd_ctx_fdget(req->fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
     }
 
-    /* Create Device Node and Sysfs Attributes */
-    /* We pass 'vfifo_device' as drvdata so sysfs show/store functions can find it */
-    vfifo_device->dev = device_create_with_groups(vfifo_class, NULL, dev_num, 
-                                                  vfifo_device, vfifo_groups, "vfifo0");
-    if (IS_ERR(vfifo_device->dev)) {
-        cdev_del(&vfifo_device->cdev);
-        kfree(vfifo_device->buffer);
-        kfree(vfifo_device);
-        class_destroy(vfifo_class);
-        unregister_chrdev_region(dev_num, 1);
-        return PTR_ERR(vfifo_device->dev);
-    }
-
-    printk(KERN_INFO "vfifo: Registered device with Major %d\n", MAJOR(dev_num));
+    old = vfifo_evt_register(dev, evt, ctx, filp, ctx ? max(req->watermark, 1U) : 0);
+    if (old)
+        eventfd_ctx_put(old);
     return 0;
 }
 
-static void __exit vfifo_exit(void)
+/* Drop the registrations made through @filp (NULL: all of them) */
+static void vfifo_clear_eventfds(struct vfifo_dev *dev, struct file *filp)
 {
-    del_timer_sync(&vfifo_device->data_timer);
-    cancel_work_sync(&vfifo_device->data_work);
+    struct vfifo_evt *evts[] = { &dev->data_evt, &dev->space_evt };
+    struct eventfd_ctx *ctx;
+    unsigned long flags;
+    int i;
 
-    device_destroy(vfifo_class, dev_num);
-    cdev_del(&vfifo_device->cdev);
-    kfree(vfifo_device->buffer);
-    kfree(vfifo_device);
-    class_destroy(vfifo_class);
-    unregister_chrdev_region(dev_num, 1);
-    printk(KERN_INFO "vfifo: Module unloaded\n");
+    for (i = 0; i < ARRAY_SIZE(evts); i++) {
+        ctx = NULL;
+        spin_lock_irqsave(&dev->evt_lock, flags);
+        if (evts[i]->ctx && (!filp || evts[i]->owner == filp)) {
+            ctx = evts[i]->ctx;
+            WRITE_ONCE(evts[i]->ctx, NULL);
+            evts[i]->owner = NULL;
+            WRITE_ONCE(evts[i]->watermark, 0);
+            atomic_set(&evts[i]->armed, 0);
+        }
+        spin_unlock_irqrestore(&dev->evt_lock, flags);
+        if (ctx)
+            eventfd_ctx_put(ctx);
+    }
 }
 
-module_init(vfifo_init);
-module_exit(vfifo_exit);
+/* --- Lock Statistics --- */
+
+/*
+ * With CONFIG_VFIFO_LOCK_STAT (make LOCKSTAT=1), every acquisition of the
+ * device's locks records how long it waited for the lock and how long it
+ * then held it, per call site, as log2 histograms in debugfs
+ * (vfifo/<name>/lockstat; write 0 to it to start over). Two local_clock()
+ * reads per acquisition and a few counter increments under the lock just
+ * taken. Without the option the wrappers are the bare lock calls.
+ */
+#if IS_ENABLED(CONFIG_VFIFO_LOCK_STAT)
+static inline void vfifo_ls_add(u64 *hist, u64 *max, u64 ns)
+{
+    hist[min_t(int, ns ? ilog2(ns) : 0, VFIFO_LS_BUCKETS - 1)]++;
+    if (ns > *max)
+        *max = ns;
+}
+
+static inline u64 vfifo_ls_start(void)
+{
+    return local_clock();
+}
+
+static inline void vfifo_ls_acquired(struct vfifo_dev *dev, enum vfifo_lock_site site, u64 t0)
+{
+    struct vfifo_lock_stat *ls = &dev->lockstat[site];
+    u64 now = local_clock();
+
+    ls->count++;
+    vfifo_ls_add(ls->wait, &ls->wait_max, now - t0);
+    ls->since = now;
+}
+
+static inline void vfifo_ls_released(struct vfifo_dev *dev, enum vfifo_lock_site site)
+{
+    struct vfifo_lock_stat *ls = &dev->lockstat[site];
+
+    vfifo_ls_add(ls->hold, &ls->hold_max, local_clock() - ls->since);
+}
+#else
+#define vfifo_ls_start()                    0
+#define vfifo_ls_acquired(dev, site, t0)    do { (void)(t0); } while (0)
+#define vfifo_ls_released(dev, site)        do { } while (0)
+#endif
+
+#define vfifo_spin_lock_at(dev, lock, site, flags)      \
+    do {                                                \
+        u64 __t0 = vfifo_ls_start();                    \
+        spin_lock_irqsave(lock, flags);                 \
+        vfifo_ls_acquired(dev, site, __t0);             \
+    } while (0)
+
+#define vfifo_spin_unlock_at(dev, lock, site, flags)    \
+    do {                                                \
+        vfifo_ls_released(dev, site);                   \
+        spin_unlock_irqrestore(lock, flags);            \
+    } while (0)
+
+static inline void vfifo_lock_at(struct vfifo_dev *dev, enum vfifo_lock_site site)
+{
+    u64 t0 = vfifo_ls_start();
+
+    mutex_lock(&dev->lock);
+    vfifo_ls_acquired(dev, site, t0);
+}
+
+static inline int vfifo_lock_interruptible_at(struct vfifo_dev *dev, enum vfifo_lock_site site)
+{
+    u64 t0 = vfifo_ls_start();
+
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+    vfifo_ls_acquired(dev, site, t0);
+    return 0;
+}
+
+static inline void vfifo_unlock_at(struct vfifo_dev *dev, enum vfifo_lock_site site)
+{
+    vfifo_ls_released(dev, site);
+    mutex_unlock(&dev->lock);
+}
+
+/* --- Producer Side: Reserve / Commit --- */
+
+/*
+ * Claim @len bytes for a producer (see vfifo_ring_reserve()). This is the
+ * only step producers serialise on: the data copy happens afterwards,
+ * outside the lock.
+ */
+static int vfifo_reserve_span(struct vfifo_dev *dev, u32 len, bool partial,
+                              struct file *owner, struct vfifo_resv *out)
+{
+    unsigned long flags;
+    int ret;
+
+    vfifo_spin_lock_at(dev, &dev->resv_lock, VFIFO_LS_RESERVE, flags);
+    ret = dev->resizing ? -EAGAIN : vfifo_ring_reserve(&dev->ring, len, partial, owner, out);
+    vfifo_spin_unlock_at(dev, &dev->resv_lock, VFIFO_LS_RESERVE, flags);
+
+    if (ret == 0)
+        vfifo_evt_rearm(dev, &dev->space_evt);
+    return ret;
+}
+
+/* Hand a filled reservation to the readers, in reservation order */
+static int vfifo_commit_span(struct vfifo_dev *dev, u32 pos, struct file *owner)
+{
+    unsigned long flags;
+    bool was_full;
+    u32 head;
+    int ret;
+
+    vfifo_spin_lock_at(dev, &dev->resv_lock, VFIFO_LS_COMMIT, flags);
+    was_full = (dev->ring.wspans.count == VFIFO_MAX_RESV);
+    head = dev->ring.head;
+    write_seqcount_begin(&dev->prod_seq);
+    ret = vfifo_ring_commit(&dev->ring, pos, owner);
+    if (ret >= 0) {
+        dev->bytes_in += dev->ring.head - head;
+        dev->commits++;
+    }
+    write_seqcount_end(&dev->prod_seq);
+    vfifo_spin_unlock_at(dev, &dev->resv_lock, VFIFO_LS_COMMIT, flags);
+
+    if (ret <= 0)
+        return ret;
+    vfifo_notify_readers(dev);
+    /* Slot freed for a blocked producer, or a resize waiting for the drain */
+    if (was_full || READ_ONCE(dev->resizing))
+        wake_up_interruptible(&dev->write_queue);
+    return 0;
+}
+
+/*
+ * Give up a reservation that will never be filled properly. If it is the
+ * newest one the space is simply handed back; otherwise later spans are
+ * already claimed, so it stays in line as a hole that readers skip, and
+ * committed spans behind it can go out.
+ */
+static int vfifo_discard_span(struct vfifo_dev *dev, u32 pos, struct file *owner)
+{
+    unsigned long flags;
+    bool was_full, freed;
+    u32 head, reserve;
+    int ret;
+
+    vfifo_spin_lock_at(dev, &dev->resv_lock, VFIFO_LS_DISCARD, flags);
+    was_full = (dev->ring.wspans.count == VFIFO_MAX_RESV);
+    head = dev->ring.head;
+    reserve = dev->ring.reserve;
+    write_seqcount_begin(&dev->prod_seq);
+    ret = vfifo_ring_discard(&dev->ring, pos, owner);
+    dev->bytes_in += dev->ring.head - head;
+    write_seqcount_end(&dev->prod_seq);
+    freed = (dev->ring.reserve != reserve);
+    vfifo_spin_unlock_at(dev, &dev->resv_lock, VFIFO_LS_DISCARD, flags);
+
+    if (ret < 0)
+        return ret;
+    if (ret > 0)
+        vfifo_notify_readers(dev);
+    if (freed)
+        vfifo_notify_writers(dev);
+    else if (was_full || READ_ONCE(dev->resizing))
+        wake_up_interruptible(&dev->write_queue);
+    return 0;
+}
+
+/*
+ * Publish what a discarded span held back while the ring's hole queue was
+ * full (see vfifo_ring_publish()); readers have made room since.
+ */
+static void vfifo_publish_held(struct vfifo_dev *dev)
+{
+    unsigned long flags;
+    u32 head;
+    int ret;
+
+    vfifo_spin_lock_at(dev, &dev->resv_lock, VFIFO_LS_COMMIT, flags);
+    head = dev->ring.head;
+    write_seqcount_begin(&dev->prod_seq);
+    ret = vfifo_ring_publish(&dev->ring);
+    dev->bytes_in += dev->ring.head - head;
+    write_seqcount_end(&dev->prod_seq);
+    vfifo_spin_unlock_at(dev, &dev->resv_lock, VFIFO_LS_COMMIT, flags);
+
+    if (ret > 0)
+        vfifo_notify_readers(dev);
+}
+
+/* Drop every reservation @owner still holds (called when the fd is closed) */
+static void vfifo_abandon_reservations(struct vfifo_dev *dev, struct file *owner)
+{
+    struct vfifo_resv *r;
+    unsigned long flags;
+    unsigned int i;
+    bool found;
+    u32 pos;
+
+    do {
+        found = false;
+        spin_lock_irqsave(&dev->resv_lock, flags);
+        /* Newest first, so each one can simply be handed back */
+        for (i = dev->ring.wspans.count; i > 0; i--) {
+            r = vfifo_spans_at(&dev->ring.wspans, i - 1);
+            if (r->busy && r->owner == owner) {
+                pos = r->pos;
+                found = true;
+                break;
+            }
+        }
+        spin_unlock_irqrestore(&dev->resv_lock, flags);
+        if (found)
+            vfifo_discard_span(dev, pos, owner);
+    } while (found);
+}
+
+/* --- Consumer Side: Claim / Release --- */
+
+/*
+ * vfifo_ring_claim() and vfifo_ring_peek() on the device ring. Stepping
+ * over holes releases their bytes, so these count for the status too and
+ * set *moved if 'tail' moved. Under cons_lock.
+ */
+static int vfifo_ring_claim_counted(struct vfifo_dev *dev, u32 len, bool partial,
+                                    struct vfifo_resv *out, int *moved)
+{
+    u32 tail = dev->ring.tail;
+    int ret;
+
+    write_seqcount_begin(&dev->cons_seq);
+    ret = vfifo_ring_claim(&dev->ring, len, partial, out);
+    dev->bytes_out += dev->ring.tail - tail;
+    write_seqcount_end(&dev->cons_seq);
+    *moved |= (dev->ring.tail != tail);
+    return ret;
+}
+
+static u32 vfifo_ring_peek_counted(struct vfifo_dev *dev, u32 *pos, int *moved)
+{
+    u32 tail = dev->ring.tail;
+    u32 len;
+
+    write_seqcount_begin(&dev->cons_seq);
+    len = vfifo_ring_peek(&dev->ring, pos);
+    dev->bytes_out += dev->ring.tail - tail;
+    write_seqcount_end(&dev->cons_seq);
+    *moved |= (dev->ring.tail != tail);
+    return len;
+}
+
+/*
+ * Claim up to @len committed bytes for a reader (exactly @len unless
+ * @partial). Readers copy out of their claim unlocked, in parallel with
+ * each other, and then release it.
+ */
+static int vfifo_claim_span(struct vfifo_dev *dev, u32 len, bool partial, struct vfifo_resv *out)
+{
+    unsigned long flags;
+    int ret = -EAGAIN, moved = 0;
+
+    vfifo_spin_lock_at(dev, &dev->cons_lock, VFIFO_LS_CLAIM, flags);
+    if (!dev->resizing)
+        ret = vfifo_ring_claim_counted(dev, len, partial, out, &moved);
+    vfifo_spin_unlock_at(dev, &dev->cons_lock, VFIFO_LS_CLAIM, flags);
+
+    if (moved)
+        vfifo_notify_writers(dev);
+    return ret;
+}
+
+/* vfifo_ring_release() on the device ring, counted for the status. Under cons_lock. */
+static int vfifo_ring_release_counted(struct vfifo_dev *dev, u32 pos, u32 done)
+{
+    u32 tail = dev->ring.tail, lost = dev->ring.lost;
+    int ret;
+
+    write_seqcount_begin(&dev->cons_seq);
+    ret = vfifo_ring_release(&dev->ring, pos, done);
+    if (ret >= 0) {
+        dev->bytes_out += dev->ring.tail - tail;
+        dev->releases++;
+    }
+    write_seqcount_end(&dev->cons_seq);
+    dev->lost += dev->ring.lost - lost;
+    return ret;
+}
+
+/* Release a claim after reading @done of its bytes (see vfifo_ring_release()) */
+static void vfifo_release_span(struct vfifo_dev *dev, u32 pos, u32 done)
+{
+    unsigned long flags;
+    int ret;
+
+    vfifo_spin_lock_at(dev, &dev->cons_lock, VFIFO_LS_RELEASE, flags);
+    ret = vfifo_ring_release_counted(dev, pos, done);
+    vfifo_spin_unlock_at(dev, &dev->cons_lock, VFIFO_LS_RELEASE, flags);
+
+    WARN_ON(ret < 0);
+    if (ret > 0) {
+        vfifo_notify_writers(dev);
+        vfifo_evt_rearm(dev, &dev->data_evt);
+    } else if (READ_ONCE(dev->resizing)) {
+        /* A claim given back unread leaves without moving 'tail'; a resize may wait for it */
+        wake_up_interruptible(&dev->write_queue);
+    }
+}
+
+/* First readable (unclaimed) byte and how many follow it */
+static u32 vfifo_peek_span(struct vfifo_dev *dev, u32 *pos)
+{
+    unsigned long flags;
+    int moved = 0;
+    u32 len = 0;
+
+    vfifo_spin_lock_at(dev, &dev->cons_lock, VFIFO_LS_PEEK, flags);
+    if (!dev->resizing)
+        len = vfifo_ring_peek_counted(dev, pos, &moved);
+    vfifo_spin_unlock_at(dev, &dev->cons_lock, VFIFO_LS_PEEK, flags);
+
+    if (moved)
+        vfifo_notify_writers(dev);
+    return len;
+}
+
+/* --- Record Rings --- */
+
+/*
+ * Sharded and multi-queue instances keep their data in several sub-rings
+ * (dev->subs) instead of the one byte-stream ring. Each write becomes one
+ * record in one sub-ring, so readers can take whole writes from any of
+ * them without tearing. The producer side of a sub-ring has its own lock;
+ * the consumer side uses *cons_lock, which shards share and queues do not.
+ */
+
+static void vfifo_subring_free(struct vfifo_dev *dev, struct vfifo_subring *s)
+{
+    vfifo_buf_free(dev, s->buffer, s->pages, s->ring.capacity);
+    s->buffer = NULL;
+}
+
+static int vfifo_subring_init(struct vfifo_dev *dev, struct vfifo_subring *s,
+                              u32 capacity, int node,
+                              spinlock_t *cons_lock, wait_queue_head_t *read_wq,
+                              wait_queue_head_t *write_wq)
+{
+    spin_lock_init(&s->lock);
+    s->cons_lock = cons_lock;
+    s->read_wq = read_wq;
+    s->write_wq = write_wq;
+    vfifo_ring_init(&s->ring, capacity, 0);
+    s->buffer = vfifo_buf_alloc(dev, capacity, node, &s->pages);
+    return s->buffer ? 0 : -ENOMEM;
+}
+
+static void vfifo_queue_put(struct vfifo_subring *s);
+
+static void vfifo_subs_free(struct vfifo_dev *dev)
+{
+    struct vfifo_subring *s;
+    unsigned int i;
+
+    if (!dev->subs)
+        return;
+    for (i = 0; i < dev->nr_subs; i++) {
+        s = dev->subs[i];
+        if (!s)
+            continue;
+        /* Now, while the account is alive: a queue may outlast the device */
+        vfifo_subring_free(dev, s);
+        if (dev->sharding)
+            kfree(s);
+        else
+            vfifo_queue_put(s);
+    }
+    kfree(dev->subs);
+    dev->subs = NULL;
+    dev->nr_subs = 0;
+    dev->nr_queues = 0;
+    dev->nr_lanes = 0;
+    dev->sharding = VFIFO_SHARD_OFF;
+}
+
+/* Largest payload a single record can carry; longer writes are cut short */
+static inline u32 vfifo_rec_max(struct vfifo_dev *dev)
+{
+    return dev->ring.capacity - sizeof(struct vfifo_rec);
+}
+
+/* Are record keys enqueue times (so dequeue can measure latency)? */
+static inline bool vfifo_rec_timed(struct vfifo_dev *dev)
+{
+    return dev->sharding == VFIFO_SHARD_TIMESTAMP || dev->nr_lanes;
+}
+
+static inline struct vfifo_rec *vfifo_rec_at(struct vfifo_subring *s, u32 pos)
+{
+    return (struct vfifo_rec *)(s->buffer + vfifo_ring_offset(&s->ring, pos));
+}
+
+/* Could @s take a record of @len bytes right now? (Wait condition) */
+static bool vfifo_rec_can_reserve(struct vfifo_subring *s, u32 len)
+{
+    return READ_ONCE(s->ring.wspans.count) < VFIFO_MAX_RESV &&
+           vfifo_ring_free(&s->ring) >= vfifo_rec_size(len);
+}
+
+/* Is there a record to read in any sub-ring? (Wait condition) */
+static bool vfifo_subs_readable(struct vfifo_dev *dev)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->nr_subs; i++)
+        if (dev->subs[i] && vfifo_ring_avail(&dev->subs[i]->ring))
+            return true;
+    return false;
+}
+
+/*
+ * Only touch a shared wait queue lock when somebody actually sleeps on it;
+ * otherwise every commit would bounce it between the producing CPUs.
+ */
+static void vfifo_wake_sleepers(wait_queue_head_t *wq)
+{
+    if (wq_has_sleeper(wq))
+        wake_up_interruptible(wq);
+}
+
+/* Reserve a record of @len payload bytes in @s and stamp its header */
+static int vfifo_rec_reserve(struct vfifo_dev *dev, struct vfifo_subring *s, u32 len,
+                             struct vfifo_resv *out)
+{
+    struct vfifo_rec *rec;
+    unsigned long flags;
+    int ret;
+
+    if (len == 0 || len > vfifo_rec_max(dev))
+        return -EINVAL;
+
+    spin_lock_irqsave(&s->lock, flags);
+    ret = vfifo_ring_reserve(&s->ring, vfifo_rec_size(len), false, NULL, out);
+    if (ret == 0) {
+        rec = vfifo_rec_at(s, out->pos);
+        rec->len = len;
+        rec->flags = 0;
+        /* Stamped under the lock, so keys only grow along each sub-ring */
+        if (dev->sharding == VFIFO_SHARD_SEQUENCE)
+            rec->key = atomic64_inc_return(&dev->shard_seq);
+        else if (vfifo_rec_timed(dev))
+            rec->key = ktime_get_ns();
+        else
+            rec->key = 0;
+        s->enqueued++;
+        s->bytes_in += len;
+    } else {
+        s->full++;
+    }
+    spin_unlock_irqrestore(&s->lock, flags);
+
+    if (ret == 0)
+        vfifo_evt_rearm(dev, &dev->space_evt);
+    return ret;
+}
+
+static void vfifo_rec_commit(struct vfifo_dev *dev, struct vfifo_subring *s, u32 pos)
+{
+    unsigned long flags;
+    bool was_full;
+    int ret;
+
+    spin_lock_irqsave(&s->lock, flags);
+    was_full = (s->ring.wspans.count == VFIFO_MAX_RESV);
+    ret = vfifo_ring_commit(&s->ring, pos, NULL);
+    spin_unlock_irqrestore(&s->lock, flags);
+
+    WARN_ON(ret < 0);
+    if (ret > 0) {
+        vfifo_ctrl_bump(dev, true);
+        vfifo_wake_sleepers(s->read_wq);
+        /* Readers not bound to a queue wait on the device */
+        if (s->read_wq != &dev->read_queue)
+            vfifo_wake_sleepers(&dev->read_queue);
+        vfifo_evt_check(dev, &dev->data_evt);
+    }
+    if (was_full)
+        vfifo_wake_sleepers(s->write_wq);
+}
+
+static int vfifo_rec_enqueue(struct vfifo_dev *dev, struct vfifo_subring *s,
+                             const void *data, size_t len)
+{
+    struct vfifo_resv r;
+    int ret;
+
+    if (len > U32_MAX)
+        return -EINVAL;
+    ret = vfifo_rec_reserve(dev, s, len, &r);
+    if (ret)
+        return ret;
+
+    memcpy(vfifo_rec_at(s, r.pos) + 1, data, len);
+    vfifo_rec_commit(dev, s, r.pos);
+    return 0;
+}
+
+static struct vfifo_subring *vfifo_subs_next(struct vfifo_dev *dev, struct vfifo_rec *hdr);
+
+/*
+ * Move whole records into @kbuf (or the user buffer @ubuf) until the next
+ * one does not fit: from @only, or from the shards or lanes (whichever the
+ * device has, in their order) if @only is NULL.
+ * Returns the payload bytes copied, -EAGAIN if nothing is queued, or
+ * -EMSGSIZE if the first record is larger than @len.
+ */
+static ssize_t vfifo_rec_dequeue(struct vfifo_dev *dev, struct vfifo_subring *only,
+                                 char *kbuf, char __user *ubuf, size_t len)
+{
+    spinlock_t *lock = only ? only->cons_lock : &dev->cons_lock;
+    struct vfifo_subring *s;
+    struct vfifo_rec hdr;
+    struct vfifo_resv r;
+    unsigned long flags, left = 0;
+    size_t done = 0;
+    void *payload;
+    int ret, moved;
+    u32 pos, lost;
+
+    for (;;) {
+        spin_lock_irqsave(lock, flags);
+        if (!only)
+            s = vfifo_subs_next(dev, &hdr);
+        else if (vfifo_ring_peek(&only->ring, &pos))
+            s = only, hdr = *vfifo_rec_at(only, pos);
+        else
+            s = NULL;
+
+        if (!s)
+            ret = -EAGAIN;
+        else if (!(hdr.flags & VFIFO_REC_SKIP) && hdr.len > len - done)
+            ret = -EMSGSIZE;
+        else
+            ret = vfifo_ring_claim(&s->ring, vfifo_rec_size(hdr.len), false, &r);
+        /* A weighted round robin turn is used up by records taken, not looked at */
+        if (!ret && !only && dev->lane_credit)
+            dev->lane_credit--;
+        spin_unlock_irqrestore(lock, flags);
+        if (ret)
+            break;
+
+        /* Copied unlocked, like any claim */
+        if (!(hdr.flags & VFIFO_REC_SKIP)) {
+            payload = vfifo_rec_at(s, r.pos) + 1;
+            if (ubuf)
+                left = copy_to_user(ubuf + done, payload, hdr.len);
+            else
+                memcpy(kbuf + done, payload, hdr.len);
+        }
+
+        /* A record we failed to copy stays queued, if nobody claimed past it */
+        spin_lock_irqsave(lock, flags);
+        lost = s->ring.lost;
+        moved = vfifo_ring_release(&s->ring, r.pos, left ? 0 : r.len);
+        s->lost += s->ring.lost - lost;
+        if (!left) {
+            s->dequeued++;
+            s->bytes_out += hdr.len;
+            if (vfifo_rec_timed(dev)) {
+                u64 lat = ktime_get_ns() - hdr.key;
+
+                s->lat_sum += lat;
+                s->lat_max = max(s->lat_max, lat);
+            }
+        }
+        spin_unlock_irqrestore(lock, flags);
+        if (moved > 0) {
+            vfifo_ctrl_bump(dev, false);
+            vfifo_wake_sleepers(s->write_wq);
+            vfifo_evt_check(dev, &dev->space_evt);
+            vfifo_evt_rearm(dev, &dev->data_evt);
+        }
+
+        if (left) {
+            ret = -EFAULT;
+            break;
+        }
+        if (!(hdr.flags & VFIFO_REC_SKIP))
+            done += hdr.len;
+    }
+    return done ? done : ret;
+}
+
+/* Drop every committed record in every sub-ring */
+static void vfifo_subs_clear(struct vfifo_dev *dev)
+{
+    struct vfifo_subring *s;
+    struct vfifo_resv r;
+    unsigned long flags;
+    unsigned int i;
+
+    for (i = 0; i < dev->nr_subs; i++) {
+        s = dev->subs[i];
+        if (!s)
+            continue;
+        spin_lock_irqsave(s->cons_lock, flags);
+        if (vfifo_ring_claim(&s->ring, s->ring.capacity, true, &r) == 0)
+            vfifo_ring_release(&s->ring, r.pos, r.len);
+        spin_unlock_irqrestore(s->cons_lock, flags);
+        vfifo_wake_sleepers(s->write_wq);
+    }
+    vfifo_notify_writers(dev);
+}
+
+/* --- Per-CPU Shards --- */
+
+/*
+ * With sharding on, there is one sub-ring per CPU and producers use the
+ * one of the CPU they run on, so producers on different CPUs share no lock
+ * and no cache line (the idea behind ftrace's per-CPU buffers). Readers
+ * drain all shards under dev->cons_lock, either in whatever order records
+ * come (unordered) or merged by the key stamped at reservation: a
+ * timestamp, or a global sequence number that is exact but is the one
+ * shared counter.
+ *
+ * Merging only orders records that are already committed: one still being
+ * filled on another CPU can be overtaken by a later one, like in ftrace.
+ */
+
+/* Give every possible CPU a ring of 'capacity' bytes on its own node */
+static int vfifo_shards_alloc(struct vfifo_dev *dev, enum vfifo_sharding mode)
+{
+    struct vfifo_subring *s;
+    int cpu;
+
+    if (mode == VFIFO_SHARD_OFF)
+        return 0;
+
+    dev->subs = kcalloc(nr_cpu_ids, sizeof(*dev->subs), GFP_KERNEL);
+    if (!dev->subs)
+        return -ENOMEM;
+    dev->nr_subs = nr_cpu_ids;
+    dev->sharding = mode;       /* So vfifo_subs_free() knows what it frees */
+
+    for_each_possible_cpu(cpu) {
+        s = kzalloc_node(sizeof(*s), GFP_KERNEL, cpu_to_node(cpu));
+        if (!s)
+            goto fail;
+        dev->subs[cpu] = s;
+        if (vfifo_subring_init(dev, s, dev->ring.capacity, cpu_to_node(cpu), &dev->cons_lock,
+                               &dev->read_queue, &dev->write_queue))
+            goto fail;
+    }
+    atomic64_set(&dev->shard_seq, 0);
+    return 0;
+
+fail:
+    vfifo_subs_free(dev);
+    return -ENOMEM;
+}
+
+/*
+ * The current CPU's shard. The caller may migrate right after: the record
+ * simply stays in the shard it was reserved in, and is committed there.
+ */
+static inline struct vfifo_subring *vfifo_this_shard(struct vfifo_dev *dev)
+{
+    return dev->subs[raw_smp_processor_id()];
+}
+
+/*
+ * Under cons_lock: the shard whose oldest record is read next, with a copy
+ * of that record's header, or NULL if every shard is empty. Unordered
+ * reads go round robin; merged reads pick the smallest key.
+ */
+static struct vfifo_subring *vfifo_shard_next(struct vfifo_dev *dev, struct vfifo_rec *hdr)
+{
+    struct vfifo_subring *s, *best = NULL;
+    struct vfifo_rec *rec;
+    unsigned int i, cpu;
+    u32 pos;
+
+    for (i = 0; i < dev->nr_subs; i++) {
+        cpu = (dev->sub_next + i) % dev->nr_subs;
+        s = dev->subs[cpu];
+        if (!s || !vfifo_ring_peek(&s->ring, &pos))
+            continue;
+        rec = vfifo_rec_at(s, pos);
+        if (dev->sharding == VFIFO_SHARD_UNORDERED) {
+            dev->sub_next = cpu + 1;
+            *hdr = *rec;
+            return s;
+        }
+        if (!best || rec->key < hdr->key) {
+            best = s;
+            *hdr = *rec;
+        }
+    }
+    return best;
+}
+
+/* --- Multi-Queue --- */
+
+/*
+ * A multi-queue instance (nr_queues=M) has M sub-rings behind one device
+ * node, like the hardware queues of blk-mq or a multi-queue NIC. Each queue
+ * has its own locks, wait queues and statistics. Writes are steered to a
+ * queue by a hash of their flow key, so one flow always lands in the same
+ * queue and stays in order. An fd bound to a queue (VFIFO_BIND_QUEUE) reads
+ * only that queue; unbound readers take the queues round robin.
+ */
+
+static inline struct vfifo_queue *vfifo_to_queue(struct vfifo_subring *s)
+{
+    return container_of(s, struct vfifo_queue, sub);
+}
+
+/* Frees the queue once sysfs is done with it too; its ring is gone already */
+static void vfifo_queue_release(struct kobject *kobj)
+{
+    kfree(container_of(kobj, struct vfifo_queue, kobj));
+}
+
+static void vfifo_queue_put(struct vfifo_subring *s)
+{
+    kobject_put(&vfifo_to_queue(s)->kobj);
+}
+
+#define VFIFO_QUEUE_ATTR(name, expr)                                            \
+static ssize_t vfifo_queue_##name##_show(struct kobject *kobj,                  \
+                                         struct kobj_attribute *attr, char *buf) \
+{                                                                               \
+    struct vfifo_subring *s = &container_of(kobj, struct vfifo_queue, kobj)->sub; \
+    return sprintf(buf, "%llu\n", (unsigned long long)(expr));                  \
+}                                                                               \
+static struct kobj_attribute vfifo_queue_attr_##name =                          \
+    __ATTR(name, 0444, vfifo_queue_##name##_show, NULL)
+
+/* queues/qN/: occupancy and counters of one queue */
+VFIFO_QUEUE_ATTR(size, vfifo_ring_used(&s->ring));
+VFIFO_QUEUE_ATTR(enqueued, READ_ONCE(s->enqueued));
+VFIFO_QUEUE_ATTR(bytes_in, READ_ONCE(s->bytes_in));
+VFIFO_QUEUE_ATTR(full, READ_ONCE(s->full));
+VFIFO_QUEUE_ATTR(dequeued, READ_ONCE(s->dequeued));
+VFIFO_QUEUE_ATTR(bytes_out, READ_ONCE(s->bytes_out));
+
+static struct attribute *vfifo_queue_attrs[] = {
+    &vfifo_queue_attr_size.attr,
+    &vfifo_queue_attr_enqueued.attr,
+    &vfifo_queue_attr_bytes_in.attr,
+    &vfifo_queue_attr_full.attr,
+    &vfifo_queue_attr_dequeued.attr,
+    &vfifo_queue_attr_bytes_out.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(vfifo_queue);
+
+static const struct kobj_type vfifo_queue_ktype = {
+    .release = vfifo_queue_release,
+    .sysfs_ops = &kobj_sysfs_ops,
+    .default_groups = vfifo_queue_groups,
+};
+
+/* lanes/laneN/: the same, plus enqueue-to-dequeue latency and the WRR weight */
+VFIFO_QUEUE_ATTR(latency_avg_ns, READ_ONCE(s->dequeued) ?
+                 div64_u64(READ_ONCE(s->lat_sum), READ_ONCE(s->dequeued)) : 0);
+VFIFO_QUEUE_ATTR(latency_max_ns, READ_ONCE(s->lat_max));
+
+static ssize_t vfifo_lane_weight_show(struct kobject *kobj, struct kobj_attribute *attr,
+                                      char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(container_of(kobj, struct vfifo_queue, kobj)->weight));
+}
+
+static ssize_t vfifo_lane_weight_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                       const char *buf, size_t count)
+{
+    u32 val;
+
+    if (kstrtou32(buf, 10, &val) || val == 0)
+        return -EINVAL;
+    WRITE_ONCE(container_of(kobj, struct vfifo_queue, kobj)->weight, val);
+    return count;
+}
+static struct kobj_attribute vfifo_lane_attr_weight =
+    __ATTR(weight, 0644, vfifo_lane_weight_show, vfifo_lane_weight_store);
+
+static struct attribute *vfifo_lane_attrs[] = {
+    &vfifo_queue_attr_size.attr,
+    &vfifo_queue_attr_enqueued.attr,
+    &vfifo_queue_attr_bytes_in.attr,
+    &vfifo_queue_attr_full.attr,
+    &vfifo_queue_attr_dequeued.attr,
+    &vfifo_queue_attr_bytes_out.attr,
+    &vfifo_queue_attr_latency_avg_ns.attr,
+    &vfifo_queue_attr_latency_max_ns.attr,
+    &vfifo_lane_attr_weight.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(vfifo_lane);
+
+static const struct kobj_type vfifo_lane_ktype = {
+    .release = vfifo_queue_release,
+    .sysfs_ops = &kobj_sysfs_ops,
+    .default_groups = vfifo_lane_groups,
+};
+
+/*
+ * @nr queues, or with @lanes, @nr priority lanes. Lanes are read through
+ * the device's consumer lock and wait queue; only their writers wait apart.
+ */
+static int vfifo_queues_alloc(struct vfifo_dev *dev, u32 nr, bool lanes)
+{
+    struct vfifo_queue *q;
+    unsigned int i;
+
+    if (nr == 0)
+        return 0;
+
+    dev->subs = kcalloc(nr, sizeof(*dev->subs), GFP_KERNEL);
+    if (!dev->subs)
+        return -ENOMEM;
+    dev->nr_subs = nr;
+    if (lanes)
+        dev->nr_lanes = nr;
+    else
+        dev->nr_queues = nr;
+
+    for (i = 0; i < nr; i++) {
+        q = kzalloc_node(sizeof(*q), GFP_KERNEL, dev->numa_node);
+        if (!q)
+            goto fail;
+        kobject_init(&q->kobj, lanes ? &vfifo_lane_ktype : &vfifo_queue_ktype);
+        dev->subs[i] = &q->sub;
+        spin_lock_init(&q->cons_lock);
+        init_waitqueue_head(&q->read_queue);
+        init_waitqueue_head(&q->write_queue);
+        /* Each lane gets twice the turn of the one below it */
+        q->weight = 1U << (nr - 1 - i);
+        if (vfifo_subring_init(dev, &q->sub, dev->ring.capacity, dev->numa_node,
+                               lanes ? &dev->cons_lock : &q->cons_lock,
+                               lanes ? &dev->read_queue : &q->read_queue, &q->write_queue))
+            goto fail;
+    }
+    if (lanes)
+        dev->lane_credit = vfifo_to_queue(dev->subs[0])->weight;
+    return 0;
+
+fail:
+    vfifo_subs_free(dev);
+    return -ENOMEM;
+}
+
+/* Publish queues/q0..qN-1 (or lanes/lane0..laneN-1) under the device's sysfs directory */
+static int vfifo_queues_sysfs_add(struct vfifo_dev *dev)
+{
+    const char *fmt = dev->nr_lanes ? "lane%u" : "q%u";
+    unsigned int i;
+    int ret;
+
+    if (!dev->nr_queues && !dev->nr_lanes)
+        return 0;
+    dev->subs_kobj = kobject_create_and_add(dev->nr_lanes ? "lanes" : "queues",
+                                            &dev->dev->kobj);
+    if (!dev->subs_kobj)
+        return -ENOMEM;
+    for (i = 0; i < dev->nr_subs; i++) {
+        ret = kobject_add(&vfifo_to_queue(dev->subs[i])->kobj, dev->subs_kobj, fmt, i);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/* Safe on a partly added set; the queues themselves live until vfifo_put() */
+static void vfifo_queues_sysfs_del(struct vfifo_dev *dev)
+{
+    unsigned int i;
+
+    if (!dev->subs_kobj)
+        return;
+    for (i = 0; i < dev->nr_subs; i++)
+        kobject_del(&vfifo_to_queue(dev->subs[i])->kobj);
+    kobject_put(dev->subs_kobj);
+    dev->subs_kobj = NULL;
+}
+
+/* --- Priority Lanes --- */
+
+/*
+ * With nr_lanes=N, one device has N lanes, lane 0 the most urgent. Each
+ * write picks its lane (VFIFO_SET_LANE, or a header per write) and each
+ * lane is a ring of its own with its own producer lock, so a full bulk
+ * lane never holds up writers to a control lane. Readers pick the next
+ * record under dev->cons_lock, either strictly by priority or by weighted
+ * round robin ('weight' records per lane per turn, so bulk lanes cannot
+ * starve). Occupancy, counters and latency are in lanes/laneN/.
+ */
+
+/* Under cons_lock: the lane to read next and its oldest record's header */
+static struct vfifo_subring *vfifo_lane_next(struct vfifo_dev *dev, struct vfifo_rec *hdr)
+{
+    struct vfifo_subring *s;
+    unsigned int i, n;
+    u32 pos;
+
+    if (!dev->lane_wrr) {
+        for (i = 0; i < dev->nr_lanes; i++) {
+            s = dev->subs[i];
+            if (vfifo_ring_peek(&s->ring, &pos)) {
+                *hdr = *vfifo_rec_at(s, pos);
+                return s;
+            }
+        }
+        return NULL;
+    }
+
+    /* Stay on a lane while it has data and credit, then move on and refill */
+    for (i = 0; i <= dev->nr_lanes; i++) {
+        n = dev->sub_next % dev->nr_lanes;
+        s = dev->subs[n];
+        if (dev->lane_credit && vfifo_ring_peek(&s->ring, &pos)) {
+            *hdr = *vfifo_rec_at(s, pos);
+            return s;
+        }
+        dev->sub_next = (n + 1) % dev->nr_lanes;
+        dev->lane_credit = READ_ONCE(vfifo_to_queue(dev->subs[dev->sub_next])->weight);
+    }
+    return NULL;
+}
+
+/* Under the consumer lock: the next record of a shard or lane device */
+static struct vfifo_subring *vfifo_subs_next(struct vfifo_dev *dev, struct vfifo_rec *hdr)
+{
+    return dev->nr_lanes ? vfifo_lane_next(dev, hdr) : vfifo_shard_next(dev, hdr);
+}
+
+/* The queue a flow key is steered to */
+static inline struct vfifo_subring *vfifo_queue_of(struct vfifo_dev *dev, u32 flow)
+{
+    return dev->subs[reciprocal_scale(hash_32(flow, 32), dev->nr_queues)];
+}
+
+/* For an unbound reader: the next queue with data, round robin (a hint) */
+static struct vfifo_subring *vfifo_queue_pick(struct vfifo_dev *dev)
+{
+    unsigned int i, n, start = READ_ONCE(dev->sub_next);
+
+    for (i = 0; i < dev->nr_queues; i++) {
+        n = (start + i) % dev->nr_queues;
+        if (vfifo_ring_avail(&dev->subs[n]->ring)) {
+            WRITE_ONCE(dev->sub_next, n + 1);
+            return dev->subs[n];
+        }
+    }
+    return NULL;
+}
+
+/* --- Sub-Ring File I/O --- */
+
+/*
+ * Where a record with @key goes: its lane (out of range means the lowest),
+ * its flow's queue, or this CPU's shard
+ */
+static struct vfifo_subring *vfifo_rec_target(struct vfifo_dev *dev, u32 key)
+{
+    if (dev->nr_lanes)
+        return dev->subs[min(key, dev->nr_lanes - 1)];
+    return dev->nr_queues ? vfifo_queue_of(dev, key) : vfifo_this_shard(dev);
+}
+
+static ssize_t vfifo_rec_write(struct file *filp, const char __user *buf, size_t count)
+{
+    struct vfifo_file *vf = filp->private_data;
+    struct vfifo_dev *dev = vf->dev;
+    struct vfifo_subring *s;
+    struct vfifo_resv r;
+    size_t hdr = 0;
+    u32 key = READ_ONCE(vf->key);
+    int ret;
+
+    /* VFIFO_FLOW_HEADER, VFIFO_LANE_HEADER: each write starts with its own key */
+    if (READ_ONCE(vf->key_in_header)) {
+        hdr = sizeof(key);
+        if (count <= hdr)
+            return -EINVAL;
+        if (copy_from_user(&key, buf, hdr))
+            return -EFAULT;
+        buf += hdr;
+        count -= hdr;
+    }
+    count = min_t(size_t, count, vfifo_rec_max(dev));
+
+    for (;;) {
+        s = vfifo_rec_target(dev, key);
+        ret = vfifo_rec_reserve(dev, s, count, &r);
+        if (ret != -EAGAIN)
+            break;
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(*s->write_wq,
+                                     vfifo_rec_can_reserve(vfifo_rec_target(dev, key), count)))
+            return -ERESTARTSYS;
+    }
+    if (ret)
+        return ret;
+
+    /* Later records may already be queued behind it: commit it, marked empty */
+    if (copy_from_user(vfifo_rec_at(s, r.pos) + 1, buf, count)) {
+        vfifo_rec_at(s, r.pos)->flags = VFIFO_REC_SKIP;
+        vfifo_rec_commit(dev, s, r.pos);
+        return -EFAULT;
+    }
+
+    vfifo_rec_commit(dev, s, r.pos);
+    return hdr + count;
+}
+
+static ssize_t vfifo_rec_read(struct file *filp, char __user *buf, size_t count)
+{
+    struct vfifo_file *vf = filp->private_data;
+    struct vfifo_dev *dev = vf->dev;
+    struct vfifo_subring *bound = NULL, *s;
+    int queue = READ_ONCE(vf->queue);
+    ssize_t ret;
+
+    if (queue >= 0)
+        bound = dev->subs[queue];
+
+    for (;;) {
+        s = bound;
+        if (!s && dev->nr_queues)
+            s = vfifo_queue_pick(dev);
+        ret = -EAGAIN;
+        if (s || !dev->nr_queues)
+            ret = vfifo_rec_dequeue(dev, s, NULL, buf, count);
+        if (ret != -EAGAIN)
+            return ret;
+
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (bound)
+            ret = wait_event_interruptible(*bound->read_wq, vfifo_ring_avail(&bound->ring));
+        else
+            ret = wait_event_interruptible(dev->read_queue, vfifo_subs_readable(dev));
+        if (ret)
+            return -ERESTARTSYS;
+    }
+}
+
+/* --- Tee --- */
+
+/*
+ * With tee_sinks=N, a write to vfifo0 (the source) is delivered to each
+ * of vfifo1..N (the sinks), copied only once: into freshly allocated
+ * pages, which every sink then references, like tee(2) does with pipe
+ * buffers. A sink's ring holds trefs (page, offset, length) rather than
+ * bytes, with its own positions and locks, and a reader copies straight
+ * out of the shared page. The page goes back when the last sink is done
+ * with it, so fan-out costs one copy in plus one copy out per reader,
+ * however many sinks there are.
+ *
+ * A write reaches every sink or none: it reserves trefs in all of them
+ * first. A full sink either holds the write back (the default) or, with
+ * tee_policy=drop, misses it and counts it in tee_dropped. The source
+ * keeps nothing itself, and sinks take no writes of their own.
+ */
+
+/*
+ * Make @sink one of @src's sinks. The room for it is made while @sink is
+ * set up, so nothing is left to undo if creating it fails later.
+ */
+static int vfifo_tee_prepare(struct vfifo_dev *src, struct vfifo_dev *sink)
+{
+    if (!src->tee) {
+        src->tee = kcalloc(VFIFO_MAX_DEVICES, sizeof(*src->tee), GFP_KERNEL);
+        if (!src->tee)
+            return -ENOMEM;
+    }
+    if (src->nr_tee == VFIFO_MAX_DEVICES)
+        return -ENOSPC;
+
+    sink->tee_sink = true;
+    return 0;
+}
+
+/* Once @sink is live (under vfifo_list_lock): writes to @src now reach it */
+static void vfifo_tee_attach(struct vfifo_dev *src, struct vfifo_dev *sink)
+{
+    kref_get(&sink->ref);
+    src->tee[src->nr_tee] = sink;
+    /* Pairs with the acquire in vfifo_tee_write(): the sink is set up */
+    smp_store_release(&src->nr_tee, src->nr_tee + 1);
+}
+
+/*
+ * Under cons_lock: consume the next tref and return its page, whose
+ * reference passes to the caller. NULL if only holes were left.
+ */
+static struct page *vfifo_tee_take(struct vfifo_dev *dev, u32 *off, u32 *len, int *moved)
+{
+    struct vfifo_tref *t;
+    struct vfifo_resv r;
+    struct page *page;
+
+    if (vfifo_ring_claim_counted(dev, sizeof(*t), false, &r, moved))
+        return NULL;
+    t = (struct vfifo_tref *)vfifo_ptr(dev, r.pos);
+    page = t->page;
+    *off = t->off;
+    *len = t->len;
+    *moved |= vfifo_ring_release_counted(dev, r.pos, sizeof(*t)) > 0;
+    return page;
+}
+
+/* Drop every tref a sink holds, with its page references */
+static void vfifo_tee_clear(struct vfifo_dev *dev)
+{
+    struct page *page;
+    unsigned long flags;
+    int moved = 0;
+    u32 off, len;
+
+    spin_lock_irqsave(&dev->cons_lock, flags);
+    while (vfifo_ring_avail(&dev->ring) >= sizeof(struct vfifo_tref)) {
+        page = vfifo_tee_take(dev, &off, &len, &moved);
+        if (page) {
+            atomic_long_sub(len, &dev->tee_bytes);
+            put_page(page);
+        }
+    }
+    spin_unlock_irqrestore(&dev->cons_lock, flags);
+    if (moved)
+        vfifo_notify_writers(dev);
+}
+
+/* Take back reservations made in sinks[0..n) for a write that will not happen */
+static void vfifo_tee_unreserve(struct vfifo_dev **sinks, struct vfifo_resv *r,
+                                unsigned int n)
+{
+    unsigned int i;
+
+    /* Newest first, so the space is simply handed back where possible */
+    for (i = n; i > 0; i--)
+        if (r[i - 1].len)
+            vfifo_discard_span(sinks[i - 1], r[i - 1].pos, NULL);
+}
+
+/*
+ * Deliver up to VFIFO_TEE_MAX_PAGES pages from @kbuf (or the user buffer
+ * @ubuf) to every sink of @dev. Returns the bytes delivered, -EAGAIN if a
+ * blocking sink is full and @nonblock, or another error.
+ */
+static ssize_t vfifo_tee_write(struct vfifo_dev *dev, const void *kbuf, const char __user *ubuf,
+                               size_t len, bool nonblock, gfp_t gfp)
+{
+    unsigned int nr_tee = smp_load_acquire(&dev->nr_tee);
+    struct page *pages[VFIFO_TEE_MAX_PAGES];
+    struct vfifo_resv r[VFIFO_MAX_DEVICES];
+    struct vfifo_dev *sink;
+    struct vfifo_tref *t;
+    unsigned long flags;
+    unsigned int i, j, npages;
+    size_t done, chunk;
+    ssize_t ret;
+    u32 need;
+
+    len = min_t(size_t, len, VFIFO_TEE_MAX_PAGES * PAGE_SIZE);
+    npages = DIV_ROUND_UP(len, PAGE_SIZE);
+    need = npages * sizeof(*t);
+
+    /* The one copy */
+    for (i = 0, done = 0; i < npages; i++, done += chunk) {
+        chunk = min_t(size_t, len - done, PAGE_SIZE);
+        pages[i] = alloc_page(gfp);
+        ret = -ENOMEM;
+        if (!pages[i])
+            goto out;
+        ret = -EFAULT;
+        if (ubuf) {
+            if (copy_from_user(page_address(pages[i]), ubuf + done, chunk)) {
+                i++;
+                goto out;
+            }
+        } else {
+            memcpy(page_address(pages[i]), (const char *)kbuf + done, chunk);
+        }
+    }
+
+    /* Room for the trefs in every sink, or in none */
+    for (;;) {
+        for (j = 0; j < nr_tee; j++) {
+            sink = dev->tee[j];
+            ret = vfifo_reserve_span(sink, need, false, NULL, &r[j]);
+            if (ret == -EAGAIN && READ_ONCE(sink->tee_drop)) {
+                ret = 0;
+                r[j].len = 0;
+            }
+            if (ret)
+                break;
+        }
+        if (j == nr_tee)
+            break;
+
+        vfifo_tee_unreserve(dev->tee, r, j);
+        if (ret != -EAGAIN || nonblock)
+            goto out;
+        ret = -ERESTARTSYS;
+        if (wait_event_interruptible(sink->write_queue, vfifo_can_reserve(sink, need)))
+            goto out;
+    }
+
+    /* Every sink gets its own reference to the same pages */
+    for (j = 0; j < nr_tee; j++) {
+        sink = dev->tee[j];
+        if (!r[j].len) {
+            spin_lock_irqsave(&sink->resv_lock, flags);
+            sink->tee_dropped++;
+            spin_unlock_irqrestore(&sink->resv_lock, flags);
+            continue;
+        }
+        t = (struct vfifo_tref *)vfifo_ptr(sink, r[j].pos);
+        for (i = 0, done = 0; i < npages; i++, done += PAGE_SIZE) {
+            get_page(pages[i]);
+            t[i].page = pages[i];
+            t[i].off = 0;
+            t[i].len = min_t(size_t, len - done, PAGE_SIZE);
+        }
+        atomic_long_add(len, &sink->tee_bytes);
+        vfifo_commit_span(sink, r[j].pos, NULL);
+    }
+    ret = len;
+    i = npages;
+
+out:
+    while (i > 0)
+        put_page(pages[--i]);
+    return ret;
+}
+
+/*
+ * Read up to @len bytes from a sink into @kbuf (or the user buffer @ubuf).
+ * Readers pick pieces off the trefs under cons_lock, each with a page
+ * reference of its own, and copy unlocked.
+ */
+static ssize_t vfifo_tee_read(struct vfifo_dev *dev, char *kbuf, char __user *ubuf, size_t len)
+{
+    struct vfifo_tref *t;
+    struct page *page;
+    unsigned long flags;
+    size_t done = 0;
+    u32 off, take, pos;
+    int moved = 0;
+    ssize_t ret = -EAGAIN;
+
+    while (done < len) {
+        spin_lock_irqsave(&dev->cons_lock, flags);
+        if (vfifo_ring_peek_counted(dev, &pos, &moved) < sizeof(*t)) {
+            spin_unlock_irqrestore(&dev->cons_lock, flags);
+            break;
+        }
+        t = (struct vfifo_tref *)vfifo_ptr(dev, pos);
+        if (t->len > len - done) {
+            /* Only part of this piece: leave the rest queued */
+            page = t->page;
+            off = t->off;
+            take = len - done;
+            get_page(page);
+            t->off += take;
+            t->len -= take;
+        } else {
+            /* Peek stepped over any holes: the claim gets this tref */
+            page = vfifo_tee_take(dev, &off, &take, &moved);
+        }
+        atomic_long_sub(take, &dev->tee_bytes);
+        spin_unlock_irqrestore(&dev->cons_lock, flags);
+
+        if (ubuf)
+            ret = copy_to_user(ubuf + done, page_address(page) + off, take) ? -EFAULT : 0;
+        else
+            memcpy(kbuf + done, page_address(page) + off, take);
+        put_page(page);
+        if (ret == -EFAULT)
+            break;
+        done += take;
+    }
+
+    if (moved) {
+        vfifo_notify_writers(dev);
+        vfifo_evt_rearm(dev, &dev->data_evt);
+    }
+    return done ? done : ret;
+}
+
+static ssize_t vfifo_tee_read_wait(struct file *filp, char __user *buf, size_t count)
+{
+    struct vfifo_file *vf = filp->private_data;
+    struct vfifo_dev *dev = vf->dev;
+    ssize_t ret;
+
+    while ((ret = vfifo_tee_read(dev, NULL, buf, count)) == -EAGAIN) {
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->read_queue, vfifo_ring_avail(&dev->ring)))
+            return -ERESTARTSYS;
+    }
+    return ret;
+}
+
+/* Drop the sinks' trefs, or a source's references to its sinks */
+static void vfifo_tee_free(struct vfifo_dev *dev)
+{
+    unsigned int i;
+
+    if (dev->tee_sink)
+        vfifo_tee_clear(dev);
+    for (i = 0; i < dev->nr_tee; i++)
+        vfifo_put(dev->tee[i]);
+    kfree(dev->tee);
+    dev->tee = NULL;
+    dev->nr_tee = 0;
+}
+
+/* --- Compression --- */
+
+/*
+ * With compress=1 the ring holds LZ4 blocks instead of the raw stream, so
+ * compressible data (text, telemetry) takes several times less of it and
+ * bursts that size run longer before writers are held back. Each write is
+ * cut into blocks of up to 'lz4_block' bytes, compressed with the kernel's
+ * lib/lz4 (blocks that do not shrink are stored as they are), and queued
+ * as one record each. Readers still see a plain byte stream.
+ *
+ * Blocks are compressed on a per-CPU workspace, and decompressed unlocked
+ * like any claim. sysfs shows the ratio and the CPU time spent both ways.
+ * Needs CONFIG_VFIFO_LZ4; without it, compress=1 fails with -EOPNOTSUPP.
+ */
+
+#if IS_ENABLED(CONFIG_VFIFO_LZ4)
+#define VFIFO_LZ4_MAX_BLOCK 4096
+#define VFIFO_LZ4_BOUNCE    (64 * 1024)     /* Most a read() or write() moves */
+
+/* A compressed block in the ring; payload padded to 8 bytes */
+struct vfifo_lz4_hdr {
+    u32 raw_len;
+    u32 comp_len;           /* 0: stored uncompressed */
+};
+
+static inline u32 vfifo_lz4_rec_size(u32 stored)
+{
+    return ALIGN(sizeof(struct vfifo_lz4_hdr) + stored, 8);
+}
+
+/* Compression state, and room for a block that does not fit a reader */
+struct vfifo_lz4_ws {
+    void *wrkmem;
+    char *dst;
+};
+
+/*
+ * Per-CPU, shared by all compressed instances. Tasks use 'task' under the
+ * local lock, with preemption off. vfifo_enqueue() and vfifo_dequeue() may
+ * also run in softirq or hardirq context; there they use 'atomic' with
+ * interrupts off, so neither can interrupt the other's use of a workspace.
+ */
+struct vfifo_lz4_ctx {
+    local_lock_t lock;
+    struct vfifo_lz4_ws task, atomic;
+};
+
+static struct vfifo_lz4_ctx __percpu *vfifo_lz4_ctx;
+static DEFINE_MUTEX(vfifo_lz4_lock);
+
+static void vfifo_lz4_ctx_free(void)
+{
+    struct vfifo_lz4_ctx *ctx;
+    int cpu;
+
+    if (!vfifo_lz4_ctx)
+        return;
+    for_each_possible_cpu(cpu) {
+        ctx = per_cpu_ptr(vfifo_lz4_ctx, cpu);
+        vfree(ctx->task.wrkmem);
+        vfree(ctx->task.dst);
+        vfree(ctx->atomic.wrkmem);
+        vfree(ctx->atomic.dst);
+    }
+    free_percpu(vfifo_lz4_ctx);
+    vfifo_lz4_ctx = NULL;
+}
+
+static int vfifo_lz4_ws_alloc(struct vfifo_lz4_ws *ws, int node)
+{
+    ws->wrkmem = vmalloc_node(LZ4_MEM_COMPRESS, node);
+    ws->dst = vmalloc_node(LZ4_COMPRESSBOUND(VFIFO_LZ4_MAX_BLOCK), node);
+    return ws->wrkmem && ws->dst ? 0 : -ENOMEM;
+}
+
+/* Allocated for the first compressed instance, kept until unload */
+static int vfifo_lz4_ctx_alloc(void)
+{
+    struct vfifo_lz4_ctx *ctx;
+    int cpu, ret = 0;
+
+    mutex_lock(&vfifo_lz4_lock);
+    if (vfifo_lz4_ctx)
+        goto out;
+    ret = -ENOMEM;
+    vfifo_lz4_ctx = alloc_percpu(struct vfifo_lz4_ctx);
+    if (!vfifo_lz4_ctx)
+        goto out;
+    for_each_possible_cpu(cpu) {
+        ctx = per_cpu_ptr(vfifo_lz4_ctx, cpu);
+        local_lock_init(&ctx->lock);
+        if (vfifo_lz4_ws_alloc(&ctx->task, cpu_to_node(cpu)) ||
+            vfifo_lz4_ws_alloc(&ctx->atomic, cpu_to_node(cpu))) {
+            vfifo_lz4_ctx_free();
+            goto out;
+        }
+    }
+    ret = 0;
+out:
+    mutex_unlock(&vfifo_lz4_lock);
+    return ret;
+}
+
+/* Turn a new, empty instance into a compressed one */
+static int vfifo_lz4_setup(struct vfifo_dev *dev)
+{
+    int ret = vfifo_lz4_ctx_alloc();
+
+    if (ret)
+        return ret;
+    /* Even a block that does not compress must fit, twice over */
+    dev->lz4_block = min_t(u32, VFIFO_LZ4_MAX_BLOCK, dev->ring.capacity / 2);
+    /* A block, and what a failed copy to user space puts back in front of it */
+    dev->lz4_out = kvmalloc(2 * dev->lz4_block, GFP_KERNEL);
+    if (!dev->lz4_out)
+        return -ENOMEM;
+    dev->lz4 = true;
+    return 0;
+}
+
+/* This CPU's workspace for the calling context; pass @flags to vfifo_lz4_ws_put() */
+static struct vfifo_lz4_ws *vfifo_lz4_ws_get(unsigned long *flags)
+{
+    if (in_task()) {
+        local_lock(&vfifo_lz4_ctx->lock);
+        return this_cpu_ptr(&vfifo_lz4_ctx->task);
+    }
+    local_irq_save(*flags);
+    return this_cpu_ptr(&vfifo_lz4_ctx->atomic);
+}
+
+static void vfifo_lz4_ws_put(unsigned long flags)
+{
+    if (in_task())
+        local_unlock(&vfifo_lz4_ctx->lock);
+    else
+        local_irq_restore(flags);
+}
+
+/*
+ * Compress and queue @len bytes of @buf, block by block, until the ring is
+ * full. Returns the raw bytes queued, or -EAGAIN with *need set to the
+ * ring space the next block takes.
+ */
+static ssize_t vfifo_lz4_write(struct vfifo_dev *dev, const u8 *buf, size_t len, u32 *need)
+{
+    struct vfifo_lz4_hdr *h;
+    struct vfifo_lz4_ws *ws;
+    struct vfifo_resv r;
+    unsigned long flags, ws_flags;
+    const void *src;
+    size_t done = 0;
+    u32 raw, stored;
+    int comp, ret = 0;
+    u64 t0, ns;
+
+    while (done < len) {
+        raw = min_t(size_t, len - done, dev->lz4_block);
+
+        ws = vfifo_lz4_ws_get(&ws_flags);
+        t0 = ktime_get_ns();
+        comp = LZ4_compress_default((const char *)buf + done, ws->dst, raw, LZ4_COMPRESSBOUND(raw),
+                                    ws->wrkmem);
+        ns = ktime_get_ns() - t0;
+        if (comp > 0 && comp < raw) {
+            src = ws->dst;
+            stored = comp;
+        } else {
+            src = buf + done;
+            stored = raw;
+            comp = 0;
+        }
+        ret = vfifo_reserve_span(dev, vfifo_lz4_rec_size(stored), false, NULL, &r);
+        if (ret) {
+            vfifo_lz4_ws_put(ws_flags);
+            *need = vfifo_lz4_rec_size(stored);
+            break;
+        }
+        h = (struct vfifo_lz4_hdr *)vfifo_ptr(dev, r.pos);
+        h->raw_len = raw;
+        h->comp_len = comp;
+        memcpy(h + 1, src, stored);
+        vfifo_lz4_ws_put(ws_flags);
+
+        spin_lock_irqsave(&dev->resv_lock, flags);
+        dev->lz4_raw += raw;
+        dev->lz4_stored += stored;
+        dev->lz4_comp_ns += ns;
+        spin_unlock_irqrestore(&dev->resv_lock, flags);
+
+        atomic_long_add(raw, &dev->lz4_queued);
+        vfifo_commit_span(dev, r.pos, NULL);
+        done += raw;
+    }
+    return done ? done : ret;
+}
+
+/*
+ * Under cons_lock: queue @len decompressed bytes behind what 'lz4_out'
+ * holds. Several readers that each took a block too big for them could
+ * overflow it; what does not fit is dropped and counted as lost.
+ */
+static void vfifo_lz4_stash(struct vfifo_dev *dev, const u8 *buf, u32 len)
+{
+    if (dev->lz4_out_len + len > 2 * dev->lz4_block) {
+        atomic_long_sub(len, &dev->lz4_queued);
+        dev->lost += len;
+        return;
+    }
+    memmove(dev->lz4_out, dev->lz4_out + dev->lz4_out_pos, dev->lz4_out_len);
+    memcpy(dev->lz4_out + dev->lz4_out_len, buf, len);
+    dev->lz4_out_pos = 0;
+    dev->lz4_out_len += len;
+}
+
+/*
+ * Read up to @len bytes into @buf: first what is left of the last block,
+ * then whole blocks. A block is claimed under cons_lock and decompressed
+ * unlocked, straight into @buf when it fits, otherwise on this CPU's
+ * workspace and from there into 'lz4_out'.
+ */
+static ssize_t vfifo_lz4_read(struct vfifo_dev *dev, u8 *buf, size_t len)
+{
+    struct vfifo_lz4_ws *ws;
+    struct vfifo_lz4_hdr *h;
+    struct vfifo_resv r;
+    unsigned long flags, ws_flags;
+    size_t done = 0;
+    u32 pos, n, comp;
+    int moved = 0, ret = -EAGAIN;
+    u8 *dst;
+    u64 t0, ns;
+
+    while (done < len) {
+        spin_lock_irqsave(&dev->cons_lock, flags);
+        if (dev->lz4_out_len) {
+            n = min_t(size_t, len - done, dev->lz4_out_len);
+            memcpy(buf + done, dev->lz4_out + dev->lz4_out_pos, n);
+            dev->lz4_out_pos += n;
+            dev->lz4_out_len -= n;
+            spin_unlock_irqrestore(&dev->cons_lock, flags);
+            atomic_long_sub(n, &dev->lz4_queued);
+            done += n;
+            continue;
+        }
+
+        n = comp = 0;
+        ret = -EAGAIN;
+        if (vfifo_ring_peek_counted(dev, &pos, &moved) >= sizeof(*h)) {
+            h = (struct vfifo_lz4_hdr *)vfifo_ptr(dev, pos);
+            n = h->raw_len;
+            comp = h->comp_len;
+            ret = vfifo_ring_claim_counted(dev, vfifo_lz4_rec_size(comp ?: n), false, &r, &moved);
+        }
+        spin_unlock_irqrestore(&dev->cons_lock, flags);
+        if (ret) {
+            ret = -EAGAIN;
+            break;
+        }
+
+        ws = NULL;
+        dst = buf + done;
+        if (len - done < n) {
+            ws = vfifo_lz4_ws_get(&ws_flags);
+            dst = (u8 *)ws->dst;
+        }
+        h = (struct vfifo_lz4_hdr *)vfifo_ptr(dev, r.pos);
+        ns = 0;
+        if (comp) {
+            t0 = ktime_get_ns();
+            ret = LZ4_decompress_safe((const char *)(h + 1), (char *)dst, comp, n);
+            ns = ktime_get_ns() - t0;
+        } else {
+            memcpy(dst, h + 1, n);
+            ret = n;
+        }
+
+        spin_lock_irqsave(&dev->cons_lock, flags);
+        moved |= vfifo_ring_release_counted(dev, r.pos, r.len) > 0;
+        dev->lz4_decomp_ns += ns;
+        if (ws && ret == n)
+            vfifo_lz4_stash(dev, dst, n);
+        spin_unlock_irqrestore(&dev->cons_lock, flags);
+        if (ws)
+            vfifo_lz4_ws_put(ws_flags);
+
+        /* Only our own writer could have produced it: drop the block loudly */
+        if (WARN_ON_ONCE(ret != n)) {
+            atomic_long_sub(n, &dev->lz4_queued);
+            ret = -EIO;
+            break;
+        }
+        ret = -EAGAIN;
+        if (!ws) {
+            atomic_long_sub(n, &dev->lz4_queued);
+            done += n;
+        }
+    }
+
+    if (moved) {
+        vfifo_notify_writers(dev);
+        vfifo_evt_rearm(dev, &dev->data_evt);
+    }
+    return done ? done : ret;
+}
+
+static bool vfifo_lz4_readable(struct vfifo_dev *dev)
+{
+    return READ_ONCE(dev->lz4_out_len) ||
+           vfifo_ring_avail(&dev->ring) >= sizeof(struct vfifo_lz4_hdr);
+}
+
+/* Drop everything queued, including the rest of a half-read block */
+static void vfifo_lz4_clear(struct vfifo_dev *dev)
+{
+    struct vfifo_resv r;
+    unsigned long flags;
+    int moved = 0;
+
+    spin_lock_irqsave(&dev->cons_lock, flags);
+    while (vfifo_ring_claim_counted(dev, dev->ring.capacity, true, &r, &moved) == 0)
+        moved |= vfifo_ring_release_counted(dev, r.pos, r.len) > 0;
+    dev->lz4_out_len = 0;
+    atomic_long_set(&dev->lz4_queued, 0);
+    spin_unlock_irqrestore(&dev->cons_lock, flags);
+    if (moved)
+        vfifo_notify_writers(dev);
+}
+
+/* write() and read() go through a kernel bounce buffer */
+static ssize_t vfifo_lz4_write_user(struct file *filp, const char __user *ubuf, size_t count)
+{
+    struct vfifo_file *vf = filp->private_data;
+    struct vfifo_dev *dev = vf->dev;
+    ssize_t ret;
+    u32 need;
+    u8 *kbuf;
+
+    count = min_t(size_t, count, VFIFO_LZ4_BOUNCE);
+    kbuf = kvmalloc(count, GFP_KERNEL);
+    if (!kbuf)
+        return -ENOMEM;
+    ret = -EFAULT;
+    if (copy_from_user(kbuf, ubuf, count))
+        goto out;
+
+    while ((ret = vfifo_lz4_write(dev, kbuf, count, &need)) == -EAGAIN) {
+        if (filp->f_flags & O_NONBLOCK)
+            break;
+        if (wait_event_interruptible(dev->write_queue, vfifo_can_reserve(dev, need))) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+    }
+out:
+    kvfree(kbuf);
+    return ret;
+}
+
+/*
+ * Put back @len bytes a reader took but could not copy out, in front of
+ * what 'lz4_out' still holds. A reader takes at most a block at a time, so
+ * they fit unless several readers fail at once; then they are dropped and
+ * counted as lost.
+ */
+static void vfifo_lz4_unread(struct vfifo_dev *dev, const u8 *buf, u32 len)
+{
+    unsigned long flags;
+    bool fits;
+
+    spin_lock_irqsave(&dev->cons_lock, flags);
+    fits = dev->lz4_out_len + len <= 2 * dev->lz4_block;
+    if (fits) {
+        memmove(dev->lz4_out + len, dev->lz4_out + dev->lz4_out_pos, dev->lz4_out_len);
+        memcpy(dev->lz4_out, buf, len);
+        dev->lz4_out_pos = 0;
+        dev->lz4_out_len += len;
+        atomic_long_add(len, &dev->lz4_queued);
+    } else {
+        dev->lost += len;
+    }
+    spin_unlock_irqrestore(&dev->cons_lock, flags);
+    if (fits)
+        vfifo_notify_readers(dev);
+}
+
+static ssize_t vfifo_lz4_read_user(struct file *filp, char __user *ubuf, size_t count)
+{
+    struct vfifo_file *vf = filp->private_data;
+    struct vfifo_dev *dev = vf->dev;
+    size_t done = 0;
+    ssize_t ret = 0;
+    u32 left;
+    u8 *kbuf;
+
+    count = min_t(size_t, count, VFIFO_LZ4_BOUNCE);
+    kbuf = kvmalloc(min_t(size_t, count, dev->lz4_block), GFP_KERNEL);
+    if (!kbuf)
+        return -ENOMEM;
+
+    /* A block at a time, so whatever a bad buffer refuses can be put back */
+    while (done < count) {
+        ret = vfifo_lz4_read(dev, kbuf, min_t(size_t, count - done, dev->lz4_block));
+        if (ret == -EAGAIN && !done && !(filp->f_flags & O_NONBLOCK)) {
+            if (wait_event_interruptible(dev->read_queue, vfifo_lz4_readable(dev))) {
+                ret = -ERESTARTSYS;
+                break;
+            }
+            continue;
+        }
+        if (ret <= 0)
+            break;
+        left = copy_to_user(ubuf + done, kbuf, ret);
+        done += ret - left;
+        if (left) {
+            vfifo_lz4_unread(dev, kbuf + ret - left, left);
+            ret = -EFAULT;
+            break;
+        }
+    }
+    kvfree(kbuf);
+    return done ? done : ret;
+}
+#else
+static void vfifo_lz4_ctx_free(void) { }
+static int vfifo_lz4_setup(struct vfifo_dev *dev) { return -EOPNOTSUPP; }
+static ssize_t vfifo_lz4_write(struct vfifo_dev *dev, const u8 *buf, size_t len, u32 *need) { return -EOPNOTSUPP; }
+static ssize_t vfifo_lz4_read(struct vfifo_dev *dev, u8 *buf, size_t len) { return -EOPNOTSUPP; }
+static void vfifo_lz4_clear(struct vfifo_dev *dev) { }
+static ssize_t vfifo_lz4_write_user(struct file *filp, const char __user *ubuf, size_t count) { return -EOPNOTSUPP; }
+static ssize_t vfifo_lz4_read_user(struct file *filp, char __user *ubuf, size_t count) { return -EOPNOTSUPP; }
+#endif
+
+/* --- Online Resize --- */
+
+/*
+ * Grow or shrink the ring while the device stays live. The new buffer is
+ * allocated before anything is stopped; producers and readers are then
+ * held off only while in-flight claims drain and the queued data is copied
+ * over. Existing mappings are zapped and refault onto the new buffer.
+ */
+static int vfifo_resize(struct vfifo_dev *dev, u32 new_cap)
+{
+    struct vfifo_file *vf;
+    unsigned char *new_buf, *old_buf;
+    struct page **new_pages, **old_pages;
+    unsigned long flags;
+    u32 old_cap;
+    long left;
+    int ret = 0;
+
+    if (new_cap == 0 || new_cap > VFIFO_MAX_CAPACITY)
+        return -EINVAL;
+    /* Sessions are sized by the pool; the device's own ring is a stub */
+    if (!vfifo_is_plain(dev) || dev->sessions || dev->session_of)
+        return -EOPNOTSUPP;
+    new_cap = roundup_pow_of_two(PAGE_ALIGN(new_cap));
+
+    new_buf = vfifo_buf_alloc(dev, new_cap, NUMA_NO_NODE, &new_pages);
+    if (!new_buf)
+        return -ENOMEM;
+
+    /* One resize at a time */
+    if (vfifo_lock_interruptible_at(dev, VFIFO_LS_RESIZE)) {
+        vfifo_buf_free(dev, new_buf, new_pages, new_cap);
+        return -ERESTARTSYS;
+    }
+    /* Importers hold the pages' DMA addresses; they cannot be moved */
+    if (atomic_read(&dev->dmabufs)) {
+        vfifo_unlock_at(dev, VFIFO_LS_RESIZE);
+        vfifo_buf_free(dev, new_buf, new_pages, new_cap);
+        return -EBUSY;
+    }
+
+    spin_lock_irqsave(&dev->resv_lock, flags);
+    spin_lock(&dev->cons_lock);
+    WRITE_ONCE(dev->resizing, true);
+    spin_unlock(&dev->cons_lock);
+    spin_unlock_irqrestore(&dev->resv_lock, flags);
+
+    /* A producer that never commits must not wedge us: give up after 1s */
+    left = wait_event_interruptible_timeout(dev->write_queue,
+                                            READ_ONCE(dev->ring.wspans.count) == 0 &&
+                                            READ_ONCE(dev->ring.rspans.count) == 0, HZ);
+    if (left <= 0) {
+        ret = left ? left : -EBUSY;
+        goto out_unfreeze;
+    }
+
+    if (vfifo_used(dev) > new_cap) {
+        ret = -ENOSPC;
+        goto out_unfreeze;
+    }
+
+    /*
+     * Nobody can touch the ring now. Positions are kept as they are, only
+     * the index mask changes; both buffers are double-mapped, so the queued
+     * bytes are a single contiguous copy.
+     */
+    memcpy(new_buf + (dev->ring.tail & (new_cap - 1)), vfifo_ptr(dev, dev->ring.tail), vfifo_used(dev));
+
+    down_write(&dev->buf_sem);
+    list_for_each_entry(vf, &dev->files, node)
+        unmap_mapping_range(vf->filp->f_mapping, 0, 0, 1);
+    old_buf = dev->buffer;
+    old_pages = dev->pages;
+    old_cap = dev->ring.capacity;
+    spin_lock_irqsave(&dev->resv_lock, flags);
+    dev->buffer = new_buf;
+    dev->pages = new_pages;
+    write_seqcount_begin(&dev->prod_seq);
+    WRITE_ONCE(dev->ring.capacity, new_cap);
+    write_seqcount_end(&dev->prod_seq);
+    spin_unlock_irqrestore(&dev->resv_lock, flags);
+    up_write(&dev->buf_sem);
+
+    /* Freed below */
+    new_buf = old_buf;
+    new_pages = old_pages;
+    new_cap = old_cap;
+
+out_unfreeze:
+    spin_lock_irqsave(&dev->resv_lock, flags);
+    spin_lock(&dev->cons_lock);
+    WRITE_ONCE(dev->resizing, false);
+    spin_unlock(&dev->cons_lock);
+    spin_unlock_irqrestore(&dev->resv_lock, flags);
+    vfifo_unlock_at(dev, VFIFO_LS_RESIZE);
+
+    vfifo_notify_writers(dev);
+    vfifo_notify_readers(dev);
+    vfifo_buf_free(dev, new_buf, new_pages, new_cap);
+    return ret;
+}
+
+/* --- Control --- */
+
+/* Drop committed data; spans still being filled are left alone */
+static void vfifo_clear(struct vfifo_dev *dev)
+{
+    struct vfifo_resv r;
+
+    if (dev->subs) {
+        vfifo_subs_clear(dev);
+        return;
+    }
+    if (dev->tee_sink) {
+        vfifo_tee_clear(dev);
+        return;
+    }
+    if (dev->lz4) {
+        vfifo_lz4_clear(dev);
+        return;
+    }
+    /* One claim per stretch between holes */
+    while (vfifo_claim_span(dev, READ_ONCE(dev->ring.capacity), true, &r) == 0)
+        vfifo_release_span(dev, r.pos, r.len);
+}
+
+/* --- Generator --- */
+
+/*
+ * The simulated hardware: with mode=1, a kthread of the device's own
+ * queues a sample every gen_interval_ms. A dedicated thread, unlike the
+ * shared system workqueue, wakes on time whatever else the system is
+ * doing, and it can be pinned to a CPU and given a real-time priority,
+ * which makes it a steady source for latency tests. It sleeps on an
+ * absolute hrtimer deadline, so periods do not drift by the time each
+ * sample takes, and it records how late it woke at worst.
+ */
+
+/* One sample. Buffer full: drop it, just like real hardware would */
+static void vfifo_gen_tick(struct vfifo_dev *dev)
+{
+    vfifo_enqueue(dev, "AUTO ", 5);
+}
+
+static int vfifo_gen_thread(void *data)
+{
+    struct vfifo_dev *dev = data;
+    ktime_t next = ktime_get(), now;
+    u32 interval;
+    s64 late;
+
+    while (!kthread_should_stop()) {
+        interval = READ_ONCE(dev->gen_interval_ms);
+        next = ktime_add_ms(next, interval);
+
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (kthread_should_stop()) {
+            __set_current_state(TASK_RUNNING);
+            break;
+        }
+        schedule_hrtimeout_range(&next, 0, HRTIMER_MODE_ABS);
+        if (kthread_should_stop())
+            break;
+
+        now = ktime_get();
+        late = ktime_to_ns(ktime_sub(now, next));
+        if (late > 0 && late > dev->gen_late_max_ns)
+            WRITE_ONCE(dev->gen_late_max_ns, late);
+        /* Lost whole periods (a stall, or the interval shrank): don't burst to catch up */
+        if (ktime_ms_delta(now, next) >= interval)
+            next = now;
+
+        vfifo_gen_tick(dev);
+    }
+    return 0;
+}
+
+/* Apply the placement and policy settings to the running generator */
+static int vfifo_gen_apply(struct vfifo_dev *dev, struct task_struct *t)
+{
+    struct sched_attr attr = {
+        .size = sizeof(attr),
+        .sched_policy = dev->gen_rt_prio ? SCHED_FIFO : SCHED_NORMAL,
+        .sched_priority = dev->gen_rt_prio,
+        .sched_nice = dev->gen_rt_prio ? 0 : dev->gen_nice,
+    };
+    int ret;
+
+    ret = set_cpus_allowed_ptr(t, dev->gen_cpu < 0 ? cpu_possible_mask : cpumask_of(dev->gen_cpu));
+    return ret ?: sched_setattr_nocheck(t, &attr);
+}
+
+/* Change one setting; restored if the running generator refuses it */
+static int vfifo_gen_set(struct vfifo_dev *dev, int *field, int val)
+{
+    int old, ret = 0;
+
+    mutex_lock(&dev->gen_lock);
+    old = *field;
+    *field = val;
+    if (dev->gen_task)
+        ret = vfifo_gen_apply(dev, dev->gen_task);
+    if (ret)
+        *field = old;
+    mutex_unlock(&dev->gen_lock);
+    return ret;
+}
+
+/* Start or stop the generator. Sleeps. */
+static int vfifo_set_mode(struct vfifo_dev *dev, bool auto_generate)
+{
+    struct task_struct *t;
+    int ret = 0;
+
+    mutex_lock(&dev->gen_lock);
+    if (auto_generate && !dev->gen_task) {
+        t = kthread_create_on_node(vfifo_gen_thread, dev, dev->numa_node, "vfifo-gen/%s",
+                                   dev->name);
+        if (IS_ERR(t)) {
+            ret = PTR_ERR(t);
+            goto out;
+        }
+        /* Placed before it first runs */
+        ret = vfifo_gen_apply(dev, t);
+        if (ret) {
+            kthread_stop(t);
+            goto out;
+        }
+        dev->gen_late_max_ns = 0;
+        dev->gen_task = t;
+        wake_up_process(t);
+    } else if (!auto_generate && dev->gen_task) {
+        kthread_stop(dev->gen_task);
+        dev->gen_task = NULL;
+    }
+    WRITE_ONCE(dev->auto_generate, !!dev->gen_task);
+out:
+    mutex_unlock(&dev->gen_lock);
+    return ret;
+}
+
+/* --- Rate Shaping --- */
+
+/*
+ * A producer that writes as fast as the ring takes it fills the ring and
+ * leaves everyone else waiting for room. Token buckets bound that: each fd
+ * may have a limit of its own (VFIFO_SET_RATE), and the device one for all
+ * of its fds together (rate_limit and rate_burst in sysfs). A bucket fills
+ * at 'rate' bytes per second up to its burst. A write may start while its
+ * buckets are not in debt, and takes its full length out of them at once
+ * (what it did not write is refunded), so concurrent writers can never
+ * overdraw a bucket by more than one write each. Without O_NONBLOCK the
+ * writer then sleeps on an hrtimer until the debt is paid off; with it, it
+ * gets -EAGAIN.
+ *
+ * This shapes what user space produces, write() and VFIFO_RESERVE. Kernel
+ * producers (the in-kernel API, the generator) cannot sleep and are not
+ * limited. A session starts with its device's limit as its own.
+ */
+
+static void vfifo_bucket_init(struct vfifo_bucket *b)
+{
+    spin_lock_init(&b->lock);
+}
+
+static u32 vfifo_bucket_depth(struct vfifo_bucket *b)
+{
+    return b->burst ? b->burst : min_t(u64, b->rate, U32_MAX);
+}
+
+/* A new limit starts with a full bucket */
+static void vfifo_bucket_set(struct vfifo_bucket *b, u64 rate, u32 burst)
+{
+    spin_lock(&b->lock);
+    b->rate = rate;
+    b->burst = burst;
+    b->tokens = (s64)vfifo_bucket_depth(b) * NSEC_PER_SEC;
+    b->stamp = ktime_get_ns();
+    spin_unlock(&b->lock);
+}
+
+/* Under b->lock, with a limit set: add what flowed in since the last refill */
+static void vfifo_bucket_refill(struct vfifo_bucket *b)
+{
+    s64 full = (s64)vfifo_bucket_depth(b) * NSEC_PER_SEC;
+    u64 now = ktime_get_ns();
+    u64 delta = now - b->stamp;
+
+    b->stamp = now;
+    if (b->tokens >= full)
+        return;
+    /* Past the time it takes to fill up, it is full: no overflow either way */
+    if (delta >= div64_u64(full - b->tokens, b->rate))
+        b->tokens = full;
+    else
+        b->tokens += delta * b->rate;
+}
+
+/* Take @len bytes, or if the bucket is in debt, return how long until it is not (ns) */
+static u64 vfifo_bucket_take(struct vfifo_bucket *b, u32 len)
+{
+    u64 wait = 0;
+
+    if (!READ_ONCE(b->rate))
+        return 0;
+    spin_lock(&b->lock);
+    if (b->rate) {
+        vfifo_bucket_refill(b);
+        if (b->tokens < 0)
+            wait = div64_u64(-b->tokens + b->rate - 1, b->rate);
+        else
+            b->tokens -= (s64)len * NSEC_PER_SEC;
+    }
+    spin_unlock(&b->lock);
+    return wait;
+}
+
+static void vfifo_bucket_refund(struct vfifo_bucket *b, u32 len)
+{
+    if (!len || !READ_ONCE(b->rate))
+        return;
+    spin_lock(&b->lock);
+    if (b->rate)
+        b->tokens = min_t(s64, b->tokens + (s64)len * NSEC_PER_SEC,
+                          (s64)vfifo_bucket_depth(b) * NSEC_PER_SEC);
+    spin_unlock(&b->lock);
+}
+
+/* Percent of the burst spent (0 without a limit), and the wait a write would have */
+static u32 vfifo_bucket_pressure(struct vfifo_bucket *b, u64 *wait)
+{
+    u64 depth, left;
+    u32 pct = 0;
+
+    *wait = 0;
+    if (!READ_ONCE(b->rate))
+        return 0;
+    spin_lock(&b->lock);
+    if (b->rate) {
+        vfifo_bucket_refill(b);
+        depth = vfifo_bucket_depth(b);
+        if (b->tokens < 0) {
+            *wait = div64_u64(-b->tokens + b->rate - 1, b->rate);
+            pct = 100;
+        } else {
+            left = div64_u64(b->tokens, NSEC_PER_SEC);
+            pct = 100 - div64_u64(min(left, depth) * 100, depth);
+        }
+    }
+    spin_unlock(&b->lock);
+    return pct;
+}
+
+/*
+ * Admit a write of @len bytes by @vf to @dev: wait for (or with @nonblock,
+ * refuse on) the fd's and the device's limits, then take @len from both.
+ */
+static int vfifo_rate_admit(struct vfifo_file *vf, struct vfifo_dev *dev, u32 len, bool nonblock)
+{
+    bool counted = false;
+    ktime_t expires;
+    u64 wait;
+
+    for (;;) {
+        wait = vfifo_bucket_take(&vf->rate, len);
+        if (!wait) {
+            wait = vfifo_bucket_take(&dev->rate, len);
+            if (!wait)
+                return 0;
+            vfifo_bucket_refund(&vf->rate, len);
+        }
+        if (!counted) {
+            atomic_long_inc(&dev->throttled);
+            counted = true;
+        }
+        if (nonblock)
+            return -EAGAIN;
+        expires = ns_to_ktime(wait);
+        set_current_state(TASK_INTERRUPTIBLE);
+        schedule_hrtimeout(&expires, HRTIMER_MODE_REL);
+        if (signal_pending(current))
+            return -ERESTARTSYS;
+    }
+}
+
+/* Give back what an admitted write of @len bytes did not use (@done < 0: all of it) */
+static void vfifo_rate_refund(struct vfifo_file *vf, struct vfifo_dev *dev, u32 len, ssize_t done)
+{
+    u32 unused = done <= 0 ? len : len - min_t(size_t, done, len);
+
+    vfifo_bucket_refund(&vf->rate, unused);
+    vfifo_bucket_refund(&dev->rate, unused);
+}
+
+/* Ring fill in percent, whatever the layout */
+static u32 vfifo_fill_pct(struct vfifo_dev *dev)
+{
+    u64 used = vfifo_level(dev, true), total = used + vfifo_level(dev, false);
+
+    return total ? div64_u64(used * 100, total) : 0;
+}
+
+/* VFIFO_GET_BACKPRESSURE; @vf NULL for the device as a whole */
+static void vfifo_get_backpressure(struct vfifo_dev *dev, struct vfifo_file *vf,
+                                   struct vfifo_backpressure *bp)
+{
+    u64 wait;
+
+    memset(bp, 0, sizeof(*bp));
+    bp->fill = vfifo_fill_pct(dev);
+    if (vf)
+        bp->fd_rate = vfifo_bucket_pressure(&vf->rate, &bp->wait_ns);
+    bp->dev_rate = vfifo_bucket_pressure(&dev->rate, &wait);
+    bp->wait_ns = max(bp->wait_ns, wait);
+    bp->level = max3(bp->fill, bp->fd_rate, bp->dev_rate);
+}
+
+/* --- Status --- */
+
+/*
+ * One consistent picture of a device for monitoring: the sysfs 'stat'
+ * attribute, debugfs and VFIFO_GET_STATUS. Nothing here takes a lock the
+ * data path uses, so scraping hundreds of devices every second costs the
+ * producers and consumers nothing but the odd seqcount retry on our side.
+ * Each side's fields are read in one seqcount section; the two sections
+ * are a few instructions apart, not one atomic view of both.
+ */
+static void vfifo_get_status(struct vfifo_dev *dev, struct vfifo_status *st)
+{
+    struct vfifo_subring *s;
+    unsigned int seq, i;
+
+    memset(st, 0, sizeof(*st));
+    do {
+        seq = read_seqcount_begin(&dev->prod_seq);
+        st->capacity = dev->ring.capacity;
+        st->head = dev->ring.head;
+        st->bytes_in = dev->bytes_in;
+        st->commits = dev->commits;
+    } while (read_seqcount_retry(&dev->prod_seq, seq));
+    do {
+        seq = read_seqcount_begin(&dev->cons_seq);
+        st->tail = dev->ring.tail;
+        st->bytes_out = dev->bytes_out;
+        st->releases = dev->releases;
+    } while (read_seqcount_retry(&dev->cons_seq, seq));
+
+    /* Record rings keep their own counters, each under a sub-ring lock */
+    for (i = 0; i < dev->nr_subs; i++) {
+        s = dev->subs[i];
+        if (!s)
+            continue;
+        st->bytes_in += READ_ONCE(s->bytes_in);
+        st->commits += READ_ONCE(s->enqueued);
+        st->bytes_out += READ_ONCE(s->bytes_out);
+        st->releases += READ_ONCE(s->dequeued);
+    }
+    st->used = vfifo_level(dev, true);
+    st->mode = READ_ONCE(dev->auto_generate);
+}
+
+static int vfifo_debug_status_show(struct seq_file *m, void *v)
+{
+    struct vfifo_dev *dev = m->private;
+    struct vfifo_status st;
+
+    vfifo_get_status(dev, &st);
+    seq_printf(m, "capacity:  %u\n", st.capacity);
+    seq_printf(m, "used:      %u\n", st.used);
+    seq_printf(m, "head:      %u\n", st.head);
+    seq_printf(m, "tail:      %u\n", st.tail);
+    seq_printf(m, "mode:      %u\n", st.mode);
+    seq_printf(m, "bytes_in:  %llu\n", (unsigned long long)st.bytes_in);
+    seq_printf(m, "bytes_out: %llu\n", (unsigned long long)st.bytes_out);
+    seq_printf(m, "commits:   %llu\n", (unsigned long long)st.commits);
+    seq_printf(m, "releases:  %llu\n", (unsigned long long)st.releases);
+    seq_printf(m, "data_events:  %llu\n", (unsigned long long)READ_ONCE(dev->data_evt.fired));
+    seq_printf(m, "space_events: %llu\n", (unsigned long long)READ_ONCE(dev->space_evt.fired));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vfifo_debug_status);
+
+#if IS_ENABLED(CONFIG_VFIFO_LOCK_STAT)
+static const char * const vfifo_ls_names[VFIFO_LS_NR] = {
+    [VFIFO_LS_RESERVE] = "reserve (resv_lock)",
+    [VFIFO_LS_COMMIT]  = "commit (resv_lock)",
+    [VFIFO_LS_DISCARD] = "discard (resv_lock)",
+    [VFIFO_LS_CLAIM]   = "claim (cons_lock)",
+    [VFIFO_LS_RELEASE] = "release (cons_lock)",
+    [VFIFO_LS_PEEK]    = "peek (cons_lock)",
+    [VFIFO_LS_FILES]   = "open/close (lock)",
+    [VFIFO_LS_RESIZE]  = "resize (lock)",
+    [VFIFO_LS_CTRL]    = "control page (lock)",
+    [VFIFO_LS_DMABUF]  = "dma-buf export (lock)",
+    [VFIFO_LS_SESSION] = "sessions (lock)",
+};
+
+/*
+ * Read without the locks: a count may be a few updates behind its
+ * neighbours, which a histogram does not mind. Empty buckets are left out.
+ */
+static int vfifo_debug_lockstat_show(struct seq_file *m, void *v)
+{
+    struct vfifo_dev *dev = m->private;
+    struct vfifo_lock_stat *ls;
+    int site, i;
+
+    for (site = 0; site < VFIFO_LS_NR; site++) {
+        ls = &dev->lockstat[site];
+        seq_printf(m, "%s: %llu acquisitions, wait max %llu ns, hold max %llu ns\n",
+                   vfifo_ls_names[site], (unsigned long long)READ_ONCE(ls->count),
+                   (unsigned long long)READ_ONCE(ls->wait_max),
+                   (unsigned long long)READ_ONCE(ls->hold_max));
+        if (!READ_ONCE(ls->count))
+            continue;
+        seq_printf(m, "  %12s %12s %12s\n", ">= ns", "wait", "hold");
+        for (i = 0; i < VFIFO_LS_BUCKETS; i++) {
+            if (!READ_ONCE(ls->wait[i]) && !READ_ONCE(ls->hold[i]))
+                continue;
+            seq_printf(m, "  %12llu %12llu %12llu\n", i ? 1ULL << i : 0ULL,
+                       (unsigned long long)READ_ONCE(ls->wait[i]),
+                       (unsigned long long)READ_ONCE(ls->hold[i]));
+        }
+    }
+    return 0;
+}
+
+static int vfifo_debug_lockstat_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, vfifo_debug_lockstat_show, inode->i_private);
+}
+
+/* Any write starts the histograms over; all three locks keep them still meanwhile */
+static ssize_t vfifo_debug_lockstat_write(struct file *file, const char __user *buf,
+                                          size_t count, loff_t *ppos)
+{
+    struct vfifo_dev *dev = file_inode(file)->i_private;
+    unsigned long flags;
+
+    mutex_lock(&dev->lock);
+    spin_lock_irqsave(&dev->resv_lock, flags);
+    spin_lock(&dev->cons_lock);
+    memset(dev->lockstat, 0, sizeof(dev->lockstat));
+    spin_unlock(&dev->cons_lock);
+    spin_unlock_irqrestore(&dev->resv_lock, flags);
+    mutex_unlock(&dev->lock);
+    return count;
+}
+
+static const struct file_operations vfifo_debug_lockstat_fops = {
+    .owner = THIS_MODULE,
+    .open = vfifo_debug_lockstat_open,
+    .read = seq_read,
+    .write = vfifo_debug_lockstat_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+#endif
+
+/* debugfs is optional: every call here copes with its absence */
+static void vfifo_debugfs_add(struct vfifo_dev *dev)
+{
+    dev->debugfs = debugfs_create_dir(dev->name, vfifo_debugfs_root);
+    debugfs_create_file("status", 0444, dev->debugfs, dev, &vfifo_debug_status_fops);
+#if IS_ENABLED(CONFIG_VFIFO_LOCK_STAT)
+    debugfs_create_file("lockstat", 0644, dev->debugfs, dev, &vfifo_debug_lockstat_fops);
+#endif
+}
+
+/* --- In-Kernel API (see vfifo.h) --- */
+
+static void vfifo_dev_free(struct kref *ref)
+{
+    struct vfifo_dev *dev = container_of(ref, struct vfifo_dev, ref);
+    struct vfifo_dev *parent = dev->session_of;
+
+    /* Sessions never go through vfifo_destroy(): their generator and eventfds end here */
+    vfifo_set_mode(dev, false);
+    vfifo_clear_eventfds(dev, NULL);
+    idr_destroy(&dev->session_ids);
+    vfifo_subs_free(dev);
+    vfifo_tee_free(dev);
+    kvfree(dev->lz4_out);
+    if (dev->ctrl_page) {
+        put_page(dev->ctrl_page);
+        fput(dev->ctrl_file);
+    }
+    /* Before the parent is put: a session's pages are charged to it */
+    vfifo_buf_free(dev, dev->buffer, dev->pages, dev->ring.capacity);
+    vfifo_account_del(dev);
+    if (dev->minor >= 0)
+        ida_free(&vfifo_minors, dev->minor);
+
+    /* A session hands its bytes back to the pool */
+    if (parent) {
+        vfifo_lock_at(parent, VFIFO_LS_SESSION);
+        idr_remove(&parent->session_ids, dev->session_id);
+        parent->session_used -= dev->ring.capacity;
+        parent->nr_sessions--;
+        vfifo_unlock_at(parent, VFIFO_LS_SESSION);
+        put_pid(dev->session_pgrp);
+        vfifo_put(parent);
+    }
+    kfree(dev);
+}
+
+struct vfifo_dev *vfifo_get(const char *name)
+{
+    struct vfifo_dev *dev;
+
+    mutex_lock(&vfifo_list_lock);
+    list_for_each_entry(dev, &vfifo_list, node) {
+        if (strcmp(dev->name, name) == 0) {
+            kref_get(&dev->ref);
+            mutex_unlock(&vfifo_list_lock);
+            return dev;
+        }
+    }
+    mutex_unlock(&vfifo_list_lock);
+    return NULL;
+}
+EXPORT_SYMBOL_GPL(vfifo_get);
+
+void vfifo_put(struct vfifo_dev *dev)
+{
+    /* Even when this is not the last reference, so a wrong caller shows up early */
+    might_sleep();
+    kref_put(&dev->ref, vfifo_dev_free);
+}
+EXPORT_SYMBOL_GPL(vfifo_put);
+
+void *vfifo_reserve(struct vfifo_dev *dev, size_t len, u32 *pos)
+{
+    struct vfifo_resv r;
+    int ret;
+
+    if (len > U32_MAX)
+        return ERR_PTR(-EINVAL);
+    /* A record's sub-ring cannot be told from its position alone */
+    if (!vfifo_is_plain(dev))
+        return ERR_PTR(-EOPNOTSUPP);
+    ret = vfifo_reserve_span(dev, len, false, NULL, &r);
+    if (ret)
+        return ERR_PTR(ret);
+
+    *pos = r.pos;
+    return vfifo_ptr(dev, r.pos);
+}
+EXPORT_SYMBOL_GPL(vfifo_reserve);
+
+int vfifo_commit(struct vfifo_dev *dev, u32 pos)
+{
+    return vfifo_commit_span(dev, pos, NULL);
+}
+EXPORT_SYMBOL_GPL(vfifo_commit);
+
+int vfifo_discard(struct vfifo_dev *dev, u32 pos)
+{
+    return vfifo_discard_span(dev, pos, NULL);
+}
+EXPORT_SYMBOL_GPL(vfifo_discard);
+
+int vfifo_enqueue_flow(struct vfifo_dev *dev, u32 flow, const void *data, size_t len)
+{
+    struct vfifo_subring *s;
+
+    if (!dev->subs)
+        return vfifo_enqueue(dev, data, len);
+    s = vfifo_rec_target(dev, flow);
+    return vfifo_rec_enqueue(dev, s, data, len);
+}
+EXPORT_SYMBOL_GPL(vfifo_enqueue_flow);
+
+int vfifo_enqueue(struct vfifo_dev *dev, const void *data, size_t len)
+{
+    ssize_t ret;
+    void *p;
+    u32 pos;
+
+    /* One flow per task, so each producer's records stay in order */
+    if (dev->subs)
+        return vfifo_enqueue_flow(dev, dev->nr_lanes ? U32_MAX : hash_ptr(current, 32),
+                                  data, len);
+    if (dev->tee) {
+        if (len == 0 || len > VFIFO_TEE_MAX_PAGES * PAGE_SIZE)
+            return -EINVAL;
+        ret = vfifo_tee_write(dev, data, NULL, len, true, GFP_ATOMIC);
+        return ret < 0 ? ret : 0;
+    }
+    /* One block, so all or nothing */
+    if (dev->lz4) {
+        if (len == 0 || len > dev->lz4_block)
+            return -EINVAL;
+        ret = vfifo_lz4_write(dev, data, len, &pos);
+        return ret < 0 ? ret : 0;
+    }
+
+    p = vfifo_reserve(dev, len, &pos);
+    if (IS_ERR(p))
+        return PTR_ERR(p);
+
+    memcpy(p, data, len);
+    return vfifo_commit(dev, pos);
+}
+EXPORT_SYMBOL_GPL(vfifo_enqueue);
+
+ssize_t vfifo_dequeue(struct vfifo_dev *dev, void *buf, size_t len, unsigned int flags)
+{
+    struct vfifo_resv r;
+    int ret;
+
+    if (flags & ~VFIFO_DEQUEUE_ALL)
+        return -EINVAL;
+    if (len == 0)
+        return 0;
+    /* Whole records only; VFIFO_DEQUEUE_ALL adds nothing to that */
+    if (dev->nr_queues) {
+        struct vfifo_subring *s = vfifo_queue_pick(dev);
+
+        return s ? vfifo_rec_dequeue(dev, s, buf, NULL, len) : -EAGAIN;
+    }
+    if (dev->subs)
+        return vfifo_rec_dequeue(dev, NULL, buf, NULL, len);
+    /* Sinks and compressed instances hand out what they have; not exactly @len */
+    if (dev->tee_sink)
+        return vfifo_tee_read(dev, buf, NULL, len);
+    if (dev->lz4)
+        return vfifo_lz4_read(dev, buf, len);
+    len = min_t(size_t, len, READ_ONCE(dev->ring.capacity));
+
+    ret = vfifo_claim_span(dev, len, !(flags & VFIFO_DEQUEUE_ALL), &r);
+    if (ret)
+        return ret;
+
+    memcpy(buf, vfifo_ptr(dev, r.pos), r.len);
+    vfifo_release_span(dev, r.pos, r.len);
+    return r.len;
+}
+EXPORT_SYMBOL_GPL(vfifo_dequeue);
+
+/* --- Sysfs Attributes --- */
+
+/* Show current data size */
+static ssize_t size_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%u\n", vfifo_level(vdev, true));
+}
+static DEVICE_ATTR_RO(size);
+
+/* The status snapshot as one line, like /sys/block/<dev>/stat (field order in README.md) */
+static ssize_t stat_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    struct vfifo_status st;
+
+    vfifo_get_status(vdev, &st);
+    return sprintf(buf, "%u %u %u %u %u %llu %llu %llu %llu\n", st.capacity, st.used,
+                   st.head, st.tail, st.mode, (unsigned long long)st.bytes_in,
+                   (unsigned long long)st.bytes_out, (unsigned long long)st.commits,
+                   (unsigned long long)st.releases);
+}
+static DEVICE_ATTR_RO(stat);
+
+/* Show buffer capacity */
+static ssize_t capacity_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%u\n", vdev->sessions ? vdev->session_pool : READ_ONCE(vdev->ring.capacity));
+}
+
+/* Resize the live ring (rounded up to a power of two) */
+static ssize_t capacity_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    u32 val;
+    int ret;
+
+    if (kstrtou32(buf, 0, &val))
+        return -EINVAL;
+
+    ret = vfifo_resize(vdev, val);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(capacity);
+
+/* Bytes of ring memory charged to the device: its rings, and its sessions' */
+static ssize_t mem_used_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%lu\n", READ_ONCE(vdev->pool_pages) << PAGE_SHIFT);
+}
+static DEVICE_ATTR_RO(mem_used);
+
+/* Show/Set auto-generate mode */
+static ssize_t mode_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%d\n", vdev->auto_generate);
+}
+
+static ssize_t mode_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    int val, ret;
+
+    if (kstrtoint(buf, 10, &val))
+        return -EINVAL;
+
+    ret = vfifo_set_mode(vdev, val != 0);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(mode);
+
+/* Generator placement and policy; a running generator changes at once */
+static ssize_t gen_cpu_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%d\n", READ_ONCE(vdev->gen_cpu));
+}
+
+static ssize_t gen_cpu_store(struct device *dev, struct device_attribute *attr,
+                             const char *buf, size_t count)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    int val, ret;
+
+    if (kstrtoint(buf, 0, &val) || val < -1 || val >= (int)nr_cpu_ids ||
+        (val >= 0 && !cpu_online(val)))
+        return -EINVAL;
+    ret = vfifo_gen_set(vdev, &vdev->gen_cpu, val);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(gen_cpu);
+
+static ssize_t gen_rt_prio_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%d\n", READ_ONCE(vdev->gen_rt_prio));
+}
+
+static ssize_t gen_rt_prio_store(struct device *dev, struct device_attribute *attr,
+                                 const char *buf, size_t count)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    int val, ret;
+
+    if (kstrtoint(buf, 0, &val) || val < 0 || val >= MAX_RT_PRIO)
+        return -EINVAL;
+    ret = vfifo_gen_set(vdev, &vdev->gen_rt_prio, val);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(gen_rt_prio);
+
+static ssize_t gen_nice_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%d\n", READ_ONCE(vdev->gen_nice));
+}
+
+static ssize_t gen_nice_store(struct device *dev, struct device_attribute *attr,
+                              const char *buf, size_t count)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    int val, ret;
+
+    if (kstrtoint(buf, 0, &val) || val < MIN_NICE || val > MAX_NICE)
+        return -EINVAL;
+    ret = vfifo_gen_set(vdev, &vdev->gen_nice, val);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(gen_nice);
+
+static ssize_t gen_late_max_ns_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%llu\n", (unsigned long long)READ_ONCE(vdev->gen_late_max_ns));
+}
+static DEVICE_ATTR_RO(gen_late_max_ns);
+
+/* Per-CPU sharding, chosen at load time */
+static ssize_t sharding_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%s\n", vfifo_sharding_names[vdev->sharding]);
+}
+static DEVICE_ATTR_RO(sharding);
+
+/* Multi-queue: how many queues (per-queue counters are in queues/qN/) */
+static ssize_t nr_queues_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%u\n", vdev->nr_queues);
+}
+static DEVICE_ATTR_RO(nr_queues);
+
+/* Priority lanes: how many, and how readers choose among them */
+static ssize_t nr_lanes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%u\n", vdev->nr_lanes);
+}
+static DEVICE_ATTR_RO(nr_lanes);
+
+static ssize_t lane_sched_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%s\n", READ_ONCE(vdev->lane_wrr) ? "wrr" : "strict");
+}
+
+static ssize_t lane_sched_store(struct device *dev, struct device_attribute *attr,
+                                const char *buf, size_t count)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    unsigned long flags;
+    bool wrr;
+
+    if (sysfs_streq(buf, "wrr"))
+        wrr = true;
+    else if (sysfs_streq(buf, "strict"))
+        wrr = false;
+    else
+        return -EINVAL;
+    if (!vdev->nr_lanes)
+        return -EOPNOTSUPP;
+
+    spin_lock_irqsave(&vdev->cons_lock, flags);
+    vdev->lane_wrr = wrr;
+    spin_unlock_irqrestore(&vdev->cons_lock, flags);
+    return count;
+}
+static DEVICE_ATTR_RW(lane_sched);
+
+/* Tee: a source lists its sinks; a sink has a full policy and a drop count */
+static ssize_t tee_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    unsigned int i, n = smp_load_acquire(&vdev->nr_tee);
+    int len = 0;
+
+    for (i = 0; i < n; i++)
+        len += sysfs_emit_at(buf, len, "%s%s", i ? " " : "", vdev->tee[i]->name);
+    return len + sysfs_emit_at(buf, len, "\n");
+}
+static DEVICE_ATTR_RO(tee);
+
+static ssize_t tee_policy_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%s\n", READ_ONCE(vdev->tee_drop) ? "drop" : "block");
+}
+
+static ssize_t tee_policy_store(struct device *dev, struct device_attribute *attr,
+                                const char *buf, size_t count)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    bool drop;
+
+    if (sysfs_streq(buf, "drop"))
+        drop = true;
+    else if (sysfs_streq(buf, "block"))
+        drop = false;
+    else
+        return -EINVAL;
+    if (!vdev->tee_sink)
+        return -EOPNOTSUPP;
+
+    WRITE_ONCE(vdev->tee_drop, drop);
+    /* A source held back by this sink can go on now */
+    if (drop)
+        wake_up_interruptible(&vdev->write_queue);
+    return count;
+}
+static DEVICE_ATTR_RW(tee_policy);
+
+static ssize_t tee_dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%llu\n", (unsigned long long)READ_ONCE(vdev->tee_dropped));
+}
+static DEVICE_ATTR_RO(tee_dropped);
+
+/* Bytes readers claimed but failed to copy out, which could not be given back */
+static ssize_t lost_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    u64 lost = READ_ONCE(vdev->lost);
+    unsigned int i;
+
+    for (i = 0; i < vdev->nr_subs; i++)
+        if (vdev->subs[i])
+            lost += READ_ONCE(vdev->subs[i]->lost);
+    return sprintf(buf, "%llu\n", (unsigned long long)lost);
+}
+static DEVICE_ATTR_RO(lost_bytes);
+
+static ssize_t compress_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%d\n", vdev->lz4);
+}
+static DEVICE_ATTR_RO(compress);
+
+/* Raw bytes written and what they took in the ring, since creation */
+static ssize_t compress_raw_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%llu\n", (unsigned long long)READ_ONCE(vdev->lz4_raw));
+}
+static DEVICE_ATTR_RO(compress_raw_bytes);
+
+static ssize_t compress_stored_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%llu\n", (unsigned long long)READ_ONCE(vdev->lz4_stored));
+}
+static DEVICE_ATTR_RO(compress_stored_bytes);
+
+/* raw / stored, two decimals: 3.50 means the ring holds 3.5x its size */
+static ssize_t compress_ratio_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    u64 raw, stored, r;
+    unsigned long flags;
+    u32 frac;
+
+    spin_lock_irqsave(&vdev->resv_lock, flags);
+    raw = vdev->lz4_raw;
+    stored = vdev->lz4_stored;
+    spin_unlock_irqrestore(&vdev->resv_lock, flags);
+
+    r = stored ? div64_u64(raw * 100, stored) : 100;
+    r = div_u64_rem(r, 100, &frac);
+    return sprintf(buf, "%llu.%02u\n", (unsigned long long)r, frac);
+}
+static DEVICE_ATTR_RO(compress_ratio);
+
+/* CPU time spent compressing and decompressing, in ns */
+static ssize_t compress_ns_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%llu\n", (unsigned long long)READ_ONCE(vdev->lz4_comp_ns));
+}
+static DEVICE_ATTR_RO(compress_ns);
+
+static ssize_t decompress_ns_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%llu\n", (unsigned long long)READ_ONCE(vdev->lz4_decomp_ns));
+}
+static DEVICE_ATTR_RO(decompress_ns);
+
+/* Sessions: the mode, each one's size, and how many are open */
+static ssize_t sessions_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%s\n", vfifo_session_names[vdev->sessions]);
+}
+static DEVICE_ATTR_RO(sessions);
+
+static ssize_t session_size_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%u\n", vdev->session_size);
+}
+static DEVICE_ATTR_RO(session_size);
+
+static ssize_t nr_sessions_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%u\n", READ_ONCE(vdev->nr_sessions));
+}
+static DEVICE_ATTR_RO(nr_sessions);
+
+/* Default for fds without VFIFO_SET_STREAM, in bytes per write; 0: never stream */
+static ssize_t stream_threshold_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%u\n", READ_ONCE(vdev->stream_threshold));
+}
+
+static ssize_t stream_threshold_store(struct device *dev, struct device_attribute *attr,
+                                      const char *buf, size_t count)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    u32 val;
+
+    if (kstrtou32(buf, 0, &val))
+        return -EINVAL;
+    WRITE_ONCE(vdev->stream_threshold, val);
+    return count;
+}
+static DEVICE_ATTR_RW(stream_threshold);
+
+/* Limit on all fds' writes together, in bytes per second; 0: none */
+static ssize_t rate_limit_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%llu\n", (unsigned long long)READ_ONCE(vdev->rate.rate));
+}
+
+static ssize_t rate_limit_store(struct device *dev, struct device_attribute *attr,
+                                const char *buf, size_t count)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    u64 val;
+
+    if (kstrtou64(buf, 0, &val))
+        return -EINVAL;
+    vfifo_bucket_set(&vdev->rate, val, READ_ONCE(vdev->rate.burst));
+    return count;
+}
+static DEVICE_ATTR_RW(rate_limit);
+
+/* Its burst, in bytes; 0: one second's worth */
+static ssize_t rate_burst_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%u\n", READ_ONCE(vdev->rate.burst));
+}
+
+static ssize_t rate_burst_store(struct device *dev, struct device_attribute *attr,
+                                const char *buf, size_t count)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    u32 val;
+
+    if (kstrtou32(buf, 0, &val))
+        return -EINVAL;
+    vfifo_bucket_set(&vdev->rate, READ_ONCE(vdev->rate.rate), val);
+    return count;
+}
+static DEVICE_ATTR_RW(rate_burst);
+
+static ssize_t throttled_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    return sprintf(buf, "%ld\n", atomic_long_read(&vdev->throttled));
+}
+static DEVICE_ATTR_RO(throttled);
+
+/* The device's side of VFIFO_GET_BACKPRESSURE: level fill dev_rate wait_ns */
+static ssize_t backpressure_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct vfifo_dev *vdev = dev_get_drvdata(dev);
+    struct vfifo_backpressure bp;
+
+    vfifo_get_backpressure(vdev, NULL, &bp);
+    return sprintf(buf, "%u %u %u %llu\n", bp.level, bp.fill, bp.dev_rate,
+                   (unsigned long long)bp.wait_ns);
+}
+static DEVICE_ATTR_RO(backpressure);
+
+static struct attribute *vfifo_attrs[] = {
+    &dev_attr_size.attr,
+    &dev_attr_stat.attr,
+    &dev_attr_capacity.attr,
+    &dev_attr_mem_used.attr,
+    &dev_attr_mode.attr,
+    &dev_attr_gen_cpu.attr,
+    &dev_attr_gen_rt_prio.attr,
+    &dev_attr_gen_nice.attr,
+    &dev_attr_gen_late_max_ns.attr,
+    &dev_attr_sharding.attr,
+    &dev_attr_nr_queues.attr,
+    &dev_attr_nr_lanes.attr,
+    &dev_attr_lane_sched.attr,
+    &dev_attr_tee.attr,
+    &dev_attr_tee_policy.attr,
+    &dev_attr_tee_dropped.attr,
+    &dev_attr_lost_bytes.attr,
+    &dev_attr_compress.attr,
+    &dev_attr_compress_raw_bytes.attr,
+    &dev_attr_compress_stored_bytes.attr,
+    &dev_attr_compress_ratio.attr,
+    &dev_attr_compress_ns.attr,
+    &dev_attr_decompress_ns.attr,
+    &dev_attr_stream_threshold.attr,
+    &dev_attr_rate_limit.attr,
+    &dev_attr_rate_burst.attr,
+    &dev_attr_throttled.attr,
+    &dev_attr_backpressure.attr,
+    &dev_attr_sessions.attr,
+    &dev_attr_session_size.attr,
+    &dev_attr_nr_sessions.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(vfifo);
+
+/* --- Sessions --- */
+
+/*
+ * With sessions=fd every open of the device gets a private ring, and with
+ * sessions=pgrp every process group does. A session is a plain vfifo_dev
+ * of its own, so the fd's reads, writes, mmap and ioctls run against it,
+ * under its own locks, exactly as on an ordinary device; the device's
+ * lock is only taken to create, join and free sessions. Their rings come
+ * out of the device's capacity, which becomes a pool: an open that would
+ * overdraw it fails with -ENOSPC.
+ *
+ * Two processes pair up through the id and token that VFIFO_GET_SESSION
+ * hands the creator: VFIFO_JOIN_SESSION moves another fd into that ring.
+ */
+
+/* A new session of @dev, charged to its pool. Called with dev->lock held. */
+static struct vfifo_dev *vfifo_session_new(struct vfifo_dev *dev, struct pid *pgrp)
+{
+    struct vfifo_dev *s;
+    int id;
+
+    if (dev->session_used + dev->session_size > dev->session_pool)
+        return ERR_PTR(-ENOSPC);
+    s = vfifo_dev_alloc_node(dev->session_size, dev->numa_node, dev);
+    if (!s)
+        return ERR_PTR(-ENOMEM);
+    id = idr_alloc_cyclic(&dev->session_ids, s, 1, 0, GFP_KERNEL);
+    if (id < 0) {
+        vfifo_put(s);
+        return ERR_PTR(id);
+    }
+
+    snprintf(s->name, sizeof(s->name), "%s.%d", dev->name, id);
+    s->session_id = id;
+    s->session_token = get_random_u64();
+    s->session_pgrp = get_pid(pgrp);
+    s->stream_threshold = READ_ONCE(dev->stream_threshold);
+    vfifo_bucket_set(&s->rate, READ_ONCE(dev->rate.rate), READ_ONCE(dev->rate.burst));
+    kref_get(&dev->ref);
+    s->session_of = dev;
+    dev->session_used += s->ring.capacity;
+    dev->nr_sessions++;
+    return s;
+}
+
+/* The session a new open of @dev goes to, with a reference for the fd */
+static struct vfifo_dev *vfifo_session_open(struct vfifo_dev *dev)
+{
+    struct pid *pgrp = dev->sessions == VFIFO_SESSION_PGRP ? task_pgrp(current) : NULL;
+    struct vfifo_dev *s;
+    int id;
+
+    vfifo_lock_at(dev, VFIFO_LS_SESSION);
+    if (pgrp) {
+        idr_for_each_entry(&dev->session_ids, s, id)
+            /* One on its way out does not count: make a new one */
+            if (s->session_pgrp == pgrp && kref_get_unless_zero(&s->ref))
+                goto out;
+    }
+    s = vfifo_session_new(dev, pgrp);
+out:
+    vfifo_unlock_at(dev, VFIFO_LS_SESSION);
+    return s;
+}
+
+/*
+ * Move @vf into the session named by @req. What the fd still holds in its
+ * old session is let go, and the old session stays referenced until the
+ * fd is closed, since calls already running on the fd may still be in it.
+ * So an fd joins at most once.
+ */
+static int vfifo_session_join(struct vfifo_file *vf, const struct vfifo_session *req)
+{
+    struct vfifo_dev *old = vf->dev, *dev = old->session_of, *s;
+
+    if (!dev)
+        return -EOPNOTSUPP;
+
+    vfifo_lock_at(dev, VFIFO_LS_SESSION);
+    s = idr_find(&dev->session_ids, req->id);
+    /* A wrong token looks like no session at all */
+    if (s && (s->session_token != req->token || !kref_get_unless_zero(&s->ref)))
+        s = NULL;
+    vfifo_unlock_at(dev, VFIFO_LS_SESSION);
+    if (!s)
+        return -ENOENT;
+    if (s == old || cmpxchg(&vf->parked, NULL, old)) {
+        vfifo_put(s);
+        return s == old ? 0 : -EBUSY;
+    }
+
+    vfifo_abandon_reservations(old, vf->filp);
+    vfifo_clear_eventfds(old, vf->filp);
+    vfifo_lock_at(old, VFIFO_LS_FILES);
+    list_del(&vf->node);
+    vfifo_unlock_at(old, VFIFO_LS_FILES);
+    vfifo_lock_at(s, VFIFO_LS_FILES);
+    list_add(&vf->node, &s->files);
+    vfifo_unlock_at(s, VFIFO_LS_FILES);
+    WRITE_ONCE(vf->dev, s);
+    return 0;
+}
+
+/* --- File Operations --- */
+
+/*
+ * Pages are inserted on fault rather than all at mmap() time, so a resize
+ * can zap the mappings and let them refault onto the new buffer.
+ */
+static vm_fault_t vfifo_vm_fault(struct vm_fault *vmf)
+{
+    struct vfifo_dev *dev = vmf->vma->vm_private_data;
+    vm_fault_t ret = VM_FAULT_SIGBUS;
+    struct page *page;
+
+    down_read(&dev->buf_sem);
+    if ((vmf->pgoff << PAGE_SHIFT) < dev->ring.capacity) {
+        page = dev->pages[vmf->pgoff];
+        get_page(page);
+        vmf->page = page;
+        ret = 0;
+    }
+    up_read(&dev->buf_sem);
+    return ret;
+}
+
+/*
+ * Every mapping holds a device reference of its own, so the ring outlives
+ * vfifo_destroy() and the fd (or dma-buf) it was mapped through. The first
+ * is taken by whoever sets vfifo_vm_ops; ->open covers splits and forks.
+ */
+static void vfifo_vm_open(struct vm_area_struct *vma)
+{
+    struct vfifo_dev *dev = vma->vm_private_data;
+
+    kref_get(&dev->ref);
+}
+
+static void vfifo_vm_close(struct vm_area_struct *vma)
+{
+    vfifo_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct vfifo_vm_ops = {
+    .open = vfifo_vm_open,
+    .close = vfifo_vm_close,
+    .fault = vfifo_vm_fault,
+};
+
+/*
+ * The control page comes from a shmem file of its own rather than
+ * alloc_page(): a futex shared between processes is keyed by the page's
+ * mapping and index, which a bare driver page lacks (FUTEX_WAIT would fail
+ * with -EFAULT). It is kept off the LRU so reclaim cannot swap it out from
+ * under the key, and lives until the device is freed.
+ */
+static int vfifo_ctrl_alloc(struct vfifo_dev *dev)
+{
+    struct file *file;
+    struct page *page;
+    int ret = 0;
+
+    vfifo_lock_at(dev, VFIFO_LS_CTRL);
+    if (dev->ctrl)
+        goto out;
+
+    file = shmem_file_setup("vfifo-ctrl", PAGE_SIZE, VM_NORESERVE);
+    if (IS_ERR(file)) {
+        ret = PTR_ERR(file);
+        goto out;
+    }
+    mapping_set_unevictable(file->f_mapping);
+    page = shmem_read_mapping_page_gfp(file->f_mapping, 0, GFP_KERNEL);
+    if (IS_ERR(page)) {
+        fput(file);
+        ret = PTR_ERR(page);
+        goto out;
+    }
+    dev->ctrl_file = file;
+    dev->ctrl_page = page;
+    /* Pairs with vfifo_ctrl_bump(): nobody sees the page before it is whole */
+    smp_store_release(&dev->ctrl, (struct vfifo_ctrl *)page_address(page));
+out:
+    vfifo_unlock_at(dev, VFIFO_LS_CTRL);
+    return ret;
+}
+
+static vm_fault_t vfifo_ctrl_fault(struct vm_fault *vmf)
+{
+    struct vfifo_dev *dev = vmf->vma->vm_private_data;
+
+    get_page(dev->ctrl_page);
+    vmf->page = dev->ctrl_page;
+    return 0;
+}
+
+static const struct vm_operations_struct vfifo_ctrl_vm_ops = {
+    .fault = vfifo_ctrl_fault,
+};
+
+/* One shared page, on every layout: the sequence words follow them all */
+static int vfifo_ctrl_mmap(struct vfifo_dev *dev, struct vm_area_struct *vma)
+{
+    int ret;
+
+    if (vma->vm_end - vma->vm_start != PAGE_SIZE || !(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+    ret = vfifo_ctrl_alloc(dev);
+    if (ret)
+        return ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+    vma->vm_private_data = dev;
+    vma->vm_ops = &vfifo_ctrl_vm_ops;
+    return 0;
+}
+
+static int vfifo_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct vfifo_file *vf = filp->private_data;
+    struct vfifo_dev *dev = vf->dev;
+    unsigned long len = vma->vm_end - vma->vm_start;
+
+    if (vma->vm_pgoff == VFIFO_CTRL_OFFSET >> PAGE_SHIFT)
+        return vfifo_ctrl_mmap(dev, vma);
+
+    /* Sub-ring and tee data is not in the one mappable buffer */
+    if (!vfifo_is_plain(dev))
+        return -EOPNOTSUPP;
+
+    /* The mapping must lie inside the buffer (after a resize, map again) */
+    if ((vma->vm_pgoff << PAGE_SHIFT) + len > READ_ONCE(dev->ring.capacity))
+        return -EINVAL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+    vma->vm_private_data = dev;
+    vma->vm_ops = &vfifo_vm_ops;
+    vfifo_vm_open(vma);
+    return 0;
+}
+
+/*
+ * dma-buf export: the ring's pages, the same ones vfifo_mmap() maps, as
+ * one buffer of 'capacity' bytes that other drivers can import. Every
+ * export holds a device reference, and the ring cannot be resized while
+ * any is alive. Each attachment's mapping is remembered so CPU access
+ * brackets can sync it for the CPU and hand it back to the device.
+ * Needs CONFIG_VFIFO_DMABUF; without it the ioctl fails with -EOPNOTSUPP.
+ */
+#if IS_ENABLED(CONFIG_VFIFO_DMABUF)
+struct vfifo_dmabuf {
+    struct vfifo_dev *dev;
+    struct mutex lock;              /* Guards 'attachments' */
+    struct list_head attachments;
+};
+
+struct vfifo_dmabuf_attach {
+    struct list_head node;
+    struct device *dev;
+    struct sg_table *sgt;           /* While mapped */
+    enum dma_data_direction dir;
+};
+
+static int vfifo_dmabuf_attach(struct dma_buf *dmabuf, struct dma_buf_attachment *attach)
+{
+    struct vfifo_dmabuf *vd = dmabuf->priv;
+    struct vfifo_dmabuf_attach *a;
+
+    a = kzalloc(sizeof(*a), GFP_KERNEL);
+    if (!a)
+        return -ENOMEM;
+    a->dev = attach->dev;
+    attach->priv = a;
+    mutex_lock(&vd->lock);
+    list_add(&a->node, &vd->attachments);
+    mutex_unlock(&vd->lock);
+    return 0;
+}
+
+static void vfifo_dmabuf_detach(struct dma_buf *dmabuf, struct dma_buf_attachment *attach)
+{
+    struct vfifo_dmabuf *vd = dmabuf->priv;
+    struct vfifo_dmabuf_attach *a = attach->priv;
+
+    mutex_lock(&vd->lock);
+    list_del(&a->node);
+    mutex_unlock(&vd->lock);
+    kfree(a);
+}
+
+static struct sg_table *vfifo_dmabuf_map(struct dma_buf_attachment *attach,
+                                         enum dma_data_direction dir)
+{
+    struct vfifo_dmabuf *vd = attach->dmabuf->priv;
+    struct vfifo_dmabuf_attach *a = attach->priv;
+    struct vfifo_dev *dev = vd->dev;
+    struct sg_table *sgt;
+    int ret;
+
+    sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+    if (!sgt)
+        return ERR_PTR(-ENOMEM);
+    ret = sg_alloc_table_from_pages(sgt, dev->pages, dev->ring.capacity >> PAGE_SHIFT,
+                                    0, dev->ring.capacity, GFP_KERNEL);
+    if (ret)
+        goto fail_free;
+    ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+    if (ret)
+        goto fail_table;
+
+    mutex_lock(&vd->lock);
+    a->sgt = sgt;
+    a->dir = dir;
+    mutex_unlock(&vd->lock);
+    return sgt;
+
+fail_table:
+    sg_free_table(sgt);
+fail_free:
+    kfree(sgt);
+    return ERR_PTR(ret);
+}
+
+static void vfifo_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt,
+                               enum dma_data_direction dir)
+{
+    struct vfifo_dmabuf *vd = attach->dmabuf->priv;
+    struct vfifo_dmabuf_attach *a = attach->priv;
+
+    mutex_lock(&vd->lock);
+    a->sgt = NULL;
+    mutex_unlock(&vd->lock);
+    dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+/*
+ * Sync @a for a CPU access in @dir, as asked, so a read-only access does not
+ * pay for write-back. A mapping made for one direction only is synced in
+ * that one: the DMA API allows nothing else.
+ */
+static enum dma_data_direction vfifo_dmabuf_sync_dir(const struct vfifo_dmabuf_attach *a,
+                                                     enum dma_data_direction dir)
+{
+    return a->dir == DMA_BIDIRECTIONAL ? dir : a->dir;
+}
+
+/* Make what the importers' devices wrote visible to the CPU... */
+static int vfifo_dmabuf_begin_cpu(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+    struct vfifo_dmabuf *vd = dmabuf->priv;
+    struct vfifo_dmabuf_attach *a;
+
+    mutex_lock(&vd->lock);
+    list_for_each_entry(a, &vd->attachments, node)
+        if (a->sgt)
+            dma_sync_sgtable_for_cpu(a->dev, a->sgt, vfifo_dmabuf_sync_dir(a, dir));
+    mutex_unlock(&vd->lock);
+    return 0;
+}
+
+/* ...and what the CPU wrote visible to the devices */
+static int vfifo_dmabuf_end_cpu(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+    struct vfifo_dmabuf *vd = dmabuf->priv;
+    struct vfifo_dmabuf_attach *a;
+
+    mutex_lock(&vd->lock);
+    list_for_each_entry(a, &vd->attachments, node)
+        if (a->sgt)
+            dma_sync_sgtable_for_device(a->dev, a->sgt, vfifo_dmabuf_sync_dir(a, dir));
+    mutex_unlock(&vd->lock);
+    return 0;
+}
+
+/* Same pages, same fault handler as mapping the device itself */
+static int vfifo_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+    struct vfifo_dmabuf *vd = dmabuf->priv;
+
+    if ((vma->vm_pgoff << PAGE_SHIFT) + (vma->vm_end - vma->vm_start) > dmabuf->size)
+        return -EINVAL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+    vma->vm_private_data = vd->dev;
+    vma->vm_ops = &vfifo_vm_ops;
+    vfifo_vm_open(vma);
+    return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+/* The ring is already mapped in the kernel, contiguously from its start */
+static int vfifo_dmabuf_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+    struct vfifo_dmabuf *vd = dmabuf->priv;
+
+    iosys_map_set_vaddr(map, vd->dev->buffer);
+    return 0;
+}
+#endif
+
+static void vfifo_dmabuf_release(struct dma_buf *dmabuf)
+{
+    struct vfifo_dmabuf *vd = dmabuf->priv;
+
+    atomic_dec(&vd->dev->dmabufs);
+    vfifo_put(vd->dev);
+    kfree(vd);
+}
+
+static const struct dma_buf_ops vfifo_dmabuf_ops = {
+    .attach = vfifo_dmabuf_attach,
+    .detach = vfifo_dmabuf_detach,
+    .map_dma_buf = vfifo_dmabuf_map,
+    .unmap_dma_buf = vfifo_dmabuf_unmap,
+    .begin_cpu_access = vfifo_dmabuf_begin_cpu,
+    .end_cpu_access = vfifo_dmabuf_end_cpu,
+    .mmap = vfifo_dmabuf_mmap,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+    .vmap = vfifo_dmabuf_vmap,
+#endif
+    .release = vfifo_dmabuf_release,
+};
+
+/* A new dma-buf of the ring, holding a device reference */
+static struct dma_buf *vfifo_dmabuf_create(struct vfifo_dev *dev)
+{
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct vfifo_dmabuf *vd;
+    struct dma_buf *dmabuf;
+
+    if (!vfifo_is_plain(dev))
+        return ERR_PTR(-EOPNOTSUPP);
+    vd = kzalloc(sizeof(*vd), GFP_KERNEL);
+    if (!vd)
+        return ERR_PTR(-ENOMEM);
+    vd->dev = dev;
+    mutex_init(&vd->lock);
+    INIT_LIST_HEAD(&vd->attachments);
+
+    exp_info.ops = &vfifo_dmabuf_ops;
+    exp_info.flags = O_RDWR;
+    exp_info.priv = vd;
+
+    /* Excludes a resize, which would swap the pages under the export */
+    vfifo_lock_at(dev, VFIFO_LS_DMABUF);
+    exp_info.size = dev->ring.capacity;
+    dmabuf = dma_buf_export(&exp_info);
+    if (!IS_ERR(dmabuf)) {
+        atomic_inc(&dev->dmabufs);
+        kref_get(&dev->ref);
+    }
+    vfifo_unlock_at(dev, VFIFO_LS_DMABUF);
+    if (IS_ERR(dmabuf))
+        kfree(vd);
+    return dmabuf;
+}
+
+/* A new dma-buf of the ring; returns its fd */
+static int vfifo_dmabuf_export(struct vfifo_dev *dev, u32 flags)
+{
+    struct dma_buf *dmabuf;
+    int fd;
+
+    if (flags & ~VFIFO_DMABUF_CLOEXEC)
+        return -EINVAL;
+    dmabuf = vfifo_dmabuf_create(dev);
+    if (IS_ERR(dmabuf))
+        return PTR_ERR(dmabuf);
+
+    fd = dma_buf_fd(dmabuf, (flags & VFIFO_DMABUF_CLOEXEC) ? O_CLOEXEC : 0);
+    if (fd < 0)
+        dma_buf_put(dmabuf);    /* Releases vd and the reference */
+    return fd;
+}
+#else
+static int vfifo_dmabuf_export(struct vfifo_dev *dev, u32 flags) { return -EOPNOTSUPP; }
+#endif
+
+static long vfifo_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct vfifo_file *vf = filp->private_data;
+    struct vfifo_dev *dev = vf->dev;
+    struct vfifo_reservation req;
+    struct vfifo_status status;
+    struct vfifo_backpressure bp;
+    struct vfifo_session session;
+    struct vfifo_stream stream;
+    struct vfifo_rate rate;
+    struct vfifo_eventfd efd;
+    struct vfifo_flow flow;
+    struct vfifo_lane lane;
+    struct vfifo_span span;
+    struct vfifo_resv r;
+    int ret = 0;
+    int val;
+    u32 pos, len;
+
+    /* The span protocol addresses the single ring */
+    if (!vfifo_is_plain(dev) && (cmd == VFIFO_RESERVE || cmd == VFIFO_COMMIT ||
+                          cmd == VFIFO_PEEK || cmd == VFIFO_CONSUME))
+        return -EOPNOTSUPP;
+
+    switch (cmd) {
+    case VFIFO_CLEAR:
+        vfifo_clear(dev);
+        break;
+
+    case VFIFO_RESERVE:
+        if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+            return -EFAULT;
+        if (req.flags & ~VFIFO_RESERVE_PARTIAL)
+            return -EINVAL;
+        ret = vfifo_rate_admit(vf, dev, req.len, filp->f_flags & O_NONBLOCK);
+        if (ret)
+            return ret;
+        while ((ret = vfifo_reserve_span(dev, req.len, req.flags & VFIFO_RESERVE_PARTIAL,
+                                         filp, &r)) == -EAGAIN) {
+            if (filp->f_flags & O_NONBLOCK)
+                break;
+            if (wait_event_interruptible(dev->write_queue,
+                    vfifo_can_reserve(dev, (req.flags & VFIFO_RESERVE_PARTIAL) ? 1 : req.len))) {
+                ret = -ERESTARTSYS;
+                break;
+            }
+        }
+        vfifo_rate_refund(vf, dev, req.len, ret ? ret : r.len);
+        if (ret)
+            return ret;
+        req.len = r.len;
+        req.pos = r.pos;
+        req.offset = r.pos & (dev->ring.capacity - 1);
+        if (copy_to_user((void __user *)arg, &req, sizeof(req))) {
+            vfifo_discard_span(dev, r.pos, filp);
+            return -EFAULT;
+        }
+        break;
+
+    case VFIFO_COMMIT:
+        if (copy_from_user(&pos, (u32 __user *)arg, sizeof(pos)))
+            return -EFAULT;
+        ret = vfifo_commit_span(dev, pos, filp);
+        break;
+
+    case VFIFO_PEEK:
+        while ((len = vfifo_peek_span(dev, &pos)) == 0) {
+            if (filp->f_flags & O_NONBLOCK)
+                return -EAGAIN;
+            if (wait_event_interruptible(dev->read_queue, vfifo_can_claim(dev, 1)))
+                return -ERESTARTSYS;
+        }
+        memset(&span, 0, sizeof(span));
+        span.pos = pos;
+        span.offset = pos & (dev->ring.capacity - 1);
+        span.len = len;
+        if (copy_to_user((void __user *)arg, &span, sizeof(span)))
+            return -EFAULT;
+        break;
+
+    case VFIFO_CONSUME:
+        if (copy_from_user(&len, (u32 __user *)arg, sizeof(len)))
+            return -EFAULT;
+        if (len == 0)
+            break;
+        /* -EAGAIN if fewer than 'len' bytes are readable */
+        ret = vfifo_claim_span(dev, len, false, &r);
+        if (ret == 0)
+            vfifo_release_span(dev, r.pos, r.len);
+        break;
+
+    case VFIFO_RESIZE:
+        if (copy_from_user(&len, (u32 __user *)arg, sizeof(len)))
+            return -EFAULT;
+        ret = vfifo_resize(dev, len);
+        break;
+
+    case VFIFO_SET_EVENTFD:
+        if (copy_from_user(&efd, (void __user *)arg, sizeof(efd)))
+            return -EFAULT;
+        ret = vfifo_set_eventfd(dev, filp, &efd);
+        break;
+
+    case VFIFO_SET_MODE:
+        if (copy_from_user(&val, (int __user *)arg, sizeof(val)))
+            return -EFAULT;
+        ret = vfifo_set_mode(dev, val != 0);
+        break;
+
+    case VFIFO_SET_FLOW:
+        if (!dev->nr_queues)
+            return -EOPNOTSUPP;
+        if (copy_from_user(&flow, (void __user *)arg, sizeof(flow)))
+            return -EFAULT;
+        if (flow.flags & ~VFIFO_FLOW_HEADER)
+            return -EINVAL;
+        WRITE_ONCE(vf->key, flow.key);
+        WRITE_ONCE(vf->key_in_header, !!(flow.flags & VFIFO_FLOW_HEADER));
+        break;
+
+    case VFIFO_SET_LANE:
+        if (!dev->nr_lanes)
+            return -EOPNOTSUPP;
+        if (copy_from_user(&lane, (void __user *)arg, sizeof(lane)))
+            return -EFAULT;
+        if (lane.flags & ~VFIFO_LANE_HEADER)
+            return -EINVAL;
+        if (lane.lane >= dev->nr_lanes && !(lane.flags & VFIFO_LANE_HEADER))
+            return -EINVAL;
+        WRITE_ONCE(vf->key, lane.lane);
+        WRITE_ONCE(vf->key_in_header, !!(lane.flags & VFIFO_LANE_HEADER));
+        break;
+
+    case VFIFO_BIND_QUEUE:
+        if (!dev->nr_queues)
+            return -EOPNOTSUPP;
+        if (copy_from_user(&val, (int __user *)arg, sizeof(val)))
+            return -EFAULT;
+        if (val < -1 || val >= (int)dev->nr_queues)
+            return -EINVAL;
+        WRITE_ONCE(vf->queue, val);
+        break;
+
+    case VFIFO_SET_STREAM:
+        if (copy_from_user(&stream, (void __user *)arg, sizeof(stream)))
+            return -EFAULT;
+        if (stream.flags & ~VFIFO_STREAM_DEVICE)
+            return -EINVAL;
+        WRITE_ONCE(vf->stream_threshold, stream.threshold);
+        WRITE_ONCE(vf->stream_own, !(stream.flags & VFIFO_STREAM_DEVICE));
+        break;
+
+    case VFIFO_SET_RATE:
+        if (copy_from_user(&rate, (void __user *)arg, sizeof(rate)))
+            return -EFAULT;
+        if (rate.reserved)
+            return -EINVAL;
+        vfifo_bucket_set(&vf->rate, rate.rate, rate.burst);
+        break;
+
+    case VFIFO_GET_BACKPRESSURE:
+        vfifo_get_backpressure(dev, vf, &bp);
+        if (copy_to_user((void __user *)arg, &bp, sizeof(bp)))
+            return -EFAULT;
+        break;
+
+    case VFIFO_GET_STATUS:
+        vfifo_get_status(dev, &status);
+        if (copy_to_user((void __user *)arg, &status, sizeof(status)))
+            return -EFAULT;
+        break;
+
+    case VFIFO_GET_SESSION:
+        if (!dev->session_of)
+            return -EOPNOTSUPP;
+        memset(&session, 0, sizeof(session));
+        session.id = dev->session_id;
+        session.token = dev->session_token;
+        if (copy_to_user((void __user *)arg, &session, sizeof(session)))
+            return -EFAULT;
+        break;
+
+    case VFIFO_JOIN_SESSION:
+        if (copy_from_user(&session, (void __user *)arg, sizeof(session)))
+            return -EFAULT;
+        ret = vfifo_session_join(vf, &session);
+        break;
+
+    /* Returns the new fd */
+    case VFIFO_EXPORT_DMABUF:
+        if (copy_from_user(&val, (int __user *)arg, sizeof(val)))
+            return -EFAULT;
+        ret = vfifo_dmabuf_export(dev, val);
+        break;
+
+    default:
+        return -ENOTTY;
+    }
+    return ret;
+}
+
+/* Every fd holds a reference on its device, which outlives vfifo_destroy() */
+static int vfifo_open(struct inode *inode, struct file *filp)
+{
+    struct vfifo_dev *dev, *s;
+    struct vfifo_file *vf;
+
+    mutex_lock(&vfifo_list_lock);
+    dev = vfifo_minor_devs[iminor(inode)];
+    if (dev)
+        kref_get(&dev->ref);
+    mutex_unlock(&vfifo_list_lock);
+    if (!dev)
+        return -ENODEV;
+
+    vf = kzalloc(sizeof(*vf), GFP_KERNEL);
+    if (!vf) {
+        vfifo_put(dev);
+        return -ENOMEM;
+    }
+    /* From here on the fd sees its session as its device; the session holds the device */
+    if (dev->sessions) {
+        s = vfifo_session_open(dev);
+        vfifo_put(dev);
+        if (IS_ERR(s)) {
+            kfree(vf);
+            return PTR_ERR(s);
+        }
+        dev = s;
+    }
+    vf->dev = dev;
+    vf->filp = filp;
+    /* Until told otherwise, all writes through one fd are one flow, in the lowest lane */
+    vf->key = dev->nr_lanes ? dev->nr_lanes - 1 : hash_ptr(filp, 32);
+    vf->queue = -1;
+    vfifo_bucket_init(&vf->rate);
+
+    vfifo_lock_at(dev, VFIFO_LS_FILES);
+    list_add(&vf->node, &dev->files);
+    vfifo_unlock_at(dev, VFIFO_LS_FILES);
+
+    filp->private_data = vf;
+    return 0;
+}
+
+static int vfifo_release(struct inode *inode, struct file *filp)
+{
+    struct vfifo_file *vf = filp->private_data;
+    struct vfifo_dev *dev = vf->dev;
+
+    /* A producer that dies mid-fill must not stall everyone behind it */
+    vfifo_abandon_reservations(dev, filp);
+    vfifo_clear_eventfds(dev, filp);
+
+    vfifo_lock_at(dev, VFIFO_LS_FILES);
+    list_del(&vf->node);
+    vfifo_unlock_at(dev, VFIFO_LS_FILES);
+
+    if (vf->parked) {
+        vfifo_abandon_reservations(vf->parked, filp);
+        vfifo_clear_eventfds(vf->parked, filp);
+        vfifo_put(vf->parked);
+    }
+    vfifo_put(dev);
+    kfree(vf);
+    return 0;
+}
+
+static ssize_t vfifo_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct vfifo_file *vf = filp->private_data;
+    struct vfifo_dev *dev = vf->dev;
+    struct vfifo_resv r;
+    u32 left;
+    int ret;
+
+    if (count == 0)
+        return 0;
+    if (dev->subs)
+        return vfifo_rec_read(filp, buf, count);
+    if (dev->tee_sink)
+        return vfifo_tee_read_wait(filp, buf, count);
+    if (dev->lz4)
+        return vfifo_lz4_read_user(filp, buf, count);
+    count = min_t(size_t, count, READ_ONCE(dev->ring.capacity));
+
+    /* Claim data: readers only serialise on this short step */
+    while ((ret = vfifo_claim_span(dev, count, true, &r)) == -EAGAIN) {
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->read_queue, vfifo_can_claim(dev, 1)))
+            return -ERESTARTSYS;
+    }
+    if (ret)
+        return ret;
+
+    /* Copy unlocked; bytes we fail to copy stay queued where possible */
+    left = copy_to_user(buf, vfifo_ptr(dev, r.pos), r.len);
+    vfifo_release_span(dev, r.pos, r.len - left);
+    return left == r.len ? -EFAULT : r.len - left;
+}
+
+/*
+ * Streaming writes: a bulk producer whose data nobody in the kernel reads
+ * again before the consumer does gains nothing from leaving it in the CPU
+ * caches, and the copy would push out the working set of everything else
+ * sharing the LLC. Spans of at least the threshold are therefore copied
+ * with non-temporal stores (where the architecture has them; elsewhere
+ * this is a plain copy). Small writes stay cached: the consumer is likely
+ * to read them while they are still hot, and the non-temporal path has a
+ * fixed cost of its own.
+ */
+static u32 vfifo_stream_threshold(struct vfifo_file *vf)
+{
+    return READ_ONCE(vf->stream_own) ? READ_ONCE(vf->stream_threshold) :
+                                       READ_ONCE(vf->dev->stream_threshold);
+}
+
+/* Is a span of @len bytes big enough to bypass the caches? */
+static bool vfifo_stream_span(struct vfifo_file *vf, u32 len)
+{
+    u32 threshold = vfifo_stream_threshold(vf);
+
+    return threshold && len >= threshold;
+}
+
+static unsigned long vfifo_copy_from_user_nocache(void *dst, const void __user *src, u32 len)
+{
+    unsigned long left;
+
+    if (!access_ok(src, len))
+        return len;
+    left = __copy_from_user_inatomic_nocache(dst, src, len);
+    /* Non-temporal stores are weakly ordered: drain them before the commit publishes them */
+    wmb();
+    return left;
+}
+
+/* The write proper, once the rate limits have let it through */
+static ssize_t vfifo_write_dev(struct file *filp, struct vfifo_dev *dev,
+                               const char __user *buf, size_t count)
+{
+    struct vfifo_file *vf = filp->private_data;
+    unsigned long left;
+    struct vfifo_resv r;
+    int ret;
+
+    if (dev->subs)
+        return vfifo_rec_write(filp, buf, count);
+    if (dev->tee)
+        return vfifo_tee_write(dev, NULL, buf, count, filp->f_flags & O_NONBLOCK, GFP_KERNEL);
+    if (dev->tee_sink)
+        return -EOPNOTSUPP;
+    if (dev->lz4)
+        return vfifo_lz4_write_user(filp, buf, count);
+    /* Only a hint (a resize may race); reserve rechecks under the lock */
+    count = min_t(size_t, count, READ_ONCE(dev->ring.capacity));
+
+    /* Claim space: a short critical section, not the whole copy */
+    while ((ret = vfifo_reserve_span(dev, count, true, NULL, &r)) == -EAGAIN) {
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->write_queue, vfifo_can_reserve(dev, 1)))
+            return -ERESTARTSYS;
+    }
+    if (ret)
+        return ret;
+
+    /* The copy runs unlocked, in parallel with other producers */
+    if (vfifo_stream_span(vf, r.len))
+        left = vfifo_copy_from_user_nocache(vfifo_ptr(dev, r.pos), buf, r.len);
+    else
+        left = copy_from_user(vfifo_ptr(dev, r.pos), buf, r.len);
+    if (left) {
+        vfifo_discard_span(dev, r.pos, NULL);
+        return -EFAULT;
+    }
+
+    vfifo_commit_span(dev, r.pos, NULL);
+    return r.len;
+}
+
+static ssize_t vfifo_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct vfifo_file *vf = filp->private_data;
+    struct vfifo_dev *dev = vf->dev;
+    u32 len = min_t(size_t, count, U32_MAX);
+    ssize_t ret;
+
+    if (count == 0)
+        return 0;
+    ret = vfifo_rate_admit(vf, dev, len, filp->f_flags & O_NONBLOCK);
+    if (ret)
+        return ret;
+    ret = vfifo_write_dev(filp, dev, buf, count);
+    vfifo_rate_refund(vf, dev, len, ret);
+    return ret;
+}
+
+/* --- Init and Exit --- */
+
+/*
+ * A ring and its state, not yet visible as a device. Freed by vfifo_put().
+ * Its memory is charged to @acct, or with NULL to an account of its own.
+ */
+static struct vfifo_dev *vfifo_dev_alloc_node(u32 capacity, int node, struct vfifo_dev *acct)
+{
+    struct vfifo_dev *dev;
+
+    dev = kzalloc_node(sizeof(struct vfifo_dev), GFP_KERNEL, node);
+    if (!dev)
+        return NULL;
+
+    kref_init(&dev->ref);
+    dev->minor = -1;
+
+    if (acct)
+        dev->pool_acct = acct;
+    else
+        vfifo_account_add(dev);
+    dev->numa_node = node;
+    vfifo_ring_init(&dev->ring, capacity, 0);
+    dev->buffer = vfifo_buf_alloc(dev, capacity, node, &dev->pages);
+    if (!dev->buffer) {
+        vfifo_account_del(dev);
+        kfree(dev);
+        return NULL;
+    }
+
+    mutex_init(&dev->lock);
+    spin_lock_init(&dev->resv_lock);
+    spin_lock_init(&dev->cons_lock);
+    init_rwsem(&dev->buf_sem);
+    INIT_LIST_HEAD(&dev->files);
+    spin_lock_init(&dev->evt_lock);
+    init_waitqueue_head(&dev->read_queue);
+    init_waitqueue_head(&dev->write_queue);
+    vfifo_bucket_init(&dev->rate);
+
+    seqcount_init(&dev->prod_seq);
+    seqcount_init(&dev->cons_seq);
+    idr_init(&dev->session_ids);
+    mutex_init(&dev->gen_lock);
+    dev->auto_generate = false;
+    dev->gen_interval_ms = 1000;
+    dev->gen_cpu = -1;
+    return dev;
+}
+
+static struct vfifo_dev *vfifo_dev_alloc(u32 capacity)
+{
+    return vfifo_dev_alloc_node(capacity, NUMA_NO_NODE, NULL);
+}
+
+/* Check a configuration and round its capacity to what the ring needs */
+static int vfifo_config_check(struct vfifo_config *cfg)
+{
+    if (cfg->capacity == 0 || cfg->capacity > VFIFO_MAX_CAPACITY)
+        return -EINVAL;
+    /*
+     * Page aligned for mmap, and a power of two so ring positions can run
+     * freely and wrap with a mask instead of a division.
+     */
+    cfg->capacity = roundup_pow_of_two(PAGE_ALIGN(cfg->capacity));
+
+    if (cfg->node != NUMA_NO_NODE && (cfg->node < 0 || cfg->node >= MAX_NUMNODES ||
+                                      !node_online(cfg->node)))
+        return -EINVAL;
+    /* Queues are steered by flow, shards by CPU: one or the other */
+    if (cfg->nr_queues > VFIFO_MAX_QUEUES || (cfg->nr_queues && cfg->sharding))
+        return -EINVAL;
+    /* ...and lanes by priority */
+    if (cfg->nr_lanes > VFIFO_MAX_LANES || (cfg->nr_lanes && (cfg->nr_queues || cfg->sharding)))
+        return -EINVAL;
+    /* Compressed blocks live in the one byte ring */
+    if (cfg->compress && (cfg->nr_lanes || cfg->nr_queues || cfg->sharding))
+        return -EINVAL;
+    /* Sessions are plain rings, carved out of the capacity */
+    if (cfg->sessions) {
+        if (cfg->nr_lanes || cfg->nr_queues || cfg->sharding || cfg->compress)
+            return -EINVAL;
+        if (cfg->session_size == 0 || cfg->session_size > cfg->capacity)
+            return -EINVAL;
+        cfg->session_size = roundup_pow_of_two(PAGE_ALIGN(cfg->session_size));
+    }
+    if (cfg->gen_interval_ms == 0)
+        return -EINVAL;
+    return 0;
+}
+
+/*
+ * A live device called @name, laid out as @cfg (already checked), and a
+ * tee sink of @tee_src if that is set. -EEXIST if the name is taken.
+ */
+static struct vfifo_dev *vfifo_create(const char *name, const struct vfifo_config *cfg,
+                                      struct vfifo_dev *tee_src)
+{
+    struct vfifo_dev *dev, *other;
+    int minor, ret;
+
+    /* With sessions the capacity is their pool; the device keeps a page */
+    dev = vfifo_dev_alloc_node(cfg->sessions ? PAGE_SIZE : cfg->capacity, cfg->node, NULL);
+    if (!dev)
+        return ERR_PTR(-ENOMEM);
+    strscpy(dev->name, name, sizeof(dev->name));
+    dev->gen_interval_ms = cfg->gen_interval_ms;
+    dev->sessions = cfg->sessions;
+    dev->session_size = cfg->session_size;
+    dev->session_pool = cfg->capacity;
+
+    if (cfg->nr_lanes)
+        ret = vfifo_queues_alloc(dev, cfg->nr_lanes, true);
+    else if (cfg->nr_queues)
+        ret = vfifo_queues_alloc(dev, cfg->nr_queues, false);
+    else if (cfg->compress)
+        ret = vfifo_lz4_setup(dev);
+    else
+        ret = vfifo_shards_alloc(dev, cfg->sharding);
+    if (!ret && tee_src)
+        ret = vfifo_tee_prepare(tee_src, dev);
+    if (ret)
+        goto fail_put;
+
+    /* Held until the device is listed, so two creates cannot take one name */
+    mutex_lock(&vfifo_list_lock);
+    ret = -EEXIST;
+    list_for_each_entry(other, &vfifo_list, node)
+        if (strcmp(other->name, dev->name) == 0)
+            goto fail_unlock;
+
+    /* The minor stays taken until the last fd is gone, see vfifo_dev_free() */
+    minor = ida_alloc_max(&vfifo_minors, VFIFO_MAX_DEVICES - 1, GFP_KERNEL);
+    if (minor < 0) {
+        ret = minor == -ENOSPC ? -ENFILE : minor;
+        goto fail_unlock;
+    }
+    dev->minor = minor;
+    dev->devt = MKDEV(MAJOR(dev_num), minor);
+
+    ret = -ENOMEM;
+    dev->cdev = cdev_alloc();
+    if (!dev->cdev)
+        goto fail_unlock;
+    dev->cdev->ops = &vfifo_fops;
+    dev->cdev->owner = THIS_MODULE;
+
+    ret = cdev_add(dev->cdev, dev->devt, 1);
+    if (ret < 0) {
+        kobject_put(&dev->cdev->kobj);
+        goto fail_unlock;
+    }
+
+    /* Create Device Node and Sysfs Attributes */
+    /* We pass 'dev' as drvdata so sysfs show/store functions can find it */
+    dev->dev = device_create_with_groups(vfifo_class, NULL, dev->devt,
+                                         dev, vfifo_groups, "%s", dev->name);
+    if (IS_ERR(dev->dev)) {
+        ret = PTR_ERR(dev->dev);
+        goto fail_cdev;
+    }
+
+    ret = vfifo_queues_sysfs_add(dev);
+    if (ret)
+        goto fail_device;
+    vfifo_debugfs_add(dev);
+
+    list_add_tail(&dev->node, &vfifo_list);
+    vfifo_minor_devs[minor] = dev;
+    if (tee_src)
+        vfifo_tee_attach(tee_src, dev);
+    mutex_unlock(&vfifo_list_lock);
+
+    if (cfg->auto_generate)
+        vfifo_set_mode(dev, true);
+    return dev;
+
+fail_device:
+    vfifo_queues_sysfs_del(dev);
+    device_destroy(vfifo_class, dev->devt);
+fail_cdev:
+    cdev_del(dev->cdev);
+fail_unlock:
+    mutex_unlock(&vfifo_list_lock);
+fail_put:
+    vfifo_put(dev);
+    return ERR_PTR(ret);
+}
+
+static void vfifo_destroy(struct vfifo_dev *dev)
+{
+    /* No new opens; fds and mappings already made keep the device */
+    mutex_lock(&vfifo_list_lock);
+    list_del(&dev->node);
+    vfifo_minor_devs[dev->minor] = NULL;
+    mutex_unlock(&vfifo_list_lock);
+
+    debugfs_remove_recursive(dev->debugfs);
+    vfifo_set_mode(dev, false);
+    vfifo_clear_eventfds(dev, NULL);
+
+    vfifo_queues_sysfs_del(dev);
+    device_destroy(vfifo_class, dev->devt);
+    cdev_del(dev->cdev);
+    vfifo_put(dev);
+}
+
+/* --- Configfs --- */
+
+#if IS_ENABLED(CONFIG_CONFIGFS_FS)
+/*
+ * Instances beyond the ones made at load time:
+ *
+ *   mkdir /sys/kernel/config/vfifo/telemetry
+ *   echo 65536 > /sys/kernel/config/vfifo/telemetry/capacity
+ *   echo 1 > /sys/kernel/config/vfifo/telemetry/enable    # /dev/telemetry
+ *
+ * An item holds a vfifo_config until it is enabled, and its device from
+ * then on. Layout attributes are fixed while the device is live; capacity
+ * resizes it, and the generator settings apply at once. Disabling or
+ * removing the item destroys the device node; open files and mappings
+ * keep the ring until they are closed.
+ */
+struct vfifo_item {
+    struct config_item item;
+    struct mutex lock;              /* Serialises attribute stores */
+    struct vfifo_config cfg;
+    struct vfifo_dev *dev;          /* Live device, or NULL */
+};
+
+static inline struct vfifo_item *to_vfifo_item(struct config_item *item)
+{
+    return container_of(item, struct vfifo_item, item);
+}
+
+/* Store a u32 setting that may only change while the item is disabled */
+static ssize_t vfifo_item_store_u32(struct config_item *item, u32 *field,
+                                    const char *page, size_t count)
+{
+    struct vfifo_item *vi = to_vfifo_item(item);
+    u32 val;
+
+    if (kstrtou32(page, 0, &val))
+        return -EINVAL;
+    mutex_lock(&vi->lock);
+    if (vi->dev) {
+        mutex_unlock(&vi->lock);
+        return -EBUSY;
+    }
+    *field = val;
+    mutex_unlock(&vi->lock);
+    return count;
+}
+
+#define VFIFO_ITEM_U32(name)                                                    \
+static ssize_t vfifo_item_##name##_show(struct config_item *item, char *page)   \
+{                                                                               \
+    return sprintf(page, "%u\n", READ_ONCE(to_vfifo_item(item)->cfg.name));     \
+}                                                                               \
+static ssize_t vfifo_item_##name##_store(struct config_item *item,              \
+                                         const char *page, size_t count)        \
+{                                                                               \
+    return vfifo_item_store_u32(item, &to_vfifo_item(item)->cfg.name, page, count); \
+}                                                                               \
+CONFIGFS_ATTR(vfifo_item_, name)
+
+VFIFO_ITEM_U32(nr_queues);
+VFIFO_ITEM_U32(nr_lanes);
+
+static ssize_t vfifo_item_compress_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%d\n", READ_ONCE(to_vfifo_item(item)->cfg.compress));
+}
+
+static ssize_t vfifo_item_compress_store(struct config_item *item, const char *page, size_t count)
+{
+    struct vfifo_item *vi = to_vfifo_item(item);
+    bool val;
+
+    if (kstrtobool(page, &val))
+        return -EINVAL;
+    mutex_lock(&vi->lock);
+    if (vi->dev) {
+        mutex_unlock(&vi->lock);
+        return -EBUSY;
+    }
+    vi->cfg.compress = val;
+    mutex_unlock(&vi->lock);
+    return count;
+}
+CONFIGFS_ATTR(vfifo_item_, compress);
+
+static ssize_t vfifo_item_sessions_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%s\n", vfifo_session_names[READ_ONCE(to_vfifo_item(item)->cfg.sessions)]);
+}
+
+static ssize_t vfifo_item_sessions_store(struct config_item *item, const char *page, size_t count)
+{
+    struct vfifo_item *vi = to_vfifo_item(item);
+    int mode = sysfs_match_string(vfifo_session_names, page);
+
+    if (mode < 0)
+        return -EINVAL;
+    mutex_lock(&vi->lock);
+    if (vi->dev) {
+        mutex_unlock(&vi->lock);
+        return -EBUSY;
+    }
+    vi->cfg.sessions = mode;
+    mutex_unlock(&vi->lock);
+    return count;
+}
+CONFIGFS_ATTR(vfifo_item_, sessions);
+
+VFIFO_ITEM_U32(session_size);
+
+/* Live: resize the ring */
+static ssize_t vfifo_item_capacity_show(struct config_item *item, char *page)
+{
+    struct vfifo_item *vi = to_vfifo_item(item);
+    struct vfifo_dev *dev = READ_ONCE(vi->dev);
+
+    return sprintf(page, "%u\n", dev ? READ_ONCE(dev->ring.capacity) : READ_ONCE(vi->cfg.capacity));
+}
+
+static ssize_t vfifo_item_capacity_store(struct config_item *item, const char *page, size_t count)
+{
+    struct vfifo_item *vi = to_vfifo_item(item);
+    ssize_t ret = count;
+    u32 val;
+
+    if (kstrtou32(page, 0, &val) || val == 0 || val > VFIFO_MAX_CAPACITY)
+        return -EINVAL;
+    mutex_lock(&vi->lock);
+    if (vi->dev)
+        ret = vfifo_resize(vi->dev, val) ?: count;
+    else
+        vi->cfg.capacity = val;
+    mutex_unlock(&vi->lock);
+    return ret;
+}
+CONFIGFS_ATTR(vfifo_item_, capacity);
+
+static ssize_t vfifo_item_numa_node_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%d\n", READ_ONCE(to_vfifo_item(item)->cfg.node));
+}
+
+/* Checked against the online nodes on enable */
+static ssize_t vfifo_item_numa_node_store(struct config_item *item, const char *page, size_t count)
+{
+    struct vfifo_item *vi = to_vfifo_item(item);
+    int val;
+
+    if (kstrtoint(page, 0, &val) || val < NUMA_NO_NODE)
+        return -EINVAL;
+    mutex_lock(&vi->lock);
+    if (vi->dev) {
+        mutex_unlock(&vi->lock);
+        return -EBUSY;
+    }
+    vi->cfg.node = val;
+    mutex_unlock(&vi->lock);
+    return count;
+}
+CONFIGFS_ATTR(vfifo_item_, numa_node);
+
+static ssize_t vfifo_item_sharding_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%s\n", vfifo_sharding_names[READ_ONCE(to_vfifo_item(item)->cfg.sharding)]);
+}
+
+static ssize_t vfifo_item_sharding_store(struct config_item *item, const char *page, size_t count)
+{
+    struct vfifo_item *vi = to_vfifo_item(item);
+    int mode = sysfs_match_string(vfifo_sharding_names, page);
+
+    if (mode < 0)
+        return -EINVAL;
+    mutex_lock(&vi->lock);
+    if (vi->dev) {
+        mutex_unlock(&vi->lock);
+        return -EBUSY;
+    }
+    vi->cfg.sharding = mode;
+    mutex_unlock(&vi->lock);
+    return count;
+}
+CONFIGFS_ATTR(vfifo_item_, sharding);
+
+/* Generator settings: live devices pick them up at once */
+static ssize_t vfifo_item_mode_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%d\n", READ_ONCE(to_vfifo_item(item)->cfg.auto_generate));
+}
+
+static ssize_t vfifo_item_mode_store(struct config_item *item, const char *page, size_t count)
+{
+    struct vfifo_item *vi = to_vfifo_item(item);
+    int ret = 0;
+    bool val;
+
+    if (kstrtobool(page, &val))
+        return -EINVAL;
+    mutex_lock(&vi->lock);
+    vi->cfg.auto_generate = val;
+    if (vi->dev)
+        ret = vfifo_set_mode(vi->dev, val);
+    mutex_unlock(&vi->lock);
+    return ret ?: count;
+}
+CONFIGFS_ATTR(vfifo_item_, mode);
+
+static ssize_t vfifo_item_gen_interval_ms_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%u\n", READ_ONCE(to_vfifo_item(item)->cfg.gen_interval_ms));
+}
+
+static ssize_t vfifo_item_gen_interval_ms_store(struct config_item *item, const char *page,
+                                                size_t count)
+{
+    struct vfifo_item *vi = to_vfifo_item(item);
+    u32 val;
+
+    if (kstrtou32(page, 0, &val) || val == 0)
+        return -EINVAL;
+    mutex_lock(&vi->lock);
+    vi->cfg.gen_interval_ms = val;
+    if (vi->dev)
+        WRITE_ONCE(vi->dev->gen_interval_ms, val);
+    mutex_unlock(&vi->lock);
+    return count;
+}
+CONFIGFS_ATTR(vfifo_item_, gen_interval_ms);
+
+/* 1: create the device from the settings; 0: destroy it */
+static ssize_t vfifo_item_enable_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%d\n", !!READ_ONCE(to_vfifo_item(item)->dev));
+}
+
+static ssize_t vfifo_item_enable_store(struct config_item *item, const char *page, size_t count)
+{
+    struct vfifo_item *vi = to_vfifo_item(item);
+    struct vfifo_config cfg;
+    struct vfifo_dev *dev;
+    ssize_t ret = count;
+    bool val;
+
+    if (kstrtobool(page, &val))
+        return -EINVAL;
+    mutex_lock(&vi->lock);
+    if (val && !vi->dev) {
+        cfg = vi->cfg;
+        ret = vfifo_config_check(&cfg);
+        if (!ret) {
+            dev = vfifo_create(config_item_name(item), &cfg, NULL);
+            if (IS_ERR(dev))
+                ret = PTR_ERR(dev);
+            else
+                WRITE_ONCE(vi->dev, dev);
+        }
+        ret = ret ?: count;
+    } else if (!val && vi->dev) {
+        vfifo_destroy(vi->dev);
+        WRITE_ONCE(vi->dev, NULL);
+    }
+    mutex_unlock(&vi->lock);
+    return ret;
+}
+CONFIGFS_ATTR(vfifo_item_, enable);
+
+static struct configfs_attribute *vfifo_item_attrs[] = {
+    &vfifo_item_attr_capacity,
+    &vfifo_item_attr_numa_node,
+    &vfifo_item_attr_sharding,
+    &vfifo_item_attr_nr_queues,
+    &vfifo_item_attr_nr_lanes,
+    &vfifo_item_attr_compress,
+    &vfifo_item_attr_sessions,
+    &vfifo_item_attr_session_size,
+    &vfifo_item_attr_mode,
+    &vfifo_item_attr_gen_interval_ms,
+    &vfifo_item_attr_enable,
+    NULL,
+};
+
+static void vfifo_item_release(struct config_item *item)
+{
+    kfree(to_vfifo_item(item));
+}
+
+static struct configfs_item_operations vfifo_item_ops = {
+    .release = vfifo_item_release,
+};
+
+static const struct config_item_type vfifo_item_type = {
+    .ct_item_ops = &vfifo_item_ops,
+    .ct_attrs = vfifo_item_attrs,
+    .ct_owner = THIS_MODULE,
+};
+
+/* mkdir: a new, disabled item with the load-time defaults */
+static struct config_item *vfifo_make_item(struct config_group *group, const char *name)
+{
+    struct vfifo_item *vi;
+
+    if (strlen(name) >= sizeof(((struct vfifo_dev *)0)->name))
+        return ERR_PTR(-ENAMETOOLONG);
+    vi = kzalloc(sizeof(*vi), GFP_KERNEL);
+    if (!vi)
+        return ERR_PTR(-ENOMEM);
+    mutex_init(&vi->lock);
+    vi->cfg.capacity = buffer_size;
+    vi->cfg.session_size = session_size;
+    vi->cfg.node = NUMA_NO_NODE;
+    vi->cfg.gen_interval_ms = 1000;
+    config_item_init_type_name(&vi->item, name, &vfifo_item_type);
+    return &vi->item;
+}
+
+/* rmdir: the device goes with the item */
+static void vfifo_drop_item(struct config_group *group, struct config_item *item)
+{
+    struct vfifo_item *vi = to_vfifo_item(item);
+
+    mutex_lock(&vi->lock);
+    if (vi->dev) {
+        vfifo_destroy(vi->dev);
+        vi->dev = NULL;
+    }
+    mutex_unlock(&vi->lock);
+    config_item_put(item);
+}
+
+static struct configfs_group_operations vfifo_group_ops = {
+    .make_item = vfifo_make_item,
+    .drop_item = vfifo_drop_item,
+};
+
+static const struct config_item_type vfifo_subsys_type = {
+    .ct_group_ops = &vfifo_group_ops,
+    .ct_owner = THIS_MODULE,
+};
+
+static struct configfs_subsystem vfifo_subsys = {
+    .su_group = {
+        .cg_item = {
+            .ci_namebuf = "vfifo",
+            .ci_type = &vfifo_subsys_type,
+        },
+    },
+};
+
+static int vfifo_configfs_init(void)
+{
+    config_group_init(&vfifo_subsys.su_group);
+    mutex_init(&vfifo_subsys.su_mutex);
+    return configfs_register_subsystem(&vfifo_subsys);
+}
+
+static void vfifo_configfs_exit(void)
+{
+    configfs_unregister_subsystem(&vfifo_subsys);
+}
+#else
+static int vfifo_configfs_init(void) { return 0; }
+static void vfifo_configfs_exit(void) { }
+#endif
+
+static int __init vfifo_init(void)
+{
+    struct vfifo_dev *dev, *tmp, *tee_src = NULL;
+    struct vfifo_config cfg = {
+        .node = NUMA_NO_NODE,
+        .gen_interval_ms = 1000,
+    };
+    char name[16];
+    int shard_mode, session_mode;
+    int ret;
+    int i;
+
+    printk(KERN_INFO "vfifo: Initializing Module 5 (Mmap & Sysfs)...\n");
+
+    if (nr_devices < 1 || nr_devices > VFIFO_MAX_DEVICES)
+        return -EINVAL;
+
+    shard_mode = sysfs_match_string(vfifo_sharding_names, sharding);
+    if (shard_mode < 0)
+        return -EINVAL;
+    session_mode = sysfs_match_string(vfifo_session_names, sessions);
+    if (session_mode < 0 || session_size <= 0)
+        return -EINVAL;
+    if (nr_queues < 0 || nr_lanes < 0)
+        return -EINVAL;
+    /* Tee sinks hold trefs, not records: plain rings only */
+    if (tee_sinks < 0 || tee_sinks >= nr_devices ||
+        (tee_sinks && (nr_lanes || nr_queues || shard_mode || compress || session_mode)))
+        return -EINVAL;
+
+    if (buffer_size <= 0 || buffer_size > VFIFO_MAX_CAPACITY)
+        buffer_size = 4096;
+    cfg.capacity = buffer_size;
+    cfg.sharding = shard_mode;
+    cfg.nr_queues = nr_queues;
+    cfg.nr_lanes = nr_lanes;
+    cfg.compress = compress;
+    cfg.sessions = session_mode;
+    cfg.session_size = session_size;
+    ret = vfifo_config_check(&cfg);
+    if (ret)
+        return ret;
+    /* The rounded size, which configfs items start from too */
+    buffer_size = cfg.capacity;
+
+    ret = alloc_chrdev_region(&dev_num, 0, VFIFO_MAX_DEVICES, "vfifo");
+    if (ret < 0) return ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    vfifo_class = class_create("vfifo_class");
+#else
+    vfifo_class = class_create(THIS_MODULE, "vfifo_class");
+#endif
+    if (IS_ERR(vfifo_class)) {
+        unregister_chrdev_region(dev_num, VFIFO_MAX_DEVICES);
+        return PTR_ERR(vfifo_class);
+    }
+    vfifo_debugfs_root = debugfs_create_dir("vfifo", NULL);
+
+    for (i = 0; i < nr_devices; i++) {
+        snprintf(name, sizeof(name), "vfifo%d", i);
+        dev = vfifo_create(name, &cfg, i > 0 && i <= tee_sinks ? tee_src : NULL);
+        if (IS_ERR(dev)) {
+            ret = PTR_ERR(dev);
+            goto fail;
+        }
+        if (i == 0)
+            tee_src = dev;
+    }
+
+    ret = vfifo_configfs_init();
+    if (ret)
+        goto fail;
+
+    printk(KERN_INFO "vfifo: Registered %d device(s) with Major %d\n", nr_devices, MAJOR(dev_num));
+    return 0;
+
+fail:
+    list_for_each_entry_safe(dev, tmp, &vfifo_list, node)
+        vfifo_destroy(dev);
+    vfifo_lz4_ctx_free();
+    vfifo_pool_drain();
+    debugfs_remove_recursive(vfifo_debugfs_root);
+    class_destroy(vfifo_class);
+    unregister_chrdev_region(dev_num, VFIFO_MAX_DEVICES);
+    return ret;
+}
+
+static void __exit vfifo_exit(void)
+{
+    struct vfifo_dev *dev, *tmp;
+
+    /* Items pin the module, so only load-time devices are left */
+    vfifo_configfs_exit();
+    list_for_each_entry_safe(dev, tmp, &vfifo_list, node)
+        vfifo_destroy(dev);
+    vfifo_lz4_ctx_free();
+    vfifo_pool_drain();
+    debugfs_remove_recursive(vfifo_debugfs_root);
+
+    class_destroy(vfifo_class);
+    unregister_chrdev_region(dev_num, VFIFO_MAX_DEVICES);
+    printk(KERN_INFO "vfifo: Module unloaded\n");
+}
+
+module_init(vfifo_init);
+module_exit(vfifo_exit);
+
+/* The tests need the static ring core, so they are built into this object */
+#if IS_ENABLED(CONFIG_VFIFO_KUNIT_TEST)
+#include "vfifo_kunit.c"
+#endif
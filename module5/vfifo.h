@@ -0,0 +1,91 @@
+/*
+ * vfifo.h - in-kernel producer/consumer API exported by vfifo.ko
+ *
+ * Lets other modules (a netfilter hook, another driver, ...) move data
+ * through a vfifo instance directly, with no syscall and no user copy.
+ * The character device's read/write/mmap paths sit on the same core.
+ *
+ * Build the client module with KBUILD_EXTRA_SYMBOLS pointing at vfifo's
+ * Module.symvers so modpost can resolve these symbols.
+ */
+#ifndef VFIFO_H
+#define VFIFO_H
+
+#include <linux/types.h>
+
+struct vfifo_dev;
+
+/*
+ * Look up an instance by name ("vfifo0") and take a reference on it.
+ * Returns NULL if there is no such instance. May sleep.
+ */
+struct vfifo_dev *vfifo_get(const char *name);
+
+/*
+ * Drop the reference. Process context only: the last one frees the
+ * instance, which may sleep. Take and drop it around the IRQ-safe calls
+ * below, not inside them.
+ */
+void vfifo_put(struct vfifo_dev *dev);
+
+/*
+ * Everything below may be called from any context, including hard IRQ,
+ * as long as the caller holds a reference.
+ * Nothing sleeps: when the ring is full (or empty) the call fails with
+ * -EAGAIN instead of waiting.
+ */
+
+/* Queue all @len bytes, or nothing. */
+int vfifo_enqueue(struct vfifo_dev *dev, const void *data, size_t len);
+
+/*
+ * The same, steered by @flow on a multi-queue instance: records of one flow
+ * always go to the same queue. vfifo_enqueue() uses one flow per task.
+ * With priority lanes, @flow is the lane; vfifo_enqueue() uses the lowest.
+ */
+int vfifo_enqueue_flow(struct vfifo_dev *dev, u32 flow, const void *data, size_t len);
+
+/*
+ * Dequeue up to @len bytes (exactly @len with VFIFO_DEQUEUE_ALL). Readers
+ * share the ring: if one fails to copy out part of what it claimed (a
+ * faulting read() buffer) while another has already claimed past it, the
+ * rest is dropped, so a consumer may see a gap. The 'lost_bytes' attribute
+ * counts such bytes.
+ */
+ssize_t vfifo_dequeue(struct vfifo_dev *dev, void *buf, size_t len, unsigned int flags);
+
+/*
+ * On an instance loaded with sharding= (per-CPU rings), nr_queues= or nr_lanes= every
+ * enqueue is a record: dequeue returns whole records only, -EMSGSIZE if
+ * the first one does not fit in @len, and vfifo_reserve() fails with
+ * -EOPNOTSUPP.
+ *
+ * With tee_sinks=N, vfifo_enqueue() on vfifo0 delivers to every sink or
+ * none (-EAGAIN while a blocking sink is full), up to 16 pages at a time.
+ * Sinks take no enqueues of their own and dequeue up to @len bytes.
+ *
+ * With compress=1, each enqueue is compressed as one block of at most
+ * 4096 bytes (-EINVAL if larger), and dequeue returns up to @len bytes.
+ * Neither has a zero-copy path: vfifo_reserve() fails with -EOPNOTSUPP.
+ *
+ * With sessions=fd or pgrp, every open of the device gets a ring of its
+ * own; these calls reach only the device's one-page ring, which no fd sees.
+ *
+ * Rate limits (VFIFO_SET_RATE, the rate_limit attribute) shape user-space
+ * producers only; these calls are never held back by them.
+ */
+
+#define VFIFO_DEQUEUE_ALL   (1 << 0)
+
+/*
+ * Zero-copy production: reserve @len bytes and fill them in place through
+ * the returned pointer (always contiguous, even across the wrap), then
+ * commit or discard using the position stored in @pos. Returns an ERR_PTR
+ * on failure. Readers see committed data in reservation order and never
+ * see the bytes of a discarded span.
+ */
+void *vfifo_reserve(struct vfifo_dev *dev, size_t len, u32 *pos);
+int vfifo_commit(struct vfifo_dev *dev, u32 pos);
+int vfifo_discard(struct vfifo_dev *dev, u32 pos);
+
+#endif /* VFIFO_H */
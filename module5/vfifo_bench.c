@@ -0,0 +1,342 @@
+/*
+ * vfifo_bench.c - throughput benchmark for /dev/vfifoN
+ *
+ * Runs producer and consumer threads against one device for a fixed time
+ * and prints one CSV line (plus a header unless -H), so runs can be
+ * appended to a file and compared:
+ *
+ *   ./vfifo-bench -m rw -s 4096 -p 4 -c 4 -t 10
+ *   ./vfifo-bench -H -m batch -s 64 -b 64 >> results.csv
+ *
+ * Modes:
+ *   rw     write() / read()
+ *   mmap   VFIFO_RESERVE + copy into the mapping + VFIFO_COMMIT, and
+ *          VFIFO_PEEK + copy out of the mapping + VFIFO_CONSUME,
+ *          one transfer per ioctl pair
+ *   batch  as mmap, but each ioctl pair moves -b transfers at once
+ *
+ * Throughput counts bytes delivered to consumers. CPU is the process's
+ * user and system time as a percentage of one CPU over the run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#include "vfifo_uapi.h"
+
+enum bench_mode { MODE_RW, MODE_MMAP, MODE_BATCH };
+static const char *mode_names[] = { "rw", "mmap", "batch" };
+
+static const char *device = "/dev/vfifo0";
+static enum bench_mode mode = MODE_RW;
+static size_t xfer = 4096;
+static int nr_producers = 1;
+static int nr_consumers = 1;
+static int seconds = 5;
+static int nonblock;
+static unsigned int batch = 16;
+static int header = 1;
+static long stream = -1;            /* VFIFO_SET_STREAM threshold, -1: device default */
+
+static unsigned int capacity;
+static volatile int stop;
+static pthread_barrier_t start_barrier;
+
+struct worker {
+    pthread_t tid;
+    int fd;
+    char *map;
+    int producer;
+    uint64_t bytes;
+    uint64_t ops;
+    uint64_t eagain;
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -d DEV   device (default /dev/vfifo0)\n"
+            "  -m MODE  rw, mmap or batch (default rw)\n"
+            "  -s SIZE  bytes per transfer (default 4096)\n"
+            "  -b N     transfers per ioctl in batch mode (default 16)\n"
+            "  -p N     producer threads (default 1)\n"
+            "  -c N     consumer threads (default 1)\n"
+            "  -t SEC   run time (default 5)\n"
+            "  -n       O_NONBLOCK, spin on EAGAIN\n"
+            "  -S SIZE  producers copy writes of SIZE bytes or more past the caches\n"
+            "  -H       no CSV header\n", prog);
+    exit(2);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The ring size, from sysfs (the mapping must not be larger) */
+static unsigned int read_capacity(void)
+{
+    char path[256], *dev = strdup(device);
+    unsigned int cap = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/class/vfifo/%s/capacity", basename(dev));
+    free(dev);
+    f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%u", &cap) != 1)
+            cap = 0;
+        fclose(f);
+    }
+    return cap;
+}
+
+/* Copy into or out of a ring span, wrapping at the end of the mapping */
+static void copy_span(char *map, unsigned int offset, char *buf, size_t len, int to_ring)
+{
+    size_t first = len;
+
+    if (offset + first > capacity)
+        first = capacity - offset;
+    if (to_ring) {
+        memcpy(map + offset, buf, first);
+        memcpy(map, buf + first, len - first);
+    } else {
+        memcpy(buf, map + offset, first);
+        memcpy(buf + first, map, len - first);
+    }
+}
+
+/* One transfer (or batch); returns bytes moved, 0 to retry, -1 to stop */
+static ssize_t produce_once(struct worker *w, char *buf, size_t len)
+{
+    struct vfifo_reservation res;
+    ssize_t ret;
+
+    if (mode == MODE_RW) {
+        ret = write(w->fd, buf, len);
+        return ret < 0 && (errno == EAGAIN || errno == EINTR) ? 0 : ret;
+    }
+
+    memset(&res, 0, sizeof(res));
+    res.len = len;
+    if (ioctl(w->fd, VFIFO_RESERVE, &res) < 0)
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    copy_span(w->map, res.offset, buf, res.len, 1);
+    if (ioctl(w->fd, VFIFO_COMMIT, &res.pos) < 0)
+        return -1;
+    return res.len;
+}
+
+static ssize_t consume_once(struct worker *w, char *buf, size_t len)
+{
+    struct vfifo_span span;
+    unsigned int n;
+    ssize_t ret;
+
+    if (mode == MODE_RW) {
+        ret = read(w->fd, buf, len);
+        return ret < 0 && (errno == EAGAIN || errno == EINTR) ? 0 : ret;
+    }
+
+    if (ioctl(w->fd, VFIFO_PEEK, &span) < 0)
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    n = span.len < len ? span.len : len;
+    copy_span(w->map, span.offset, buf, n, 0);
+    if (ioctl(w->fd, VFIFO_CONSUME, &n) < 0)
+        return errno == EAGAIN ? 0 : -1;
+    return n;
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    size_t len = mode == MODE_BATCH ? xfer * batch : xfer;
+    char *buf = malloc(len);
+    ssize_t ret;
+
+    if (!buf) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(buf, 'x', len);
+    pthread_barrier_wait(&start_barrier);
+
+    while (!stop) {
+        ret = w->producer ? produce_once(w, buf, len) : consume_once(w, buf, len);
+        if (ret < 0) {
+            if (!stop)
+                perror(w->producer ? "producer" : "consumer");
+            break;
+        }
+        if (ret == 0) {
+            w->eagain++;
+            continue;
+        }
+        if (stop)
+            break;
+        w->bytes += ret;
+        w->ops += (ret + xfer - 1) / xfer;
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Only here to interrupt blocked read()/write()/ioctl() at the end */
+static void wake_handler(int sig)
+{
+    (void)sig;
+}
+
+int main(int argc, char **argv)
+{
+    struct worker *workers;
+    struct rusage ru0, ru1;
+    struct sigaction sa;
+    uint64_t bytes = 0, ops = 0, eagain = 0;
+    double t0, elapsed, cpu_user, cpu_sys;
+    int i, n, fd, opt;
+
+    while ((opt = getopt(argc, argv, "d:m:s:b:p:c:t:nS:Hh")) != -1) {
+        switch (opt) {
+        case 'd': device = optarg; break;
+        case 'm':
+            for (i = 0; i < 3 && strcmp(optarg, mode_names[i]); i++)
+                ;
+            if (i == 3)
+                usage(argv[0]);
+            mode = i;
+            break;
+        case 's': xfer = strtoul(optarg, NULL, 0); break;
+        case 'b': batch = strtoul(optarg, NULL, 0); break;
+        case 'p': nr_producers = atoi(optarg); break;
+        case 'c': nr_consumers = atoi(optarg); break;
+        case 't': seconds = atoi(optarg); break;
+        case 'n': nonblock = 1; break;
+        case 'S': stream = strtol(optarg, NULL, 0); break;
+        case 'H': header = 0; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (xfer == 0 || batch == 0 || nr_producers < 1 || nr_consumers < 1 || seconds < 1)
+        usage(argv[0]);
+
+    capacity = read_capacity();
+    if (mode != MODE_RW) {
+        if (!capacity) {
+            fprintf(stderr, "Cannot read the capacity of %s from sysfs\n", device);
+            return 1;
+        }
+        /* PEEK/CONSUME always address the oldest data: one consumer only */
+        if (nr_consumers > 1) {
+            fprintf(stderr, "mmap and batch modes support a single consumer\n");
+            return 1;
+        }
+        if ((mode == MODE_BATCH ? xfer * batch : xfer) > capacity) {
+            fprintf(stderr, "Transfer larger than the ring (%u bytes)\n", capacity);
+            return 1;
+        }
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wake_handler;   /* No SA_RESTART: blocked calls return EINTR */
+    sigaction(SIGUSR1, &sa, NULL);
+
+    n = nr_producers + nr_consumers;
+    workers = calloc(n, sizeof(*workers));
+    if (!workers) {
+        perror("calloc");
+        return 1;
+    }
+
+    /* Start from an empty ring */
+    fd = open(device, O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open device");
+        return 1;
+    }
+    ioctl(fd, VFIFO_CLEAR);
+    close(fd);
+
+    pthread_barrier_init(&start_barrier, NULL, n + 1);
+    for (i = 0; i < n; i++) {
+        workers[i].producer = i < nr_producers;
+        workers[i].fd = open(device, O_RDWR | (nonblock ? O_NONBLOCK : 0));
+        if (workers[i].fd < 0) {
+            perror("Failed to open device");
+            return 1;
+        }
+        if (stream >= 0 && workers[i].producer) {
+            struct vfifo_stream st = { .threshold = stream };
+
+            if (ioctl(workers[i].fd, VFIFO_SET_STREAM, &st) < 0) {
+                perror("VFIFO_SET_STREAM");
+                return 1;
+            }
+        }
+        if (mode != MODE_RW) {
+            workers[i].map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                  workers[i].fd, 0);
+            if (workers[i].map == MAP_FAILED) {
+                perror("MMAP failed");
+                return 1;
+            }
+        }
+        pthread_create(&workers[i].tid, NULL, worker_fn, &workers[i]);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    getrusage(RUSAGE_SELF, &ru0);
+    t0 = now();
+    sleep(seconds);
+    stop = 1;
+    elapsed = now() - t0;
+    getrusage(RUSAGE_SELF, &ru1);
+
+    for (i = 0; i < n; i++)
+        pthread_kill(workers[i].tid, SIGUSR1);
+    for (i = 0; i < n; i++) {
+        pthread_join(workers[i].tid, NULL);
+        if (!workers[i].producer) {
+            bytes += workers[i].bytes;
+            ops += workers[i].ops;
+        }
+        eagain += workers[i].eagain;
+        if (workers[i].map)
+            munmap(workers[i].map, capacity);
+        close(workers[i].fd);
+    }
+
+    cpu_user = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec) +
+               (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec) / 1e6;
+    cpu_sys = (ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) +
+              (ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec) / 1e6;
+
+    if (header)
+        printf("mode,xfer,batch,producers,consumers,nonblock,capacity,seconds,"
+               "bytes,mb_s,ops_s,cpu_user_pct,cpu_sys_pct,vol_ctxsw,invol_ctxsw,eagain,stream\n");
+    printf("%s,%zu,%u,%d,%d,%d,%u,%.3f,%llu,%.1f,%.0f,%.1f,%.1f,%ld,%ld,%llu,%ld\n",
+           mode_names[mode], xfer, mode == MODE_BATCH ? batch : 1, nr_producers, nr_consumers,
+           nonblock, capacity, elapsed, (unsigned long long)bytes, bytes / elapsed / 1e6,
+           ops / elapsed, 100 * cpu_user / elapsed, 100 * cpu_sys / elapsed,
+           ru1.ru_nvcsw - ru0.ru_nvcsw, ru1.ru_nivcsw - ru0.ru_nivcsw,
+           (unsigned long long)eagain, stream);
+
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,1639 @@
+/*
+ * vfifo_kunit.c - KUnit tests and microbenchmarks for the ring core
+ *
+ * Built into vfifo.o (it is #included at the end of vfifo.c) so it can
+ * drive the static helpers directly. The rings are created with
+ * vfifo_dev_alloc() and never get a device node, so nothing here needs
+ * root, user space or real hardware. See README.md for running it under
+ * kunit.py (UML or QEMU) or by loading a module built with KUNIT=1.
+ */
+#include <kunit/test.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/delay.h>
+#include <linux/sched/task.h>
+
+/* Older kernels have no speed attribute; just run the benchmarks */
+#ifndef KUNIT_CASE_SLOW
+#define KUNIT_CASE_SLOW KUNIT_CASE
+#endif
+
+#define VFIFO_TEST_CAPACITY (4 * PAGE_SIZE)
+
+static void vfifo_test_fill(u8 *buf, size_t len, u32 seed)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = (u8)(seed + i * 7);
+}
+
+static int vfifo_test_init(struct kunit *test)
+{
+    struct vfifo_dev *dev = vfifo_dev_alloc(VFIFO_TEST_CAPACITY);
+
+    KUNIT_ASSERT_NOT_NULL(test, dev);
+    strscpy(dev->name, "vfifo-kunit", sizeof(dev->name));
+    test->priv = dev;
+    return 0;
+}
+
+static void vfifo_test_exit(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+
+    vfifo_set_mode(dev, false);
+    vfifo_put(dev);
+}
+
+/* Start every position at @pos, e.g. just short of the u32 wrap */
+static void vfifo_test_set_pos(struct vfifo_dev *dev, u32 pos)
+{
+    dev->ring.head = dev->ring.tail = dev->ring.reserve = dev->ring.cons = pos;
+}
+
+/* --- Basic Ring Behaviour --- */
+
+static void vfifo_test_empty(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    u8 buf[16];
+    u32 pos;
+
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), 0U);
+    KUNIT_EXPECT_EQ(test, vfifo_free(dev), (u32)VFIFO_TEST_CAPACITY);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, buf, sizeof(buf), 0), (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, buf, 0, 0), (ssize_t)0);
+    KUNIT_EXPECT_EQ(test, vfifo_peek_span(dev, &pos), 0U);
+    KUNIT_EXPECT_FALSE(test, vfifo_can_claim(dev, 1));
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, buf, sizeof(buf), ~0U), (ssize_t)-EINVAL);
+}
+
+static void vfifo_test_full(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    u8 *in, *out;
+
+    in = kunit_kmalloc(test, VFIFO_TEST_CAPACITY + 1, GFP_KERNEL);
+    out = kunit_kmalloc(test, VFIFO_TEST_CAPACITY, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, in);
+    KUNIT_ASSERT_NOT_NULL(test, out);
+    vfifo_test_fill(in, VFIFO_TEST_CAPACITY + 1, 1);
+
+    KUNIT_EXPECT_EQ(test, vfifo_enqueue(dev, in, VFIFO_TEST_CAPACITY + 1), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vfifo_enqueue(dev, in, VFIFO_TEST_CAPACITY - 1), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_free(dev), 1U);
+    /* All or nothing: two bytes do not fit, one does */
+    KUNIT_EXPECT_EQ(test, vfifo_enqueue(dev, in, 2), -EAGAIN);
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), (u32)VFIFO_TEST_CAPACITY - 1);
+    KUNIT_EXPECT_EQ(test, vfifo_enqueue(dev, in + VFIFO_TEST_CAPACITY - 1, 1), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_free(dev), 0U);
+    KUNIT_EXPECT_FALSE(test, vfifo_can_reserve(dev, 1));
+    KUNIT_EXPECT_EQ(test, vfifo_enqueue(dev, in, 1), -EAGAIN);
+
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, VFIFO_TEST_CAPACITY, VFIFO_DEQUEUE_ALL),
+                    (ssize_t)VFIFO_TEST_CAPACITY);
+    KUNIT_EXPECT_EQ(test, memcmp(in, out, VFIFO_TEST_CAPACITY), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), 0U);
+}
+
+static void vfifo_test_partial_dequeue(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    u8 in[100], out[200];
+
+    vfifo_test_fill(in, sizeof(in), 2);
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, in, sizeof(in)), 0);
+
+    /* Without VFIFO_DEQUEUE_ALL a short dequeue succeeds */
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, sizeof(out), VFIFO_DEQUEUE_ALL),
+                    (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, 40, VFIFO_DEQUEUE_ALL), (ssize_t)40);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out + 40, sizeof(out), 0), (ssize_t)60);
+    KUNIT_EXPECT_EQ(test, memcmp(in, out, sizeof(in)), 0);
+}
+
+/* Spans that straddle the end of the buffer, and positions that wrap u32 */
+static void vfifo_test_wrap(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    const u32 chunk = VFIFO_TEST_CAPACITY / 3 + 5;
+    u8 *in, *out;
+    int i;
+
+    in = kunit_kmalloc(test, chunk, GFP_KERNEL);
+    out = kunit_kmalloc(test, chunk, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, in);
+    KUNIT_ASSERT_NOT_NULL(test, out);
+
+    vfifo_test_set_pos(dev, U32_MAX - VFIFO_TEST_CAPACITY / 2);
+    for (i = 0; i < 16; i++) {
+        vfifo_test_fill(in, chunk, i);
+        KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, in, chunk), 0);
+        KUNIT_EXPECT_EQ(test, vfifo_used(dev), chunk);
+        memset(out, 0, chunk);
+        KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, out, chunk, VFIFO_DEQUEUE_ALL), (ssize_t)chunk);
+        KUNIT_EXPECT_EQ(test, memcmp(in, out, chunk), 0);
+    }
+    /* The counters went through zero, the arithmetic did not notice */
+    KUNIT_EXPECT_LT(test, dev->ring.head, (u32)VFIFO_TEST_CAPACITY * 16);
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), 0U);
+    KUNIT_EXPECT_EQ(test, vfifo_free(dev), (u32)VFIFO_TEST_CAPACITY);
+}
+
+/* --- Reserve / Commit and Claim / Release --- */
+
+static void vfifo_test_commit_order(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    u8 *a, *b, out[8];
+    u32 pa, pb;
+
+    a = vfifo_reserve(dev, 4, &pa);
+    b = vfifo_reserve(dev, 4, &pb);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(a));
+    KUNIT_ASSERT_FALSE(test, IS_ERR(b));
+    memcpy(a, "AAAA", 4);
+    memcpy(b, "BBBB", 4);
+
+    /* The second span is done first, but must not overtake the first */
+    KUNIT_EXPECT_EQ(test, vfifo_commit(dev, pb), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), 0U);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, sizeof(out), 0), (ssize_t)-EAGAIN);
+
+    KUNIT_EXPECT_EQ(test, vfifo_commit(dev, pa), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, sizeof(out), 0), (ssize_t)8);
+    KUNIT_EXPECT_EQ(test, memcmp(out, "AAAABBBB", 8), 0);
+
+    /* Committing twice, or a position never reserved, is rejected */
+    KUNIT_EXPECT_EQ(test, vfifo_commit(dev, pa), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vfifo_discard(dev, pa + 1), -EINVAL);
+}
+
+static void vfifo_test_discard(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    u8 *a, *b, *c, out[12];
+    u32 pa, pb, pc;
+
+    a = vfifo_reserve(dev, 4, &pa);
+    b = vfifo_reserve(dev, 4, &pb);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(a));
+    KUNIT_ASSERT_FALSE(test, IS_ERR(b));
+
+    /* The newest span is simply handed back */
+    KUNIT_EXPECT_EQ(test, vfifo_discard(dev, pb), 0);
+    KUNIT_EXPECT_EQ(test, dev->ring.reserve, pa + 4);
+
+    b = vfifo_reserve(dev, 4, &pb);
+    c = vfifo_reserve(dev, 4, &pc);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(b));
+    KUNIT_ASSERT_FALSE(test, IS_ERR(c));
+    memcpy(a, "AAAA", 4);
+    memset(b, 'x', 4);
+    memcpy(c, "CCCC", 4);
+
+    /* One in the middle cannot be, so readers skip it */
+    KUNIT_EXPECT_EQ(test, vfifo_discard(dev, pb), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_commit(dev, pc), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_commit(dev, pa), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, sizeof(out), 0), (ssize_t)4);
+    KUNIT_EXPECT_EQ(test, memcmp(out, "AAAA", 4), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, sizeof(out), 0), (ssize_t)4);
+    KUNIT_EXPECT_EQ(test, memcmp(out, "CCCC", 4), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), 0U);
+}
+
+static void vfifo_test_reserve_limits(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    struct vfifo_resv r;
+    u32 pos[VFIFO_MAX_RESV];
+    void *p;
+    int i;
+
+    KUNIT_EXPECT_EQ(test, vfifo_reserve_span(dev, 0, false, NULL, &r), -EINVAL);
+
+    /* Partial reservations take what is left */
+    KUNIT_ASSERT_EQ(test, vfifo_reserve_span(dev, VFIFO_TEST_CAPACITY - 10, false, NULL, &r), 0);
+    KUNIT_ASSERT_EQ(test, vfifo_reserve_span(dev, 64, true, NULL, &r), 0);
+    KUNIT_EXPECT_EQ(test, r.len, 10U);
+    KUNIT_EXPECT_EQ(test, vfifo_reserve_span(dev, 1, true, NULL, &r), -EAGAIN);
+    vfifo_abandon_reservations(dev, NULL);
+    KUNIT_EXPECT_EQ(test, dev->ring.reserve, dev->ring.head);
+    KUNIT_EXPECT_EQ(test, dev->ring.wspans.count, 0U);
+
+    /* The slot queue bounds in-flight spans even when bytes are left */
+    for (i = 0; i < VFIFO_MAX_RESV; i++) {
+        p = vfifo_reserve(dev, 1, &pos[i]);
+        KUNIT_ASSERT_FALSE(test, IS_ERR(p));
+    }
+    KUNIT_EXPECT_PTR_EQ(test, vfifo_reserve(dev, 1, &pos[0]), ERR_PTR(-EAGAIN));
+    for (i = VFIFO_MAX_RESV - 1; i >= 0; i--)
+        KUNIT_EXPECT_EQ(test, vfifo_commit(dev, pos[i]), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), (u32)VFIFO_MAX_RESV);
+}
+
+static void vfifo_test_claim_release(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    struct vfifo_resv r1, r2;
+    u8 in[64];
+    u32 pos;
+
+    vfifo_test_fill(in, sizeof(in), 3);
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, in, sizeof(in)), 0);
+
+    KUNIT_ASSERT_EQ(test, vfifo_claim_span(dev, 16, false, &r1), 0);
+    KUNIT_ASSERT_EQ(test, vfifo_claim_span(dev, 32, false, &r2), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_peek_span(dev, &pos), 16U);
+    KUNIT_EXPECT_EQ(test, pos, r2.pos + 32);
+
+    /* A short read of the newest claim gives its tail back to the readers */
+    vfifo_release_span(dev, r2.pos, 8);
+    KUNIT_EXPECT_EQ(test, vfifo_peek_span(dev, &pos), 40U);
+    /* Space is only returned once the older claim is released too */
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), 64U);
+    vfifo_release_span(dev, r1.pos, 16);
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), 40U);
+    KUNIT_EXPECT_EQ(test, memcmp(vfifo_ptr(dev, pos), in + 24, 40), 0);
+}
+
+/* --- Control Operations --- */
+
+static void vfifo_test_clear(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    u8 in[32], out[4];
+    u32 pos;
+    u8 *p;
+
+    vfifo_test_fill(in, sizeof(in), 4);
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, in, sizeof(in)), 0);
+    p = vfifo_reserve(dev, 4, &pos);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(p));
+
+    /* Committed data goes, the span still being filled survives */
+    vfifo_clear(dev);
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), 0U);
+    memcpy(p, "LATE", 4);
+    KUNIT_EXPECT_EQ(test, vfifo_commit(dev, pos), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, sizeof(out), 0), (ssize_t)4);
+    KUNIT_EXPECT_EQ(test, memcmp(out, "LATE", 4), 0);
+
+    /* Clearing an empty ring is a no-op */
+    vfifo_clear(dev);
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), 0U);
+}
+
+static void vfifo_test_mode(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    struct task_struct *t;
+    u8 *in, out[5];
+
+    KUNIT_ASSERT_EQ(test, vfifo_set_mode(dev, true), 0);
+    KUNIT_EXPECT_TRUE(test, dev->auto_generate);
+    t = dev->gen_task;
+    KUNIT_ASSERT_NOT_NULL(test, t);
+    /* Switching on twice keeps the one thread */
+    KUNIT_EXPECT_EQ(test, vfifo_set_mode(dev, true), 0);
+    KUNIT_EXPECT_PTR_EQ(test, dev->gen_task, t);
+
+    /* Policy changes reach the running thread */
+    KUNIT_EXPECT_EQ(test, vfifo_gen_set(dev, &dev->gen_rt_prio, 10), 0);
+    KUNIT_EXPECT_EQ(test, t->policy, (unsigned int)SCHED_FIFO);
+    KUNIT_EXPECT_EQ(test, vfifo_gen_set(dev, &dev->gen_rt_prio, 0), 0);
+    KUNIT_EXPECT_EQ(test, t->policy, (unsigned int)SCHED_NORMAL);
+
+    KUNIT_EXPECT_EQ(test, vfifo_set_mode(dev, false), 0);
+    KUNIT_EXPECT_FALSE(test, dev->auto_generate);
+    KUNIT_EXPECT_NULL(test, dev->gen_task);
+
+    /* One tick of the generator queues one sample... */
+    vfifo_gen_tick(dev);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, sizeof(out), VFIFO_DEQUEUE_ALL), (ssize_t)5);
+    KUNIT_EXPECT_EQ(test, memcmp(out, "AUTO ", 5), 0);
+
+    /* ...and drops it when the ring is full */
+    in = kunit_kzalloc(test, VFIFO_TEST_CAPACITY, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, in);
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, in, VFIFO_TEST_CAPACITY - 4), 0);
+    vfifo_gen_tick(dev);
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), (u32)VFIFO_TEST_CAPACITY - 4);
+}
+
+static void vfifo_test_status(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    struct vfifo_status st;
+    u8 buf[100] = { 0 };
+    u32 pos;
+
+    vfifo_test_set_pos(dev, U32_MAX - 50);
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, buf, sizeof(buf)), 0);
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, buf, 40, 0), (ssize_t)40);
+    /* Reserved but not committed: not in yet */
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vfifo_reserve(dev, 10, &pos)));
+
+    vfifo_get_status(dev, &st);
+    KUNIT_EXPECT_EQ(test, st.capacity, (u32)VFIFO_TEST_CAPACITY);
+    KUNIT_EXPECT_EQ(test, st.used, 60U);
+    KUNIT_EXPECT_EQ(test, st.head - st.tail, 60U);
+    KUNIT_EXPECT_EQ(test, st.tail, U32_MAX - 50 + 40);
+    KUNIT_EXPECT_EQ(test, st.bytes_in, 100ULL);
+    KUNIT_EXPECT_EQ(test, st.commits, 1ULL);
+    KUNIT_EXPECT_EQ(test, st.bytes_out, 40ULL);
+    KUNIT_EXPECT_EQ(test, st.releases, 1ULL);
+    KUNIT_EXPECT_EQ(test, st.mode, 0U);
+
+    KUNIT_ASSERT_EQ(test, vfifo_commit(dev, pos), 0);
+    vfifo_clear(dev);
+    vfifo_get_status(dev, &st);
+    KUNIT_EXPECT_EQ(test, st.used, 0U);
+    KUNIT_EXPECT_EQ(test, st.bytes_in, 110ULL);
+    KUNIT_EXPECT_EQ(test, st.bytes_out, 110ULL);
+}
+
+static void vfifo_test_rate(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    struct vfifo_backpressure bp;
+    struct vfifo_file *vf;
+    u8 *buf;
+    u64 t0;
+
+    buf = kunit_kzalloc(test, VFIFO_TEST_CAPACITY / 2, GFP_KERNEL);
+    vf = kunit_kzalloc(test, sizeof(*vf), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+    KUNIT_ASSERT_NOT_NULL(test, vf);
+    vfifo_bucket_init(&vf->rate);
+
+    /* No limits: nothing waits, and only the ring's fill counts */
+    KUNIT_EXPECT_EQ(test, vfifo_rate_admit(vf, dev, U32_MAX, true), 0);
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, buf, VFIFO_TEST_CAPACITY / 2), 0);
+    vfifo_get_backpressure(dev, vf, &bp);
+    KUNIT_EXPECT_EQ(test, bp.fill, 50U);
+    KUNIT_EXPECT_EQ(test, bp.level, 50U);
+    KUNIT_EXPECT_EQ(test, bp.wait_ns, 0ULL);
+
+    /* 1000 bytes/s in bursts of 100: a write may overdraw, the next one waits */
+    vfifo_bucket_set(&vf->rate, 1000, 100);
+    KUNIT_EXPECT_EQ(test, vfifo_rate_admit(vf, dev, 60, true), 0);
+    vfifo_get_backpressure(dev, vf, &bp);
+    KUNIT_EXPECT_GE(test, bp.fd_rate, 55U);
+    KUNIT_EXPECT_LE(test, bp.fd_rate, 60U);
+    KUNIT_EXPECT_EQ(test, vfifo_rate_admit(vf, dev, 60, true), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_rate_admit(vf, dev, 1, true), -EAGAIN);
+    KUNIT_EXPECT_EQ(test, atomic_long_read(&dev->throttled), 1L);
+    vfifo_get_backpressure(dev, vf, &bp);
+    KUNIT_EXPECT_EQ(test, bp.level, 100U);
+    KUNIT_EXPECT_GT(test, bp.wait_ns, 0ULL);
+    KUNIT_EXPECT_LE(test, bp.wait_ns, 20 * NSEC_PER_MSEC);
+
+    /* What a write did not use comes back */
+    vfifo_rate_refund(vf, dev, 60, 30);
+    KUNIT_EXPECT_EQ(test, vfifo_rate_admit(vf, dev, 1, true), 0);
+    /* ...and time refills the bucket, up to the burst */
+    vf->rate.stamp -= NSEC_PER_SEC;
+    vfifo_get_backpressure(dev, vf, &bp);
+    KUNIT_EXPECT_EQ(test, bp.fd_rate, 0U);
+
+    /* The device's limit applies on top; a blocking writer sleeps off the debt */
+    vfifo_bucket_set(&vf->rate, 0, 0);
+    vfifo_bucket_set(&dev->rate, 1000, 10);
+    KUNIT_EXPECT_EQ(test, vfifo_rate_admit(vf, dev, 20, true), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_rate_admit(vf, dev, 1, true), -EAGAIN);
+    t0 = ktime_get_ns();
+    KUNIT_EXPECT_EQ(test, vfifo_rate_admit(vf, dev, 1, false), 0);
+    KUNIT_EXPECT_GE(test, ktime_get_ns() - t0, 9 * NSEC_PER_MSEC);
+    KUNIT_EXPECT_EQ(test, atomic_long_read(&dev->throttled), 3L);
+    vfifo_bucket_set(&dev->rate, 0, 0);
+}
+
+static void vfifo_test_ctrl(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    struct vfifo_ctrl *ctrl;
+    u8 buf[16] = { 0 };
+    u32 data, space;
+
+    KUNIT_ASSERT_EQ(test, vfifo_ctrl_alloc(dev), 0);
+    ctrl = dev->ctrl;
+    KUNIT_ASSERT_NOT_NULL(test, ctrl);
+    /* Mapped again: the same page */
+    KUNIT_ASSERT_EQ(test, vfifo_ctrl_alloc(dev), 0);
+    KUNIT_EXPECT_PTR_EQ(test, dev->ctrl, ctrl);
+
+    data = ctrl->data_seq;
+    space = ctrl->space_seq;
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, buf, sizeof(buf)), 0);
+    KUNIT_EXPECT_NE(test, ctrl->data_seq, data);
+    KUNIT_EXPECT_EQ(test, ctrl->space_seq, space);
+
+    data = ctrl->data_seq;
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, buf, sizeof(buf), 0), (ssize_t)sizeof(buf));
+    KUNIT_EXPECT_NE(test, ctrl->space_seq, space);
+    KUNIT_EXPECT_EQ(test, ctrl->data_seq, data);
+
+    /* Nothing moved, nothing to wake for */
+    space = ctrl->space_seq;
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, buf, sizeof(buf), 0), (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, ctrl->space_seq, space);
+}
+
+/*
+ * Edge-triggered readiness: one signal per watermark crossing. Armed without
+ * an eventfd (no fd to make one from in here), so 'fired' counts the
+ * signals an eventfd would have had.
+ */
+static void vfifo_test_evt(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    struct vfifo_evt *evt = &dev->data_evt;
+    u8 buf[64] = { 0 };
+
+    KUNIT_EXPECT_NULL(test, vfifo_evt_register(dev, evt, NULL, NULL, 32));
+    KUNIT_EXPECT_EQ(test, atomic_read(&evt->armed), 1);
+
+    /* Below the watermark: nothing */
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, buf, 16), 0);
+    KUNIT_EXPECT_EQ(test, evt->fired, 0ULL);
+    /* Crossing it: once, and not again while the level stays above */
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, buf, 16), 0);
+    KUNIT_EXPECT_EQ(test, evt->fired, 1ULL);
+    KUNIT_EXPECT_EQ(test, atomic_read(&evt->armed), 0);
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, buf, 16), 0);
+    KUNIT_EXPECT_EQ(test, evt->fired, 1ULL);
+
+    /* Still at the watermark after a read: stays disarmed */
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, buf, 16, 0), (ssize_t)16);
+    KUNIT_EXPECT_EQ(test, atomic_read(&evt->armed), 0);
+    /* Drained below it: re-armed, and the next crossing signals again */
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, buf, sizeof(buf), 0), (ssize_t)32);
+    KUNIT_EXPECT_EQ(test, atomic_read(&evt->armed), 1);
+    KUNIT_EXPECT_EQ(test, evt->fired, 1ULL);
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, buf, 40), 0);
+    KUNIT_EXPECT_EQ(test, evt->fired, 2ULL);
+
+    /* Registering while the condition holds signals at once */
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, buf, sizeof(buf), 0), (ssize_t)40);
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, buf, 8), 0);
+    KUNIT_EXPECT_NULL(test, vfifo_evt_register(dev, evt, NULL, NULL, 8));
+    KUNIT_EXPECT_EQ(test, evt->fired, 3ULL);
+
+    /* Unregistered: neither re-armed nor signalled */
+    KUNIT_EXPECT_NULL(test, vfifo_evt_register(dev, evt, NULL, NULL, 0));
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, buf, sizeof(buf), 0), (ssize_t)8);
+    KUNIT_EXPECT_EQ(test, atomic_read(&evt->armed), 0);
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, buf, 8), 0);
+    KUNIT_EXPECT_EQ(test, evt->fired, 3ULL);
+}
+
+/* Spans at or above the threshold go through non-temporal stores, and arrive intact */
+static void vfifo_test_stream(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    /* Unaligned at both ends, as the nocache copy's head and tail handling needs */
+    const u32 len = 3 * PAGE_SIZE + 5;
+    struct vfifo_file *vf;
+    struct file *filp;
+    unsigned long ubuf;
+    u32 *in, *out;
+    int i;
+
+    vf = kunit_kzalloc(test, sizeof(*vf), GFP_KERNEL);
+    filp = kunit_kzalloc(test, sizeof(*filp), GFP_KERNEL);
+    in = kunit_kmalloc(test, round_up(len, sizeof(u32)), GFP_KERNEL);
+    out = kunit_kzalloc(test, len, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, vf);
+    KUNIT_ASSERT_NOT_NULL(test, filp);
+    KUNIT_ASSERT_NOT_NULL(test, in);
+    KUNIT_ASSERT_NOT_NULL(test, out);
+    vf->dev = dev;
+    filp->private_data = vf;
+
+    /* The device's threshold, unless the fd has one of its own; 0 never streams */
+    KUNIT_EXPECT_FALSE(test, vfifo_stream_span(vf, len));
+    WRITE_ONCE(dev->stream_threshold, len);
+    KUNIT_EXPECT_TRUE(test, vfifo_stream_span(vf, len));
+    KUNIT_EXPECT_FALSE(test, vfifo_stream_span(vf, len - 1));
+    vf->stream_own = true;
+    vf->stream_threshold = 0;
+    KUNIT_EXPECT_FALSE(test, vfifo_stream_span(vf, len));
+    vf->stream_threshold = len;
+    KUNIT_EXPECT_TRUE(test, vfifo_stream_span(vf, len));
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+    ubuf = kunit_vm_mmap(test, NULL, 0, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0);
+#else
+    ubuf = 0;
+#endif
+    if (!ubuf || IS_ERR_VALUE(ubuf))
+        kunit_skip(test, "no user memory for the test thread");
+    for (i = 0; i < DIV_ROUND_UP(len, sizeof(u32)); i++)
+        in[i] = get_random_u32();
+    KUNIT_ASSERT_EQ(test, copy_to_user((void __user *)ubuf, in, len), 0UL);
+
+    vfifo_test_set_pos(dev, 3);
+    KUNIT_ASSERT_EQ(test, vfifo_write_dev(filp, dev, (const char __user *)ubuf, len),
+                    (ssize_t)len);
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, out, len, 0), (ssize_t)len);
+    KUNIT_EXPECT_EQ(test, memcmp(in, out, len), 0);
+}
+
+#if IS_ENABLED(CONFIG_VFIFO_DMABUF)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+#define dma_buf_map_attachment_unlocked     dma_buf_map_attachment
+#define dma_buf_unmap_attachment_unlocked   dma_buf_unmap_attachment
+#endif
+
+/* Drop an export and wait for its release, which fput() may defer */
+static void vfifo_test_dmabuf_put(struct dma_buf *dmabuf)
+{
+    dma_buf_put(dmabuf);
+    flush_delayed_fput();
+}
+
+/* An export holds the device and pins the pages: the ring must not move under importers */
+static void vfifo_test_dmabuf(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    unsigned int refs = kref_read(&dev->ref);
+    struct dma_buf *dmabuf;
+
+    KUNIT_EXPECT_EQ(test, vfifo_dmabuf_export(dev, ~VFIFO_DMABUF_CLOEXEC), -EINVAL);
+
+    dmabuf = vfifo_dmabuf_create(dev);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(dmabuf));
+    KUNIT_EXPECT_EQ(test, dmabuf->size, (size_t)VFIFO_TEST_CAPACITY);
+    KUNIT_EXPECT_EQ(test, atomic_read(&dev->dmabufs), 1);
+    KUNIT_EXPECT_EQ(test, kref_read(&dev->ref), refs + 1);
+    KUNIT_EXPECT_EQ(test, vfifo_resize(dev, 2 * VFIFO_TEST_CAPACITY), -EBUSY);
+    KUNIT_EXPECT_EQ(test, dev->ring.capacity, (u32)VFIFO_TEST_CAPACITY);
+
+    vfifo_test_dmabuf_put(dmabuf);
+    KUNIT_EXPECT_EQ(test, atomic_read(&dev->dmabufs), 0);
+    KUNIT_EXPECT_EQ(test, kref_read(&dev->ref), refs);
+    KUNIT_EXPECT_EQ(test, vfifo_resize(dev, 2 * VFIFO_TEST_CAPACITY), 0);
+
+    /* Only the one buffer can be exported */
+    dev->lz4 = true;
+    KUNIT_EXPECT_EQ(test, PTR_ERR(vfifo_dmabuf_create(dev)), -EOPNOTSUPP);
+    dev->lz4 = false;
+}
+
+/*
+ * An importer maps the ring's own pages, and CPU access syncs each mapping
+ * in the direction asked for, unless the mapping only allows its own.
+ */
+static void vfifo_test_dmabuf_map(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    struct vfifo_dmabuf_attach *a, one_way = { .dir = DMA_TO_DEVICE };
+    struct dma_buf_attachment *attach;
+    struct dma_buf *dmabuf;
+    struct sg_table *sgt;
+    struct device *importer;
+    u32 off;
+
+    KUNIT_EXPECT_EQ(test, vfifo_dmabuf_sync_dir(&one_way, DMA_FROM_DEVICE), DMA_TO_DEVICE);
+    KUNIT_EXPECT_EQ(test, vfifo_dmabuf_sync_dir(&one_way, DMA_BIDIRECTIONAL), DMA_TO_DEVICE);
+
+    importer = root_device_register("vfifo-kunit-importer");
+    KUNIT_ASSERT_FALSE(test, IS_ERR(importer));
+    dmabuf = vfifo_dmabuf_create(dev);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(dmabuf));
+    if (dma_coerce_mask_and_coherent(importer, DMA_BIT_MASK(64)))
+        goto out_put;
+
+    attach = dma_buf_attach(dmabuf, importer);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(attach));
+    a = attach->priv;
+    KUNIT_EXPECT_PTR_EQ(test, a->dev, importer);
+    KUNIT_EXPECT_NULL(test, a->sgt);
+
+    sgt = dma_buf_map_attachment_unlocked(attach, DMA_BIDIRECTIONAL);
+    if (IS_ERR(sgt)) {
+        /* No DMA (UML): nothing more to check */
+        dma_buf_detach(dmabuf, attach);
+        goto out_put;
+    }
+    KUNIT_EXPECT_PTR_EQ(test, a->sgt, sgt);
+    KUNIT_EXPECT_EQ(test, a->dir, DMA_BIDIRECTIONAL);
+    KUNIT_EXPECT_PTR_EQ(test, sg_page(sgt->sgl), dev->pages[0]);
+    KUNIT_EXPECT_EQ(test, vfifo_dmabuf_sync_dir(a, DMA_FROM_DEVICE), DMA_FROM_DEVICE);
+    KUNIT_EXPECT_EQ(test, vfifo_dmabuf_sync_dir(a, DMA_TO_DEVICE), DMA_TO_DEVICE);
+
+    /* What the CPU puts in the ring is what the importer's pages hold */
+    KUNIT_EXPECT_EQ(test, dma_buf_begin_cpu_access(dmabuf, DMA_TO_DEVICE), 0);
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, "dma", 3), 0);
+    KUNIT_EXPECT_EQ(test, dma_buf_end_cpu_access(dmabuf, DMA_TO_DEVICE), 0);
+    KUNIT_EXPECT_EQ(test, dma_buf_begin_cpu_access(dmabuf, DMA_FROM_DEVICE), 0);
+    off = vfifo_ring_offset(&dev->ring, dev->ring.tail);
+    KUNIT_EXPECT_EQ(test, memcmp(page_address(dev->pages[off >> PAGE_SHIFT]) + offset_in_page(off),
+                                 "dma", 3), 0);
+    KUNIT_EXPECT_EQ(test, dma_buf_end_cpu_access(dmabuf, DMA_FROM_DEVICE), 0);
+
+    dma_buf_unmap_attachment_unlocked(attach, sgt, DMA_BIDIRECTIONAL);
+    KUNIT_EXPECT_NULL(test, a->sgt);
+    dma_buf_detach(dmabuf, attach);
+out_put:
+    vfifo_test_dmabuf_put(dmabuf);
+    root_device_unregister(importer);
+    KUNIT_EXPECT_EQ(test, atomic_read(&dev->dmabufs), 0);
+}
+#endif
+
+static void vfifo_test_sessions(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv, *a, *b, *c;
+    struct vfifo_session req = { 0 };
+    struct vfifo_file *vf;
+    u8 buf[8] = "session";
+
+    dev->sessions = VFIFO_SESSION_FD;
+    dev->session_size = PAGE_SIZE;
+    dev->session_pool = 2 * PAGE_SIZE;
+
+    a = vfifo_session_open(dev);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(a));
+    b = vfifo_session_open(dev);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(b));
+    /* The pool is spent */
+    KUNIT_EXPECT_PTR_EQ(test, vfifo_session_open(dev), ERR_PTR(-ENOSPC));
+    KUNIT_EXPECT_EQ(test, dev->nr_sessions, 2U);
+    KUNIT_EXPECT_NE(test, a->session_id, b->session_id);
+
+    /* Each ring is its own */
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(a, buf, sizeof(buf)), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_used(b), 0U);
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), 0U);
+
+    /* An fd in b joins a, but only with a's token */
+    vf = kunit_kzalloc(test, sizeof(*vf), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, vf);
+    vf->filp = kunit_kzalloc(test, sizeof(*vf->filp), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, vf->filp);
+    vf->dev = b;
+    list_add(&vf->node, &b->files);
+    req.id = a->session_id;
+    req.token = a->session_token + 1;
+    KUNIT_EXPECT_EQ(test, vfifo_session_join(vf, &req), -ENOENT);
+    req.token = a->session_token;
+    KUNIT_ASSERT_EQ(test, vfifo_session_join(vf, &req), 0);
+    KUNIT_EXPECT_PTR_EQ(test, vf->dev, a);
+    KUNIT_EXPECT_PTR_EQ(test, vf->parked, b);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(vf->dev, buf, sizeof(buf), 0), (ssize_t)sizeof(buf));
+    KUNIT_EXPECT_EQ(test, memcmp(buf, "session", 8), 0);
+    /* Once only */
+    req.id = b->session_id;
+    req.token = b->session_token;
+    KUNIT_EXPECT_EQ(test, vfifo_session_join(vf, &req), -EBUSY);
+
+    /* Closing the fd lets b go, and its bytes return to the pool */
+    list_del(&vf->node);
+    vfifo_put(vf->parked);
+    vfifo_put(vf->dev);
+    KUNIT_EXPECT_EQ(test, dev->session_used, (u32)PAGE_SIZE);
+    c = vfifo_session_open(dev);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(c));
+    vfifo_put(c);
+    vfifo_put(a);
+    KUNIT_EXPECT_EQ(test, dev->session_used, 0U);
+    KUNIT_EXPECT_EQ(test, dev->nr_sessions, 0U);
+}
+
+/* A generator started on a session stops when the session's last user goes */
+static void vfifo_test_session_gen(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv, *s;
+    struct task_struct *t;
+
+    dev->sessions = VFIFO_SESSION_FD;
+    dev->session_size = PAGE_SIZE;
+    dev->session_pool = PAGE_SIZE;
+
+    s = vfifo_session_open(dev);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(s));
+    s->gen_interval_ms = 1;
+    KUNIT_ASSERT_EQ(test, vfifo_set_mode(s, true), 0);
+    t = s->gen_task;
+    get_task_struct(t);
+    msleep(20);
+    KUNIT_EXPECT_GT(test, vfifo_used(s), 0U);
+
+    vfifo_put(s);
+    KUNIT_EXPECT_EQ(test, dev->nr_sessions, 0U);
+    KUNIT_EXPECT_NE(test, READ_ONCE(t->exit_state), 0);
+    put_task_struct(t);
+}
+
+#if IS_ENABLED(CONFIG_VFIFO_LOCK_STAT)
+static void vfifo_test_lockstat(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    struct vfifo_lock_stat *ls = dev->lockstat;
+    u8 buf[16] = { 0 };
+    u64 waits = 0, holds = 0;
+    int i;
+
+    memset(dev->lockstat, 0, sizeof(dev->lockstat));
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, buf, sizeof(buf)), 0);
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, buf, sizeof(buf), 0), (ssize_t)sizeof(buf));
+
+    /* One round trip takes each side's lock twice */
+    KUNIT_EXPECT_EQ(test, ls[VFIFO_LS_RESERVE].count, 1ULL);
+    KUNIT_EXPECT_EQ(test, ls[VFIFO_LS_COMMIT].count, 1ULL);
+    KUNIT_EXPECT_EQ(test, ls[VFIFO_LS_CLAIM].count, 1ULL);
+    KUNIT_EXPECT_EQ(test, ls[VFIFO_LS_RELEASE].count, 1ULL);
+    KUNIT_EXPECT_EQ(test, ls[VFIFO_LS_DISCARD].count, 0ULL);
+    KUNIT_EXPECT_EQ(test, ls[VFIFO_LS_RESIZE].count, 0ULL);
+
+    /* Every acquisition lands in exactly one wait and one hold bucket */
+    for (i = 0; i < VFIFO_LS_BUCKETS; i++) {
+        waits += ls[VFIFO_LS_RESERVE].wait[i];
+        holds += ls[VFIFO_LS_RESERVE].hold[i];
+    }
+    KUNIT_EXPECT_EQ(test, waits, 1ULL);
+    KUNIT_EXPECT_EQ(test, holds, 1ULL);
+}
+#endif
+
+static void vfifo_test_resize(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    const u32 len = VFIFO_TEST_CAPACITY / 2 + 100;
+    u8 *in, *out;
+
+    in = kunit_kmalloc(test, len, GFP_KERNEL);
+    out = kunit_kmalloc(test, len, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, in);
+    KUNIT_ASSERT_NOT_NULL(test, out);
+    vfifo_test_fill(in, len, 5);
+
+    /* Queued data straddles the wrap in the old ring */
+    vfifo_test_set_pos(dev, VFIFO_TEST_CAPACITY - 50);
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, in, len), 0);
+
+    KUNIT_EXPECT_EQ(test, vfifo_resize(dev, 0), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vfifo_resize(dev, VFIFO_MAX_CAPACITY + 1), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vfifo_resize(dev, PAGE_SIZE), -ENOSPC);
+    KUNIT_EXPECT_EQ(test, dev->ring.capacity, (u32)VFIFO_TEST_CAPACITY);
+
+    /* Rounded up to a power of two; the data comes along */
+    KUNIT_ASSERT_EQ(test, vfifo_resize(dev, 3 * VFIFO_TEST_CAPACITY), 0);
+    KUNIT_EXPECT_EQ(test, dev->ring.capacity, (u32)(4 * VFIFO_TEST_CAPACITY));
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), len);
+    KUNIT_ASSERT_EQ(test, vfifo_resize(dev, VFIFO_TEST_CAPACITY), 0);
+    KUNIT_EXPECT_EQ(test, dev->ring.capacity, (u32)VFIFO_TEST_CAPACITY);
+
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, out, len, VFIFO_DEQUEUE_ALL), (ssize_t)len);
+    KUNIT_EXPECT_EQ(test, memcmp(in, out, len), 0);
+}
+
+static void vfifo_test_mem_limit(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    const u32 share = 256;      /* Pages; more than any other ring here holds */
+    unsigned long saved = mem_limit;
+    struct page *page;
+    int nid;
+
+    KUNIT_EXPECT_EQ(test, dev->pool_pages, VFIFO_TEST_CAPACITY >> PAGE_SHIFT);
+
+    /*
+     * With every other account below its share, the device may grow to
+     * its own share and no further. A resize holds both rings meanwhile.
+     */
+    mem_limit = (unsigned long)vfifo_nr_accounts * share << PAGE_SHIFT;
+    KUNIT_EXPECT_EQ(test, vfifo_resize(dev, (share / 2) << PAGE_SHIFT), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_resize(dev, share << PAGE_SHIFT), -ENOMEM);
+    KUNIT_EXPECT_EQ(test, dev->pool_pages, (unsigned long)share / 2);
+    mem_limit = 0;
+    KUNIT_EXPECT_EQ(test, vfifo_resize(dev, share << PAGE_SHIFT), 0);
+    KUNIT_EXPECT_EQ(test, dev->pool_pages, (unsigned long)share);
+    KUNIT_EXPECT_EQ(test, vfifo_resize(dev, VFIFO_TEST_CAPACITY), 0);
+    KUNIT_EXPECT_EQ(test, dev->pool_pages, VFIFO_TEST_CAPACITY >> PAGE_SHIFT);
+
+    /* No room at all: not even a new device */
+    mem_limit = vfifo_pages_used << PAGE_SHIFT;
+    KUNIT_EXPECT_NULL(test, vfifo_dev_alloc(PAGE_SIZE));
+    mem_limit = saved;
+
+    /* Freed pages come back last in, first out, and wiped */
+    page = vfifo_page_get(NUMA_NO_NODE);
+    KUNIT_ASSERT_NOT_NULL(test, page);
+    nid = page_to_nid(page);
+    memset(page_address(page), 0x5a, PAGE_SIZE);
+    vfifo_page_put(page);
+    KUNIT_ASSERT_PTR_EQ(test, vfifo_page_get(nid), page);
+    KUNIT_EXPECT_NULL(test, memchr_inv(page_address(page), 0, PAGE_SIZE));
+    vfifo_page_put(page);
+}
+
+/* Gives a claim back unread once a resize waits for it */
+struct vfifo_test_unread {
+    struct vfifo_dev *dev;
+    struct vfifo_resv r;
+    struct completion done;
+};
+
+static int vfifo_test_unread_fn(void *arg)
+{
+    struct vfifo_test_unread *u = arg;
+    int i;
+
+    for (i = 0; i < 500 && !READ_ONCE(u->dev->resizing); i++)
+        msleep(1);
+    vfifo_release_span(u->dev, u->r.pos, 0);
+    complete(&u->done);
+    return 0;
+}
+
+static void vfifo_test_resize_busy(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    struct vfifo_test_unread u = { .dev = dev };
+    struct task_struct *t;
+    u32 pos;
+    void *p;
+    u64 t0;
+
+    /* A reservation that is never committed makes the resize give up */
+    p = vfifo_reserve(dev, 8, &pos);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(p));
+    KUNIT_EXPECT_EQ(test, vfifo_resize(dev, 2 * VFIFO_TEST_CAPACITY), -EBUSY);
+    KUNIT_EXPECT_FALSE(test, dev->resizing);
+    KUNIT_EXPECT_EQ(test, dev->ring.capacity, (u32)VFIFO_TEST_CAPACITY);
+    KUNIT_EXPECT_EQ(test, vfifo_commit(dev, pos), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), 8U);
+
+    /* A claim given back unread moves no 'tail', but still ends the wait */
+    KUNIT_ASSERT_EQ(test, vfifo_claim_span(dev, 8, false, &u.r), 0);
+    init_completion(&u.done);
+    t = kthread_run(vfifo_test_unread_fn, &u, "vfifo-test/unread");
+    KUNIT_ASSERT_FALSE(test, IS_ERR(t));
+    t0 = ktime_get_ns();
+    KUNIT_EXPECT_EQ(test, vfifo_resize(dev, 2 * VFIFO_TEST_CAPACITY), 0);
+    KUNIT_EXPECT_LT(test, ktime_get_ns() - t0, 500 * NSEC_PER_MSEC);
+    wait_for_completion(&u.done);
+    KUNIT_EXPECT_EQ(test, dev->ring.capacity, (u32)(2 * VFIFO_TEST_CAPACITY));
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), 8U);
+}
+
+/* --- Concurrent Producers and Consumers --- */
+
+#define VFIFO_TEST_THREADS 4
+
+/* Fixed-size records, so every enqueue and dequeue moves exactly one */
+struct vfifo_test_rec {
+    u32 producer;
+    u32 seq;
+};
+
+struct vfifo_test_stress {
+    struct vfifo_dev *dev;
+    u32 per_producer;
+    u32 total;
+    atomic_t consumed;
+    atomic64_t sum_in;
+    atomic64_t sum_out;
+    atomic_t order_errors;
+};
+
+struct vfifo_test_worker {
+    struct vfifo_test_stress *st;
+    u32 id;
+    struct completion done;
+};
+
+static int vfifo_test_producer(void *arg)
+{
+    struct vfifo_test_worker *w = arg;
+    struct vfifo_test_stress *st = w->st;
+    struct vfifo_test_rec rec = { .producer = w->id };
+
+    for (rec.seq = 0; rec.seq < st->per_producer; rec.seq++) {
+        while (vfifo_enqueue(st->dev, &rec, sizeof(rec)) == -EAGAIN)
+            cond_resched();
+        atomic64_add(((u64)rec.producer << 32) | rec.seq, &st->sum_in);
+    }
+    complete(&w->done);
+    return 0;
+}
+
+/* Each consumer must see every producer's records in increasing order */
+static int vfifo_test_consumer(void *arg)
+{
+    struct vfifo_test_worker *w = arg;
+    struct vfifo_test_stress *st = w->st;
+    u32 next[VFIFO_TEST_THREADS] = { 0 };
+    struct vfifo_test_rec rec;
+
+    while (atomic_read(&st->consumed) < st->total) {
+        if (vfifo_dequeue(st->dev, &rec, sizeof(rec), VFIFO_DEQUEUE_ALL) != sizeof(rec)) {
+            cond_resched();
+            continue;
+        }
+        if (rec.producer >= VFIFO_TEST_THREADS || rec.seq < next[rec.producer])
+            atomic_inc(&st->order_errors);
+        else
+            next[rec.producer] = rec.seq + 1;
+        atomic64_add(((u64)rec.producer << 32) | rec.seq, &st->sum_out);
+        atomic_inc(&st->consumed);
+    }
+    complete(&w->done);
+    return 0;
+}
+
+/* Start @nprod producers and @ncons consumers, wait for all of them */
+static void vfifo_test_run_stress(struct kunit *test, struct vfifo_test_stress *st,
+                                  int nprod, int ncons)
+{
+    struct vfifo_test_worker *w;
+    struct task_struct *t;
+    int i, n = nprod + ncons;
+
+    w = kunit_kcalloc(test, n, sizeof(*w), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, w);
+
+    st->total = st->per_producer * nprod;
+    atomic_set(&st->consumed, 0);
+    atomic64_set(&st->sum_in, 0);
+    atomic64_set(&st->sum_out, 0);
+    atomic_set(&st->order_errors, 0);
+
+    for (i = 0; i < n; i++) {
+        w[i].st = st;
+        w[i].id = i < nprod ? i : i - nprod;
+        init_completion(&w[i].done);
+        t = kthread_run(i < nprod ? vfifo_test_producer : vfifo_test_consumer,
+                        &w[i], "vfifo-test/%d", i);
+        if (IS_ERR(t)) {
+            /* Nothing can be stopped safely: let the started ones finish */
+            KUNIT_FAIL(test, "kthread_run: %ld", PTR_ERR(t));
+            st->total = atomic_read(&st->consumed);
+            n = i;
+            break;
+        }
+    }
+    for (i = 0; i < n; i++)
+        wait_for_completion(&w[i].done);
+}
+
+static void vfifo_test_concurrent(struct kunit *test)
+{
+    struct vfifo_test_stress st = { .dev = test->priv, .per_producer = 20000 };
+
+    vfifo_test_run_stress(test, &st, VFIFO_TEST_THREADS, VFIFO_TEST_THREADS);
+
+    KUNIT_EXPECT_EQ(test, atomic_read(&st.consumed), (int)st.total);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&st.sum_out), atomic64_read(&st.sum_in));
+    KUNIT_EXPECT_EQ(test, atomic_read(&st.order_errors), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_used(st.dev), 0U);
+    KUNIT_EXPECT_EQ(test, st.dev->ring.wspans.count, 0U);
+    KUNIT_EXPECT_EQ(test, st.dev->ring.rspans.count, 0U);
+}
+
+/* --- Per-CPU Shards --- */
+
+/* Two possible CPUs whose shards the tests fill by hand (the same one on UP) */
+static void vfifo_test_two_shards(struct kunit *test, enum vfifo_sharding mode,
+                                  struct vfifo_subring **a, struct vfifo_subring **b)
+{
+    struct vfifo_dev *dev = test->priv;
+    int first = cpumask_first(cpu_possible_mask);
+    int second = cpumask_next(first, cpu_possible_mask);
+
+    KUNIT_ASSERT_EQ(test, vfifo_shards_alloc(dev, mode), 0);
+    *a = dev->subs[first];
+    *b = dev->subs[second < nr_cpu_ids ? second : first];
+}
+
+static void vfifo_test_shard_records(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    struct vfifo_subring *a, *b;
+    struct vfifo_resv r;
+    u8 out[16];
+    u32 pos;
+
+    vfifo_test_two_shards(test, VFIFO_SHARD_UNORDERED, &a, &b);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, sizeof(out), 0), (ssize_t)-EAGAIN);
+
+    /* Reads return whole writes: the second does not fit after the first */
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, "hello", 5), 0);
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, "world!", 6), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_level(dev, true), 2 * vfifo_rec_size(6));
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, 8, 0), (ssize_t)5);
+    KUNIT_EXPECT_EQ(test, memcmp(out, "hello", 5), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, 3, 0), (ssize_t)-EMSGSIZE);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, sizeof(out), 0), (ssize_t)6);
+    KUNIT_EXPECT_EQ(test, memcmp(out, "world!", 6), 0);
+
+    /* A record that was never filled is skipped */
+    KUNIT_ASSERT_EQ(test, vfifo_rec_reserve(dev, a, 4, &r), 0);
+    vfifo_rec_at(a, r.pos)->flags = VFIFO_REC_SKIP;
+    vfifo_rec_commit(dev, a, r.pos);
+    KUNIT_ASSERT_EQ(test, vfifo_rec_enqueue(dev, b, "b", 1), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, sizeof(out), 0), (ssize_t)1);
+    KUNIT_EXPECT_EQ(test, out[0], (u8)'b');
+    KUNIT_EXPECT_EQ(test, vfifo_level(dev, true), 0U);
+
+    /* Limits, and what only the single ring can do */
+    KUNIT_EXPECT_EQ(test, vfifo_enqueue(dev, out, 0), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vfifo_enqueue(dev, out, vfifo_rec_max(dev) + 1), -EINVAL);
+    KUNIT_EXPECT_EQ(test, PTR_ERR(vfifo_reserve(dev, 4, &pos)), (long)-EOPNOTSUPP);
+    KUNIT_EXPECT_EQ(test, vfifo_resize(dev, 2 * VFIFO_TEST_CAPACITY), -EOPNOTSUPP);
+
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, "x", 1), 0);
+    vfifo_clear(dev);
+    KUNIT_EXPECT_FALSE(test, vfifo_subs_readable(dev));
+}
+
+/* Merged reads come out in key order whichever shard holds each record */
+static void vfifo_test_shard_merge(struct kunit *test)
+{
+    static const enum vfifo_sharding modes[] = { VFIFO_SHARD_SEQUENCE, VFIFO_SHARD_TIMESTAMP };
+    struct vfifo_dev *dev = test->priv;
+    struct vfifo_subring *a, *b;
+    u32 i, v;
+    int m;
+
+    for (m = 0; m < ARRAY_SIZE(modes); m++) {
+        vfifo_subs_free(dev);
+        vfifo_test_two_shards(test, modes[m], &a, &b);
+        for (i = 0; i < 8; i++)
+            KUNIT_ASSERT_EQ(test, vfifo_rec_enqueue(dev, (i & 2) ? b : a, &i, sizeof(i)), 0);
+        for (i = 0; i < 8; i++) {
+            KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, &v, sizeof(v), 0), (ssize_t)sizeof(v));
+            KUNIT_EXPECT_EQ_MSG(test, v, i, "sharding=%s", vfifo_sharding_names[modes[m]]);
+        }
+    }
+}
+
+static void vfifo_test_shard_concurrent(struct kunit *test)
+{
+    struct vfifo_test_stress st = { .dev = test->priv, .per_producer = 20000 };
+
+    /* Producers migrate between shards; the sequence merge keeps their order */
+    KUNIT_ASSERT_EQ(test, vfifo_shards_alloc(st.dev, VFIFO_SHARD_SEQUENCE), 0);
+    vfifo_test_run_stress(test, &st, VFIFO_TEST_THREADS, VFIFO_TEST_THREADS);
+
+    KUNIT_EXPECT_EQ(test, atomic_read(&st.consumed), (int)st.total);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&st.sum_out), atomic64_read(&st.sum_in));
+    KUNIT_EXPECT_EQ(test, atomic_read(&st.order_errors), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_level(st.dev, true), 0U);
+}
+
+/* --- Multi-Queue --- */
+
+static void vfifo_test_queue_steering(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    struct vfifo_subring *q;
+    u32 i, v, other;
+
+    KUNIT_ASSERT_EQ(test, vfifo_queues_alloc(dev, 4, false), 0);
+    KUNIT_EXPECT_EQ(test, dev->nr_subs, 4U);
+
+    /* One flow always lands in one queue, in order */
+    q = vfifo_queue_of(dev, 7);
+    for (i = 0; i < 3; i++)
+        KUNIT_ASSERT_EQ(test, vfifo_enqueue_flow(dev, 7, &i, sizeof(i)), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_ring_used(&q->ring), 3 * vfifo_rec_size(sizeof(i)));
+    KUNIT_EXPECT_EQ(test, q->enqueued, 3ULL);
+    KUNIT_EXPECT_EQ(test, q->bytes_in, 3ULL * sizeof(i));
+
+    /* Find a flow steered elsewhere; a reader bound to q never sees it */
+    for (other = 8; vfifo_queue_of(dev, other) == q; other++)
+        ;
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue_flow(dev, other, "x", 1), 0);
+    for (i = 0; i < 3; i++) {
+        KUNIT_ASSERT_EQ(test, vfifo_rec_dequeue(dev, q, (char *)&v, NULL, sizeof(v)),
+                        (ssize_t)sizeof(v));
+        KUNIT_EXPECT_EQ(test, v, i);
+    }
+    KUNIT_EXPECT_EQ(test, vfifo_rec_dequeue(dev, q, (char *)&v, NULL, sizeof(v)),
+                    (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, q->dequeued, 3ULL);
+
+    /* Unbound readers find it wherever it is */
+    KUNIT_EXPECT_TRUE(test, vfifo_subs_readable(dev));
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, &v, sizeof(v), 0), (ssize_t)1);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, &v, sizeof(v), 0), (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, vfifo_level(dev, true), 0U);
+}
+
+static void vfifo_test_queue_concurrent(struct kunit *test)
+{
+    struct vfifo_test_stress st = { .dev = test->priv, .per_producer = 20000 };
+
+    /* vfifo_enqueue() makes each producer task a flow: its order holds */
+    KUNIT_ASSERT_EQ(test, vfifo_queues_alloc(st.dev, VFIFO_TEST_THREADS, false), 0);
+    vfifo_test_run_stress(test, &st, VFIFO_TEST_THREADS, VFIFO_TEST_THREADS);
+
+    KUNIT_EXPECT_EQ(test, atomic_read(&st.consumed), (int)st.total);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&st.sum_out), atomic64_read(&st.sum_in));
+    KUNIT_EXPECT_EQ(test, atomic_read(&st.order_errors), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_level(st.dev, true), 0U);
+}
+
+/* --- Priority Lanes --- */
+
+static void vfifo_test_lane_strict(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    struct vfifo_subring *low;
+    u32 i, v;
+
+    KUNIT_ASSERT_EQ(test, vfifo_queues_alloc(dev, 3, true), 0);
+    low = dev->subs[2];
+
+    /* The lowest lane is full; the top lane still takes records */
+    for (i = 0; vfifo_enqueue(dev, &i, sizeof(i)) == 0; i++)
+        ;
+    KUNIT_EXPECT_EQ(test, low->enqueued, (u64)i);
+    KUNIT_EXPECT_GT(test, low->full, 0ULL);
+    v = 100;
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue_flow(dev, 0, &v, sizeof(v)), 0);
+    v = 200;
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue_flow(dev, 1, &v, sizeof(v)), 0);
+
+    /* Strictly by priority, then in order within a lane */
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, &v, sizeof(v), 0), (ssize_t)sizeof(v));
+    KUNIT_EXPECT_EQ(test, v, 100U);
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, &v, sizeof(v), 0), (ssize_t)sizeof(v));
+    KUNIT_EXPECT_EQ(test, v, 200U);
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, &v, sizeof(v), 0), (ssize_t)sizeof(v));
+    KUNIT_EXPECT_EQ(test, v, 0U);
+    KUNIT_EXPECT_EQ(test, dev->subs[0]->dequeued, 1ULL);
+    KUNIT_EXPECT_EQ(test, dev->subs[0]->lat_max, dev->subs[0]->lat_sum);
+}
+
+static void vfifo_test_lane_wrr(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    u32 i, lane, got[2] = { 0, 0 };
+
+    KUNIT_ASSERT_EQ(test, vfifo_queues_alloc(dev, 2, true), 0);
+    dev->lane_wrr = true;
+    KUNIT_EXPECT_EQ(test, vfifo_to_queue(dev->subs[0])->weight, 2U);
+    KUNIT_EXPECT_EQ(test, vfifo_to_queue(dev->subs[1])->weight, 1U);
+
+    for (i = 0; i < 30; i++) {
+        lane = i & 1;
+        KUNIT_ASSERT_EQ(test, vfifo_enqueue_flow(dev, lane, &lane, sizeof(lane)), 0);
+    }
+
+    /* While both have data, lane 0 gets two turns for each of lane 1's */
+    for (i = 0; i < 15; i++) {
+        KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, &lane, sizeof(lane), 0),
+                        (ssize_t)sizeof(lane));
+        got[lane]++;
+    }
+    KUNIT_EXPECT_EQ(test, got[0], 10U);
+    KUNIT_EXPECT_EQ(test, got[1], 5U);
+
+    /* An empty lane gives up its turn: the rest drains without stalling */
+    for (i = 0; i < 15; i++)
+        KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, &lane, sizeof(lane), 0),
+                        (ssize_t)sizeof(lane));
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, &lane, sizeof(lane), 0), (ssize_t)-EAGAIN);
+}
+
+/* --- Configuration --- */
+
+static void vfifo_test_config_check(struct kunit *test)
+{
+    struct vfifo_config cfg = { .capacity = 5000, .node = NUMA_NO_NODE, .gen_interval_ms = 1 };
+
+    /* Rounded to a power-of-two number of pages */
+    KUNIT_EXPECT_EQ(test, vfifo_config_check(&cfg), 0);
+    KUNIT_EXPECT_EQ(test, cfg.capacity, (u32)roundup_pow_of_two(PAGE_ALIGN(5000)));
+
+    /* One layout at a time */
+    cfg.nr_queues = 2;
+    cfg.nr_lanes = 2;
+    KUNIT_EXPECT_EQ(test, vfifo_config_check(&cfg), -EINVAL);
+    cfg.nr_lanes = 0;
+    cfg.sharding = VFIFO_SHARD_UNORDERED;
+    KUNIT_EXPECT_EQ(test, vfifo_config_check(&cfg), -EINVAL);
+    cfg.nr_queues = 0;
+    KUNIT_EXPECT_EQ(test, vfifo_config_check(&cfg), 0);
+    cfg.compress = true;
+    KUNIT_EXPECT_EQ(test, vfifo_config_check(&cfg), -EINVAL);
+    cfg.sharding = VFIFO_SHARD_OFF;
+    KUNIT_EXPECT_EQ(test, vfifo_config_check(&cfg), 0);
+
+    cfg.capacity = VFIFO_MAX_CAPACITY + 1;
+    KUNIT_EXPECT_EQ(test, vfifo_config_check(&cfg), -EINVAL);
+    cfg.capacity = PAGE_SIZE;
+    cfg.node = MAX_NUMNODES;
+    KUNIT_EXPECT_EQ(test, vfifo_config_check(&cfg), -EINVAL);
+    cfg.node = NUMA_NO_NODE;
+    cfg.gen_interval_ms = 0;
+    KUNIT_EXPECT_EQ(test, vfifo_config_check(&cfg), -EINVAL);
+}
+
+/* Destroying a device (configfs enable=0, rmdir) leaves its open fds working until they close */
+static void vfifo_test_destroy_open(struct kunit *test)
+{
+    struct vfifo_config cfg = { .capacity = PAGE_SIZE, .node = NUMA_NO_NODE, .gen_interval_ms = 1000 };
+    struct file *filp, *filp2;
+    struct vfifo_dev *dev;
+    struct inode *inode;
+    u8 buf[4] = "abc";
+
+    /* Needs the char region and class from vfifo_init() */
+    if (!vfifo_class)
+        kunit_skip(test, "module not initialised");
+    inode = kunit_kzalloc(test, sizeof(*inode), GFP_KERNEL);
+    filp = kunit_kzalloc(test, sizeof(*filp), GFP_KERNEL);
+    filp2 = kunit_kzalloc(test, sizeof(*filp2), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, inode);
+    KUNIT_ASSERT_NOT_NULL(test, filp);
+    KUNIT_ASSERT_NOT_NULL(test, filp2);
+
+    dev = vfifo_create("vfifo-kunit", &cfg, NULL);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(dev));
+    inode->i_rdev = dev->devt;
+    KUNIT_ASSERT_EQ(test, vfifo_open(inode, filp), 0);
+    KUNIT_EXPECT_EQ(test, kref_read(&dev->ref), 2U);
+
+    vfifo_destroy(dev);
+    KUNIT_EXPECT_EQ(test, vfifo_open(inode, filp2), -ENODEV);
+    KUNIT_EXPECT_EQ(test, kref_read(&dev->ref), 1U);
+    KUNIT_EXPECT_PTR_EQ(test, ((struct vfifo_file *)filp->private_data)->dev, dev);
+    KUNIT_EXPECT_EQ(test, vfifo_enqueue(dev, buf, sizeof(buf)), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, buf, sizeof(buf), 0), (ssize_t)sizeof(buf));
+    /* The minor is not handed out again while the fd is open */
+    KUNIT_EXPECT_EQ(test, ida_alloc_range(&vfifo_minors, dev->minor, dev->minor, GFP_KERNEL),
+                    -ENOSPC);
+
+    vfifo_release(inode, filp);
+}
+
+/* --- Tee --- */
+
+/* Make @nr sinks of @src, sized in pages; @src keeps them alive */
+static void vfifo_test_tee_sinks(struct kunit *test, struct vfifo_dev *src,
+                                 struct vfifo_dev **sinks, const u32 *pages, int nr)
+{
+    int i;
+
+    for (i = 0; i < nr; i++) {
+        sinks[i] = vfifo_dev_alloc(pages[i] * PAGE_SIZE);
+        KUNIT_ASSERT_NOT_NULL(test, sinks[i]);
+        KUNIT_ASSERT_EQ(test, vfifo_tee_prepare(src, sinks[i]), 0);
+        vfifo_tee_attach(src, sinks[i]);
+        vfifo_put(sinks[i]);
+    }
+}
+
+static void vfifo_test_tee(struct kunit *test)
+{
+    struct vfifo_dev *src = test->priv, *sinks[2];
+    static const u32 pages[2] = { 1, 1 };
+    size_t len = 2 * PAGE_SIZE + 100;
+    struct vfifo_tref *ta, *tb;
+    u8 *in, *out;
+    u32 pos;
+    int i;
+
+    in = kunit_kmalloc(test, len, GFP_KERNEL);
+    out = kunit_kzalloc(test, len, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, in);
+    KUNIT_ASSERT_NOT_NULL(test, out);
+    vfifo_test_fill(in, len, 3);
+    vfifo_test_tee_sinks(test, src, sinks, pages, 2);
+
+    /* One copy, referenced from both sinks */
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(src, in, len), 0);
+    for (i = 0; i < 2; i++) {
+        KUNIT_EXPECT_EQ(test, vfifo_level(sinks[i], true), (u32)len);
+        KUNIT_EXPECT_EQ(test, vfifo_used(sinks[i]), 3 * (u32)sizeof(struct vfifo_tref));
+    }
+    ta = (struct vfifo_tref *)vfifo_ptr(sinks[0], sinks[0]->ring.cons);
+    tb = (struct vfifo_tref *)vfifo_ptr(sinks[1], sinks[1]->ring.cons);
+    KUNIT_EXPECT_PTR_EQ(test, ta->page, tb->page);
+    KUNIT_EXPECT_EQ(test, page_ref_count(ta->page), 2);
+    KUNIT_EXPECT_EQ(test, vfifo_used(src), 0U);
+
+    /* Each sink reads at its own pace, in pieces of any size */
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(sinks[0], out, 10, 0), (ssize_t)10);
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(sinks[0], out + 10, len, 0), (ssize_t)(len - 10));
+    KUNIT_EXPECT_EQ(test, memcmp(in, out, len), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(sinks[0], out, len, 0), (ssize_t)-EAGAIN);
+
+    memset(out, 0, len);
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(sinks[1], out, len, 0), (ssize_t)len);
+    KUNIT_EXPECT_EQ(test, memcmp(in, out, len), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_level(sinks[1], true), 0U);
+
+    /* Sinks only take the source's writes, and expose no byte ring */
+    KUNIT_EXPECT_EQ(test, vfifo_enqueue(sinks[0], in, 1), -EOPNOTSUPP);
+    KUNIT_EXPECT_TRUE(test, IS_ERR(vfifo_reserve(src, 1, &pos)));
+}
+
+static void vfifo_test_tee_full(struct kunit *test)
+{
+    struct vfifo_dev *src = test->priv, *sinks[2];
+    static const u32 pages[2] = { 1, 2 };
+    u32 per_page = PAGE_SIZE / sizeof(struct vfifo_tref), n;
+    u8 c = 'x';
+
+    vfifo_test_tee_sinks(test, src, sinks, pages, 2);
+    sinks[0]->tee_drop = true;
+
+    /* The small sink fills first and then misses writes; the other holds them back */
+    for (n = 0; vfifo_enqueue(src, &c, 1) == 0; n++)
+        ;
+    KUNIT_EXPECT_EQ(test, n, 2 * per_page);
+    KUNIT_EXPECT_EQ(test, vfifo_level(sinks[0], true), per_page);
+    KUNIT_EXPECT_EQ(test, sinks[0]->tee_dropped, (u64)per_page);
+    KUNIT_EXPECT_EQ(test, vfifo_level(sinks[1], true), 2 * per_page);
+    KUNIT_EXPECT_EQ(test, vfifo_free(sinks[1]), 0U);
+    KUNIT_EXPECT_EQ(test, vfifo_enqueue(src, &c, 1), -EAGAIN);
+    KUNIT_EXPECT_EQ(test, sinks[0]->tee_dropped, (u64)per_page);
+
+    /* Clearing a sink returns the page references */
+    vfifo_clear(sinks[1]);
+    KUNIT_EXPECT_EQ(test, vfifo_level(sinks[1], true), 0U);
+    KUNIT_EXPECT_EQ(test, vfifo_enqueue(src, &c, 1), 0);
+}
+
+/* --- Compression --- */
+
+#if IS_ENABLED(CONFIG_VFIFO_LZ4)
+/* Text-like data: compresses well, but not to nothing */
+static void vfifo_test_fill_text(u8 *buf, size_t len)
+{
+    static const char words[] = "vfifo queued sample ";
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = i % 97 == 0 ? (u8)i : words[i % (sizeof(words) - 1)];
+}
+
+static void vfifo_test_lz4(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    size_t len = 4 * VFIFO_TEST_CAPACITY, done;
+    ssize_t ret;
+    u8 *in, *out;
+    u32 need;
+
+    in = kunit_kmalloc(test, len, GFP_KERNEL);
+    out = kunit_kzalloc(test, len, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, in);
+    KUNIT_ASSERT_NOT_NULL(test, out);
+    vfifo_test_fill_text(in, len);
+    KUNIT_ASSERT_EQ(test, vfifo_lz4_setup(dev), 0);
+
+    /* Four ring sizes' worth fits in one ring */
+    KUNIT_ASSERT_EQ(test, vfifo_lz4_write(dev, in, len, &need), (ssize_t)len);
+    KUNIT_EXPECT_EQ(test, vfifo_level(dev, true), (u32)len);
+    KUNIT_EXPECT_EQ(test, dev->lz4_raw, (u64)len);
+    KUNIT_EXPECT_LT(test, dev->lz4_stored, (u64)VFIFO_TEST_CAPACITY);
+
+    /* Reads of any size cut blocks up; the rest waits for the next read */
+    for (done = 0; done < len; done += ret) {
+        ret = vfifo_dequeue(dev, out + done, min_t(size_t, 1000, len - done), 0);
+        KUNIT_ASSERT_GT(test, ret, (ssize_t)0);
+    }
+    KUNIT_EXPECT_EQ(test, memcmp(in, out, len), 0);
+    KUNIT_EXPECT_EQ(test, vfifo_level(dev, true), 0U);
+    KUNIT_EXPECT_EQ(test, vfifo_used(dev), 0U);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, len, 0), (ssize_t)-EAGAIN);
+
+    /* In-kernel producers enqueue one block at a time, and lose no half-read one to a clear */
+    KUNIT_EXPECT_EQ(test, vfifo_enqueue(dev, in, dev->lz4_block + 1), -EINVAL);
+    KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, in, dev->lz4_block), 0);
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, out, 10, 0), (ssize_t)10);
+    vfifo_clear(dev);
+    KUNIT_EXPECT_EQ(test, vfifo_level(dev, true), 0U);
+    KUNIT_EXPECT_EQ(test, vfifo_dequeue(dev, out, len, 0), (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_TRUE(test, IS_ERR(vfifo_reserve(dev, 1, &need)));
+}
+
+static void vfifo_test_lz4_random(struct kunit *test)
+{
+    struct vfifo_dev *dev = test->priv;
+    u32 *in, *out, need, rec;
+    size_t len;
+    int i;
+
+    KUNIT_ASSERT_EQ(test, vfifo_lz4_setup(dev), 0);
+    len = dev->lz4_block;
+    in = kunit_kmalloc(test, len, GFP_KERNEL);
+    out = kunit_kzalloc(test, len, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, in);
+    KUNIT_ASSERT_NOT_NULL(test, out);
+    for (i = 0; i < len / sizeof(u32); i++)
+        in[i] = get_random_u32();
+
+    /* Stored as is, so the ring holds what it would uncompressed, less headers */
+    rec = vfifo_lz4_rec_size(len);
+    for (i = 0; i < VFIFO_TEST_CAPACITY / rec; i++)
+        KUNIT_ASSERT_EQ(test, vfifo_lz4_write(dev, (u8 *)in, len, &need), (ssize_t)len);
+    KUNIT_EXPECT_EQ(test, vfifo_lz4_write(dev, (u8 *)in, len, &need), (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, need, rec);
+    KUNIT_EXPECT_EQ(test, dev->lz4_stored, dev->lz4_raw);
+
+    KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, out, len, 0), (ssize_t)len);
+    KUNIT_EXPECT_EQ(test, memcmp(in, out, len), 0);
+    KUNIT_EXPECT_TRUE(test, vfifo_can_reserve(dev, need));
+}
+#endif
+
+static struct kunit_case vfifo_test_cases[] = {
+    KUNIT_CASE(vfifo_test_empty),
+    KUNIT_CASE(vfifo_test_full),
+    KUNIT_CASE(vfifo_test_partial_dequeue),
+    KUNIT_CASE(vfifo_test_wrap),
+    KUNIT_CASE(vfifo_test_commit_order),
+    KUNIT_CASE(vfifo_test_discard),
+    KUNIT_CASE(vfifo_test_reserve_limits),
+    KUNIT_CASE(vfifo_test_claim_release),
+    KUNIT_CASE(vfifo_test_clear),
+    KUNIT_CASE(vfifo_test_mode),
+    KUNIT_CASE(vfifo_test_status),
+    KUNIT_CASE(vfifo_test_rate),
+    KUNIT_CASE(vfifo_test_ctrl),
+    KUNIT_CASE(vfifo_test_evt),
+    KUNIT_CASE(vfifo_test_stream),
+#if IS_ENABLED(CONFIG_VFIFO_DMABUF)
+    KUNIT_CASE(vfifo_test_dmabuf),
+    KUNIT_CASE(vfifo_test_dmabuf_map),
+#endif
+    KUNIT_CASE(vfifo_test_sessions),
+    KUNIT_CASE(vfifo_test_session_gen),
+#if IS_ENABLED(CONFIG_VFIFO_LOCK_STAT)
+    KUNIT_CASE(vfifo_test_lockstat),
+#endif
+    KUNIT_CASE(vfifo_test_resize),
+    KUNIT_CASE(vfifo_test_mem_limit),
+    KUNIT_CASE_SLOW(vfifo_test_resize_busy),
+    KUNIT_CASE_SLOW(vfifo_test_concurrent),
+    KUNIT_CASE(vfifo_test_shard_records),
+    KUNIT_CASE(vfifo_test_shard_merge),
+    KUNIT_CASE_SLOW(vfifo_test_shard_concurrent),
+    KUNIT_CASE(vfifo_test_queue_steering),
+    KUNIT_CASE_SLOW(vfifo_test_queue_concurrent),
+    KUNIT_CASE(vfifo_test_lane_strict),
+    KUNIT_CASE(vfifo_test_lane_wrr),
+    KUNIT_CASE(vfifo_test_tee),
+    KUNIT_CASE(vfifo_test_tee_full),
+#if IS_ENABLED(CONFIG_VFIFO_LZ4)
+    KUNIT_CASE(vfifo_test_lz4),
+    KUNIT_CASE(vfifo_test_lz4_random),
+#endif
+    KUNIT_CASE(vfifo_test_config_check),
+    KUNIT_CASE(vfifo_test_destroy_open),
+    {}
+};
+
+static struct kunit_suite vfifo_test_suite = {
+    .name = "vfifo",
+    .init = vfifo_test_init,
+    .exit = vfifo_test_exit,
+    .test_cases = vfifo_test_cases,
+};
+
+/* --- Microbenchmarks --- */
+
+/*
+ * Numbers go to the KTAP log ("# vfifo_bench_...: ..."), so a run under
+ * UML or QEMU can be compared against an earlier one. They only fail if
+ * the data path itself fails. Each measurement runs for a fixed time.
+ */
+#define VFIFO_BENCH_NS (200 * NSEC_PER_MSEC)
+
+static void vfifo_bench_report(struct kunit *test, const char *what, u32 size,
+                               u64 ops, u64 ns)
+{
+    u64 bytes = ops * size;
+
+    kunit_info(test, "%-16s size=%-5u ops=%llu ns/op=%llu MB/s=%llu\n", what, size, ops,
+               ops ? div64_u64(ns, ops) : 0, div64_u64(bytes * 1000, ns));
+}
+
+/* One thread, enqueue then dequeue: the cost of the path without contention */
+static void vfifo_bench_copy(struct kunit *test)
+{
+    static const u32 sizes[] = { 16, 64, 256, 1024, 4096 };
+    struct vfifo_dev *dev = test->priv;
+    u64 start, now, ops;
+    u8 *buf;
+    int i;
+
+    buf = kunit_kzalloc(test, 4096, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        ops = 0;
+        start = ktime_get_ns();
+        do {
+            KUNIT_ASSERT_EQ(test, vfifo_enqueue(dev, buf, sizes[i]), 0);
+            KUNIT_ASSERT_EQ(test, vfifo_dequeue(dev, buf, sizes[i], VFIFO_DEQUEUE_ALL),
+                            (ssize_t)sizes[i]);
+            ops++;
+            now = ktime_get_ns();
+        } while (now - start < VFIFO_BENCH_NS);
+        vfifo_bench_report(test, "enqueue+dequeue", sizes[i], ops, now - start);
+    }
+}
+
+/* Reserve/commit with the fill done in place, no intermediate buffer */
+static void vfifo_bench_reserve(struct kunit *test)
+{
+    static const u32 sizes[] = { 16, 256, 4096 };
+    struct vfifo_dev *dev = test->priv;
+    struct vfifo_resv r;
+    u64 start, now, ops;
+    void *p;
+    u32 pos;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        ops = 0;
+        start = ktime_get_ns();
+        do {
+            p = vfifo_reserve(dev, sizes[i], &pos);
+            KUNIT_ASSERT_FALSE(test, IS_ERR(p));
+            memset(p, 0x5a, sizes[i]);
+            KUNIT_ASSERT_EQ(test, vfifo_commit(dev, pos), 0);
+            KUNIT_ASSERT_EQ(test, vfifo_claim_span(dev, sizes[i], false, &r), 0);
+            vfifo_release_span(dev, r.pos, r.len);
+            ops++;
+            now = ktime_get_ns();
+        } while (now - start < VFIFO_BENCH_NS);
+        vfifo_bench_report(test, "reserve+commit", sizes[i], ops, now - start);
+    }
+}
+
+/* Threads on both sides, the same workload as vfifo_test_concurrent */
+static void vfifo_bench_threads(struct kunit *test)
+{
+    static const int threads[] = { 1, 2, VFIFO_TEST_THREADS };
+    struct vfifo_test_stress st = { .dev = test->priv, .per_producer = 200000 };
+    char what[16];
+    u64 start;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(threads); i++) {
+        st.per_producer = 200000 / threads[i];
+        start = ktime_get_ns();
+        vfifo_test_run_stress(test, &st, threads[i], threads[i]);
+        snprintf(what, sizeof(what), "%dP%dC", threads[i], threads[i]);
+        vfifo_bench_report(test, what, sizeof(struct vfifo_test_rec), st.total,
+                           ktime_get_ns() - start);
+        KUNIT_EXPECT_EQ(test, atomic_read(&st.order_errors), 0);
+        KUNIT_EXPECT_EQ(test, atomic64_read(&st.sum_out), atomic64_read(&st.sum_in));
+    }
+}
+
+/* The same, with per-CPU shards: producers should scale with the CPUs */
+static void vfifo_bench_shards(struct kunit *test)
+{
+    static const enum vfifo_sharding modes[] = { VFIFO_SHARD_UNORDERED, VFIFO_SHARD_SEQUENCE };
+    struct vfifo_test_stress st = { .dev = test->priv };
+    char what[24];
+    u64 start;
+    int m, n;
+
+    for (m = 0; m < ARRAY_SIZE(modes); m++) {
+        vfifo_subs_free(st.dev);
+        KUNIT_ASSERT_EQ(test, vfifo_shards_alloc(st.dev, modes[m]), 0);
+        for (n = 1; n <= VFIFO_TEST_THREADS; n *= 2) {
+            st.per_producer = 200000 / n;
+            start = ktime_get_ns();
+            vfifo_test_run_stress(test, &st, n, 1);
+            snprintf(what, sizeof(what), "%s %dP1C", vfifo_sharding_names[modes[m]], n);
+            vfifo_bench_report(test, what, sizeof(struct vfifo_test_rec), st.total,
+                               ktime_get_ns() - start);
+            KUNIT_EXPECT_EQ(test, atomic64_read(&st.sum_out), atomic64_read(&st.sum_in));
+        }
+    }
+}
+
+static struct kunit_case vfifo_bench_cases[] = {
+    KUNIT_CASE_SLOW(vfifo_bench_copy),
+    KUNIT_CASE_SLOW(vfifo_bench_reserve),
+    KUNIT_CASE_SLOW(vfifo_bench_threads),
+    KUNIT_CASE_SLOW(vfifo_bench_shards),
+    {}
+};
+
+static struct kunit_suite vfifo_bench_suite = {
+    .name = "vfifo_bench",
+    .init = vfifo_test_init,
+    .exit = vfifo_test_exit,
+    .test_cases = vfifo_bench_cases,
+};
+
+kunit_test_suites(&vfifo_test_suite, &vfifo_bench_suite);
@@ -0,0 +1,633 @@
+/*
+ * vfifo_pingpong.c - round-trip latency of vfifo against standard IPC
+ *
+ * Two processes pinned to different CPUs bounce a small message back and
+ * forth. One process times every round trip. vfifo needs two instances,
+ * one for each direction:
+ *
+ *   sudo insmod vfifo.ko nr_devices=2
+ *   sudo ./vfifo-pingpong -m all -s 64
+ *   sudo ./vfifo-pingpong -m vfifo-mmap -s 256 -D > mmap.hgrm
+ *
+ * Transports:
+ *   vfifo        blocking read()/write() on /dev/vfifo0 and /dev/vfifo1
+ *   vfifo-poll   the same with O_NONBLOCK, spinning on EAGAIN
+ *   vfifo-mmap   RESERVE/COMMIT and PEEK/CONSUME through the mapping,
+ *                spinning on PEEK
+ *   vfifo-futex  non-blocking read()/write(), sleeping on the control
+ *                page's futex words instead of in the driver
+ *   pipe         two pipe(2)s
+ *   eventfd      message in shared memory, eventfd(2) as the doorbell
+ *   unix         an AF_UNIX stream socketpair
+ *
+ * Prints p50/p99/p99.9/max per transport. With -D it prints instead the
+ * full percentile distribution in HdrHistogram's text format, which the
+ * usual HdrHistogram plotters accept.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+#include <time.h>
+#include <libgen.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "vfifo_uapi.h"
+
+static const char *dev_ab = "/dev/vfifo0";
+static const char *dev_ba = "/dev/vfifo1";
+static size_t msg_size = 64;
+static long iterations = 100000;
+static long warmup = 1000;
+static int cpu_a = 0, cpu_b = 1;
+static int distribution;
+
+/* --- Histogram --- */
+
+/*
+ * Log-linear buckets: exact below 64 ns, then 32 sub-buckets per power of
+ * two (about 3% resolution), the same layout HdrHistogram uses.
+ */
+#define HIST_SUB        32
+#define HIST_BUCKETS    (60 * HIST_SUB)
+
+struct hist {
+    uint64_t count[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+    double sum, sum_sq;
+};
+
+static unsigned int hist_index(uint64_t v)
+{
+    unsigned int b;
+
+    if (v < 2 * HIST_SUB)
+        return v;
+    b = 63 - __builtin_clzll(v);
+    return (b - 5) * HIST_SUB + (v >> (b - 5));
+}
+
+/* Highest value in bucket @i */
+static uint64_t hist_value(unsigned int i)
+{
+    unsigned int b, sub;
+
+    if (i < 2 * HIST_SUB)
+        return i;
+    b = i / HIST_SUB + 4;
+    sub = i % HIST_SUB + HIST_SUB;
+    return ((uint64_t)(sub + 1) << (b - 5)) - 1;
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+    unsigned int i = hist_index(v);
+
+    h->count[i < HIST_BUCKETS ? i : HIST_BUCKETS - 1]++;
+    h->total++;
+    h->sum += v;
+    h->sum_sq += (double)v * v;
+    if (v > h->max)
+        h->max = v;
+}
+
+static uint64_t hist_percentile(const struct hist *h, double pct)
+{
+    uint64_t target = (uint64_t)ceil(pct / 100.0 * h->total), seen = 0;
+    unsigned int i;
+
+    if (target == 0)
+        target = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen >= target)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+/* HdrHistogram's outputPercentileDistribution(), values in microseconds */
+static void hist_print_distribution(const struct hist *h, const char *name)
+{
+    double pct = 0, mean = h->sum / h->total;
+    double stddev = sqrt(h->sum_sq / h->total - mean * mean);
+    uint64_t v, seen, target;
+    unsigned int i = 0;
+    const int ticks = 5;
+
+    printf("# %s, %zu byte messages, round trip\n", name, msg_size);
+    printf("%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+    for (;;) {
+        target = (uint64_t)ceil(pct / 100.0 * h->total);
+        for (seen = 0, i = 0; i < HIST_BUCKETS; i++) {
+            seen += h->count[i];
+            if (seen >= target && seen > 0)
+                break;
+        }
+        v = hist_value(i) < h->max ? hist_value(i) : h->max;
+        if (pct >= 100) {
+            printf("%12.3f %1.12f %10llu\n", v / 1000.0, 1.0, (unsigned long long)h->total);
+            break;
+        }
+        printf("%12.3f %1.12f %10llu %14.2f\n", v / 1000.0, pct / 100,
+               (unsigned long long)seen, 1 / (1 - pct / 100));
+        if (seen >= h->total) {
+            pct = 100;
+            continue;
+        }
+        /* Halve the distance to 100% every 'ticks' lines */
+        pct += 100 / (pow(2, floor(log2(100 / (100 - pct))) + 1) * ticks);
+    }
+    printf("#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1000, stddev / 1000);
+    printf("#[Max     = %12.3f, Total count    = %12llu]\n", h->max / 1000.0,
+           (unsigned long long)h->total);
+    printf("#[Buckets = %12d, SubBuckets     = %12d]\n", HIST_BUCKETS / HIST_SUB, HIST_SUB);
+}
+
+/* --- Transports --- */
+
+/* One side's view of the link */
+struct endpoint {
+    int rfd, wfd;
+    char *rmap, *wmap;          /* vfifo-mmap: the two rings */
+    unsigned int rcap, wcap;
+    char *shm_in, *shm_out;     /* eventfd: message slots */
+    struct vfifo_ctrl *rctrl, *wctrl;   /* vfifo-futex: the control pages */
+};
+
+struct transport {
+    const char *name;
+    int (*setup)(struct endpoint *a, struct endpoint *b);
+    void (*send)(struct endpoint *e, const char *buf, size_t len);
+    void (*recv)(struct endpoint *e, char *buf, size_t len);
+};
+
+static void die(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(fd, buf, len);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            die("write");
+        }
+        buf += ret;
+        len -= ret;
+    }
+}
+
+static void read_all(int fd, char *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = read(fd, buf, len);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            die("read");
+        }
+        if (ret == 0) {
+            fprintf(stderr, "read: unexpected EOF\n");
+            exit(1);
+        }
+        buf += ret;
+        len -= ret;
+    }
+}
+
+static void fd_send(struct endpoint *e, const char *buf, size_t len)
+{
+    write_all(e->wfd, buf, len);
+}
+
+static void fd_recv(struct endpoint *e, char *buf, size_t len)
+{
+    read_all(e->rfd, buf, len);
+}
+
+static int setup_pipe(struct endpoint *a, struct endpoint *b)
+{
+    int ab[2], ba[2];
+
+    if (pipe(ab) || pipe(ba))
+        return -1;
+    a->wfd = ab[1];
+    b->rfd = ab[0];
+    b->wfd = ba[1];
+    a->rfd = ba[0];
+    return 0;
+}
+
+static int setup_unix(struct endpoint *a, struct endpoint *b)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+        return -1;
+    a->rfd = a->wfd = sv[0];
+    b->rfd = b->wfd = sv[1];
+    return 0;
+}
+
+static int setup_eventfd(struct endpoint *a, struct endpoint *b)
+{
+    char *shm;
+
+    shm = mmap(NULL, 2 * msg_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shm == MAP_FAILED)
+        return -1;
+    a->wfd = eventfd(0, 0);
+    b->wfd = eventfd(0, 0);
+    if (a->wfd < 0 || b->wfd < 0)
+        return -1;
+    b->rfd = dup(a->wfd);
+    a->rfd = dup(b->wfd);
+    a->shm_out = b->shm_in = shm;
+    b->shm_out = a->shm_in = shm + msg_size;
+    return 0;
+}
+
+static void eventfd_send(struct endpoint *e, const char *buf, size_t len)
+{
+    uint64_t one = 1;
+
+    memcpy(e->shm_out, buf, len);
+    write_all(e->wfd, (const char *)&one, sizeof(one));
+}
+
+static void eventfd_recv(struct endpoint *e, char *buf, size_t len)
+{
+    uint64_t n;
+
+    read_all(e->rfd, (char *)&n, sizeof(n));
+    memcpy(buf, e->shm_in, len);
+}
+
+static unsigned int vfifo_capacity(const char *device)
+{
+    char path[256], *dev = strdup(device);
+    unsigned int cap = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/class/vfifo/%s/capacity", basename(dev));
+    free(dev);
+    f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%u", &cap) != 1)
+            cap = 0;
+        fclose(f);
+    }
+    return cap;
+}
+
+static int vfifo_open(const char *device, int flags)
+{
+    int fd = open(device, O_RDWR | flags);
+
+    if (fd >= 0)
+        ioctl(fd, VFIFO_CLEAR);
+    return fd;
+}
+
+static int setup_vfifo_flags(struct endpoint *a, struct endpoint *b, int flags)
+{
+    a->wfd = vfifo_open(dev_ab, flags);
+    b->rfd = vfifo_open(dev_ab, flags);
+    b->wfd = vfifo_open(dev_ba, flags);
+    a->rfd = vfifo_open(dev_ba, flags);
+    return a->wfd < 0 || a->rfd < 0 || b->wfd < 0 || b->rfd < 0 ? -1 : 0;
+}
+
+static int setup_vfifo(struct endpoint *a, struct endpoint *b)
+{
+    return setup_vfifo_flags(a, b, 0);
+}
+
+static int setup_vfifo_poll(struct endpoint *a, struct endpoint *b)
+{
+    return setup_vfifo_flags(a, b, O_NONBLOCK);
+}
+
+static char *vfifo_map(int fd, unsigned int cap)
+{
+    char *map = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    return map == MAP_FAILED ? NULL : map;
+}
+
+static int setup_vfifo_mmap(struct endpoint *a, struct endpoint *b)
+{
+    unsigned int cap_ab = vfifo_capacity(dev_ab), cap_ba = vfifo_capacity(dev_ba);
+
+    if (!cap_ab || !cap_ba || msg_size > cap_ab || msg_size > cap_ba) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* Writers may block in RESERVE; readers spin on PEEK */
+    a->wfd = vfifo_open(dev_ab, 0);
+    b->rfd = vfifo_open(dev_ab, O_NONBLOCK);
+    b->wfd = vfifo_open(dev_ba, 0);
+    a->rfd = vfifo_open(dev_ba, O_NONBLOCK);
+    if (a->wfd < 0 || a->rfd < 0 || b->wfd < 0 || b->rfd < 0)
+        return -1;
+    a->wcap = b->rcap = cap_ab;
+    b->wcap = a->rcap = cap_ba;
+    a->wmap = vfifo_map(a->wfd, cap_ab);
+    b->rmap = vfifo_map(b->rfd, cap_ab);
+    b->wmap = vfifo_map(b->wfd, cap_ba);
+    a->rmap = vfifo_map(a->rfd, cap_ba);
+    return a->wmap && a->rmap && b->wmap && b->rmap ? 0 : -1;
+}
+
+static void vfifo_mmap_send(struct endpoint *e, const char *buf, size_t len)
+{
+    struct vfifo_reservation res;
+    size_t first = len;
+
+    memset(&res, 0, sizeof(res));
+    res.len = len;
+    while (ioctl(e->wfd, VFIFO_RESERVE, &res) < 0)
+        if (errno != EINTR)
+            die("VFIFO_RESERVE");
+    if (res.offset + first > e->wcap)
+        first = e->wcap - res.offset;
+    memcpy(e->wmap + res.offset, buf, first);
+    memcpy(e->wmap, buf + first, len - first);
+    if (ioctl(e->wfd, VFIFO_COMMIT, &res.pos) < 0)
+        die("VFIFO_COMMIT");
+}
+
+static void vfifo_mmap_recv(struct endpoint *e, char *buf, size_t len)
+{
+    struct vfifo_span span;
+    unsigned int n = len;
+    size_t first = len;
+
+    for (;;) {
+        if (ioctl(e->rfd, VFIFO_PEEK, &span) == 0) {
+            if (span.len >= len)
+                break;
+        } else if (errno != EAGAIN && errno != EINTR) {
+            die("VFIFO_PEEK");
+        }
+    }
+    if (span.offset + first > e->rcap)
+        first = e->rcap - span.offset;
+    memcpy(buf, e->rmap + span.offset, first);
+    memcpy(buf + first, e->rmap, len - first);
+    if (ioctl(e->rfd, VFIFO_CONSUME, &n) < 0)
+        die("VFIFO_CONSUME");
+}
+
+static struct vfifo_ctrl *vfifo_map_ctrl(int fd)
+{
+    void *map = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, VFIFO_CTRL_OFFSET);
+
+    return map == MAP_FAILED ? NULL : map;
+}
+
+static int setup_vfifo_futex(struct endpoint *a, struct endpoint *b)
+{
+    if (setup_vfifo_flags(a, b, O_NONBLOCK))
+        return -1;
+    a->wctrl = vfifo_map_ctrl(a->wfd);
+    b->rctrl = vfifo_map_ctrl(b->rfd);
+    b->wctrl = vfifo_map_ctrl(b->wfd);
+    a->rctrl = vfifo_map_ctrl(a->rfd);
+    return a->wctrl && a->rctrl && b->wctrl && b->rctrl ? 0 : -1;
+}
+
+static long futex(uint32_t *word, int op, uint32_t val)
+{
+    return syscall(SYS_futex, word, op, val, NULL, NULL, 0);
+}
+
+/* The driver has moved data_seq on by the time write() returns */
+static void vfifo_futex_send(struct endpoint *e, const char *buf, size_t len)
+{
+    write_all(e->wfd, buf, len);
+    if (__atomic_load_n(&e->wctrl->data_waiters, __ATOMIC_SEQ_CST))
+        futex(&e->wctrl->data_seq, FUTEX_WAKE, INT_MAX);
+}
+
+/*
+ * Announce ourselves, then look again before sleeping: a write that lands
+ * in between either sees us waiting or changes data_seq under FUTEX_WAIT.
+ */
+static void vfifo_futex_recv(struct endpoint *e, char *buf, size_t len)
+{
+    struct vfifo_ctrl *c = e->rctrl;
+    uint32_t seq;
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = read(e->rfd, buf, len);
+        if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+            __atomic_add_fetch(&c->data_waiters, 1, __ATOMIC_SEQ_CST);
+            seq = __atomic_load_n(&c->data_seq, __ATOMIC_SEQ_CST);
+            ret = read(e->rfd, buf, len);
+            if (ret < 0 && errno == EAGAIN)
+                futex(&c->data_seq, FUTEX_WAIT, seq);
+            __atomic_sub_fetch(&c->data_waiters, 1, __ATOMIC_SEQ_CST);
+            if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+        }
+        if (ret <= 0)
+            die("read");
+        buf += ret;
+        len -= ret;
+    }
+}
+
+static const struct transport transports[] = {
+    { "vfifo",      setup_vfifo,      fd_send,         fd_recv },
+    { "vfifo-poll", setup_vfifo_poll, fd_send,         fd_recv },
+    { "vfifo-mmap", setup_vfifo_mmap, vfifo_mmap_send, vfifo_mmap_recv },
+    { "vfifo-futex", setup_vfifo_futex, vfifo_futex_send, vfifo_futex_recv },
+    { "pipe",       setup_pipe,       fd_send,         fd_recv },
+    { "eventfd",    setup_eventfd,    eventfd_send,    eventfd_recv },
+    { "unix",       setup_unix,       fd_send,         fd_recv },
+};
+
+#define NR_TRANSPORTS (sizeof(transports) / sizeof(transports[0]))
+
+/* --- Driver --- */
+
+static void pin(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set))
+        perror("sched_setaffinity");
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void close_endpoint(struct endpoint *e)
+{
+    if (e->rmap)
+        munmap(e->rmap, e->rcap);
+    if (e->wmap)
+        munmap(e->wmap, e->wcap);
+    if (e->rctrl)
+        munmap(e->rctrl, sysconf(_SC_PAGESIZE));
+    if (e->wctrl)
+        munmap(e->wctrl, sysconf(_SC_PAGESIZE));
+    if (e->rfd >= 0)
+        close(e->rfd);
+    if (e->wfd >= 0 && e->wfd != e->rfd)
+        close(e->wfd);
+}
+
+static int run(const struct transport *t)
+{
+    struct endpoint a, b;
+    struct hist *h;
+    char *buf;
+    uint64_t t0;
+    pid_t pid;
+    long i;
+    int status;
+
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    a.rfd = a.wfd = b.rfd = b.wfd = -1;
+    if (t->setup(&a, &b)) {
+        fprintf(stderr, "%s: setup failed: %s\n", t->name, strerror(errno));
+        return -1;
+    }
+    buf = calloc(1, msg_size);
+    h = calloc(1, sizeof(*h));
+    if (!buf || !h)
+        die("calloc");
+
+    pid = fork();
+    if (pid < 0)
+        die("fork");
+    if (pid == 0) {
+        /* Echo side */
+        pin(cpu_b);
+        for (i = 0; i < warmup + iterations; i++) {
+            t->recv(&b, buf, msg_size);
+            t->send(&b, buf, msg_size);
+        }
+        _exit(0);
+    }
+
+    pin(cpu_a);
+    for (i = 0; i < warmup + iterations; i++) {
+        t0 = now_ns();
+        t->send(&a, buf, msg_size);
+        t->recv(&a, buf, msg_size);
+        if (i >= warmup)
+            hist_add(h, now_ns() - t0);
+    }
+    waitpid(pid, &status, 0);
+
+    if (distribution)
+        hist_print_distribution(h, t->name);
+    else
+        printf("%-11s %6zu %9ld %10.2f %10.2f %10.2f %10.2f\n", t->name, msg_size, iterations,
+               hist_percentile(h, 50) / 1000.0, hist_percentile(h, 99) / 1000.0,
+               hist_percentile(h, 99.9) / 1000.0, h->max / 1000.0);
+    fflush(stdout);
+
+    /* The child's copies are gone with it; ours are closed here */
+    close_endpoint(&a);
+    close_endpoint(&b);
+    if (a.shm_out)
+        munmap(a.shm_out, 2 * msg_size);
+    free(buf);
+    free(h);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    unsigned int i;
+
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -m NAME  transport, or 'all' (default):", prog);
+    for (i = 0; i < NR_TRANSPORTS; i++)
+        fprintf(stderr, " %s", transports[i].name);
+    fprintf(stderr, "\n"
+            "  -s SIZE  message size in bytes (default 64)\n"
+            "  -i N     timed round trips (default 100000)\n"
+            "  -w N     untimed warm-up round trips (default 1000)\n"
+            "  -a CPU   CPU of the timing process (default 0)\n"
+            "  -b CPU   CPU of the echo process (default 1)\n"
+            "  -f DEV   vfifo device for the forward direction (default /dev/vfifo0)\n"
+            "  -r DEV   vfifo device for the return direction (default /dev/vfifo1)\n"
+            "  -D       print the HdrHistogram percentile distribution\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = "all";
+    unsigned int i;
+    int opt, ran = 0;
+
+    while ((opt = getopt(argc, argv, "m:s:i:w:a:b:f:r:Dh")) != -1) {
+        switch (opt) {
+        case 'm': name = optarg; break;
+        case 's': msg_size = strtoul(optarg, NULL, 0); break;
+        case 'i': iterations = atol(optarg); break;
+        case 'w': warmup = atol(optarg); break;
+        case 'a': cpu_a = atoi(optarg); break;
+        case 'b': cpu_b = atoi(optarg); break;
+        case 'f': dev_ab = optarg; break;
+        case 'r': dev_ba = optarg; break;
+        case 'D': distribution = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (msg_size == 0 || iterations < 1 || warmup < 0)
+        usage(argv[0]);
+
+    if (!distribution)
+        printf("%-11s %6s %9s %10s %10s %10s %10s\n", "# transport", "size", "iters",
+               "p50_us", "p99_us", "p99.9_us", "max_us");
+    for (i = 0; i < NR_TRANSPORTS; i++) {
+        if (strcmp(name, "all") && strcmp(name, transports[i].name))
+            continue;
+        ran++;
+        run(&transports[i]);
+    }
+    if (!ran)
+        usage(argv[0]);
+    return 0;
+}
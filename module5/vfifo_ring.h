@@ -0,0 +1,412 @@
+/*
+ * vfifo_ring.h - the ring core: positions, claims and their arithmetic
+ *
+ * Header-only and free of kernel dependencies beyond a few primitives, so
+ * the exact algorithm the driver runs also builds in user space (see
+ * test_ring.c) for sanitizers, fuzzers and benchmarks without a module.
+ *
+ * The core only does bookkeeping. It never touches the data, never sleeps
+ * and never locks: callers hold one lock per side around the calls,
+ *   producer side: vfifo_ring_reserve/commit/discard
+ *   consumer side: vfifo_ring_claim/release/peek
+ * and copy data in or out of their claim between the calls, unlocked.
+ * The two sides only communicate through 'head' and 'tail' (and the
+ * queue of discarded spans, 'holes'), published with release stores and
+ * read with acquire loads.
+ */
+#ifndef VFIFO_RING_H
+#define VFIFO_RING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/compiler.h>
+#include <asm/barrier.h>
+#else
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+
+typedef uint32_t u32;
+
+#define READ_ONCE(x)            __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, val)      __atomic_store_n(&(x), (val), __ATOMIC_RELAXED)
+#define smp_load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+/* How many claims each side may have in flight (reserved but not committed) */
+#define VFIFO_MAX_RESV 64
+
+/* A claim on ring bytes [pos, pos + len) by a producer or a consumer */
+struct vfifo_resv {
+    u32 pos;
+    u32 len;
+    bool busy;              /* Still being filled (or read) by its owner */
+    bool skip;              /* Discarded: retires as a hole, never read */
+    const void *owner;      /* Opaque tag (the driver uses the struct file), or NULL */
+};
+
+/* In-flight claims of one side, oldest first. The side's lock protects it. */
+struct vfifo_spans {
+    struct vfifo_resv slot[VFIFO_MAX_RESV];
+    unsigned int first;
+    unsigned int count;     /* Also read unlocked, as a hint */
+};
+
+/* A discarded reservation that readers step over */
+struct vfifo_hole {
+    u32 pos;
+    u32 len;
+};
+
+struct vfifo_ring {
+    u32 capacity;           /* Power of two, so (pos & (capacity - 1)) is the index */
+
+    /*
+     * Positions are free-running counters: tail <= cons <= head <= reserve.
+     *   [tail, cons)    claimed by consumers, still being read
+     *   [cons, head)    committed data, available to readers
+     *   [head, reserve) claimed by producers, possibly still being filled
+     */
+    u32 head;
+    u32 tail;
+    u32 reserve;
+    u32 cons;
+
+    struct vfifo_spans wspans;  /* Producer side */
+    struct vfifo_spans rspans;  /* Consumer side */
+
+    /*
+     * Discarded reservations in [cons, head), oldest first: producers add
+     * one as 'head' passes it, readers drop it as 'cons' steps over it.
+     * One writer per side, published like head and tail themselves.
+     */
+    struct vfifo_hole holes[VFIFO_MAX_RESV];
+    u32 hole_head;          /* Producer side */
+    u32 hole_tail;          /* Consumer side */
+    bool hole_wait;         /* A discarded span waits for room in holes[] */
+
+    u32 lost;               /* Unread bytes short releases dropped (consumer side) */
+};
+
+/* @capacity must be a power of two. Positions may start anywhere. */
+static inline void vfifo_ring_init(struct vfifo_ring *r, u32 capacity, u32 pos)
+{
+    r->capacity = capacity;
+    r->head = r->tail = r->reserve = r->cons = pos;
+    r->wspans.first = r->wspans.count = 0;
+    r->rspans.first = r->rspans.count = 0;
+    r->hole_head = r->hole_tail = 0;
+    r->hole_wait = false;
+    r->lost = 0;
+}
+
+static inline u32 vfifo_ring_offset(const struct vfifo_ring *r, u32 pos)
+{
+    return pos & (r->capacity - 1);
+}
+
+/* Committed bytes not yet released by readers (and holes not yet skipped) */
+static inline u32 vfifo_ring_used(struct vfifo_ring *r)
+{
+    return smp_load_acquire(&r->head) - READ_ONCE(r->tail);
+}
+
+/* Bytes a producer could still reserve */
+static inline u32 vfifo_ring_free(struct vfifo_ring *r)
+{
+    return READ_ONCE(r->capacity) - (READ_ONCE(r->reserve) - smp_load_acquire(&r->tail));
+}
+
+/* Committed bytes no reader has claimed yet, counting holes ahead of them */
+static inline u32 vfifo_ring_avail(struct vfifo_ring *r)
+{
+    return smp_load_acquire(&r->head) - READ_ONCE(r->cons);
+}
+
+/* --- Claim Queues --- */
+
+static inline struct vfifo_resv *vfifo_spans_at(struct vfifo_spans *s, unsigned int i)
+{
+    return &s->slot[(s->first + i) % VFIFO_MAX_RESV];
+}
+
+static inline struct vfifo_resv *vfifo_spans_push(struct vfifo_spans *s, u32 pos, u32 len,
+                                                  const void *owner)
+{
+    struct vfifo_resv *r = vfifo_spans_at(s, s->count);
+
+    r->pos = pos;
+    r->len = len;
+    r->busy = true;
+    r->skip = false;
+    r->owner = owner;
+    WRITE_ONCE(s->count, s->count + 1);
+    return r;
+}
+
+static inline struct vfifo_resv *vfifo_spans_find(struct vfifo_spans *s, u32 pos,
+                                                  const void *owner)
+{
+    struct vfifo_resv *r;
+    unsigned int i;
+
+    for (i = 0; i < s->count; i++) {
+        r = vfifo_spans_at(s, i);
+        if (r->busy && r->pos == pos && r->owner == owner)
+            return r;
+    }
+    return NULL;
+}
+
+static inline bool vfifo_spans_is_newest(struct vfifo_spans *s, const struct vfifo_resv *r)
+{
+    return r == vfifo_spans_at(s, s->count - 1);
+}
+
+/* Drop the oldest claim */
+static inline void vfifo_spans_pop(struct vfifo_spans *s)
+{
+    s->first = (s->first + 1) % VFIFO_MAX_RESV;
+    WRITE_ONCE(s->count, s->count - 1);
+}
+
+/*
+ * Retire finished claims from the front of the queue. Returns true if any
+ * were retired, with *end set to the position just past the last one.
+ * Claims only retire in order, whatever order their owners finish in.
+ */
+static inline bool vfifo_spans_retire(struct vfifo_spans *s, u32 *end)
+{
+    struct vfifo_resv *r;
+    bool retired = false;
+
+    while (s->count > 0) {
+        r = vfifo_spans_at(s, 0);
+        if (r->busy)
+            break;
+        *end = r->pos + r->len;
+        vfifo_spans_pop(s);
+        retired = true;
+    }
+    return retired;
+}
+
+/* --- Producer Side (under the producer lock) --- */
+
+/*
+ * Claim @len bytes for a producer. With @partial, claim as much as fits
+ * (at least one byte). -EINVAL if @len can never fit, -EAGAIN if it does
+ * not fit now.
+ */
+static inline int vfifo_ring_reserve(struct vfifo_ring *r, u32 len, bool partial,
+                                     const void *owner, struct vfifo_resv *out)
+{
+    u32 free_space;
+
+    if (len == 0 || len > r->capacity)
+        return -EINVAL;
+
+    /* Pairs with the release in vfifo_ring_release(): readers are done with it */
+    free_space = r->capacity - (r->reserve - smp_load_acquire(&r->tail));
+    if (partial && free_space > 0 && free_space < len)
+        len = free_space;
+
+    if (free_space < len || r->wspans.count == VFIFO_MAX_RESV)
+        return -EAGAIN;
+
+    *out = *vfifo_spans_push(&r->wspans, r->reserve, len, owner);
+    WRITE_ONCE(r->reserve, r->reserve + len);
+    return 0;
+}
+
+/*
+ * Publish every finished reservation at the front of the queue: committed
+ * ones as data, discarded ones as holes. A discarded span waits (with
+ * everything after it) while holes[] is full; readers make room as they
+ * skip, and the caller then publishes again. Returns 1 if 'head' moved.
+ */
+static inline int vfifo_ring_publish(struct vfifo_ring *r)
+{
+    struct vfifo_resv *res;
+    struct vfifo_hole *h;
+    u32 head = r->head;
+
+    WRITE_ONCE(r->hole_wait, false);
+    while (r->wspans.count > 0) {
+        res = vfifo_spans_at(&r->wspans, 0);
+        if (res->busy)
+            break;
+        if (res->skip) {
+            /* Pairs with the release in vfifo_ring_skip(): readers are done with the slot */
+            if (r->hole_head - smp_load_acquire(&r->hole_tail) == VFIFO_MAX_RESV) {
+                WRITE_ONCE(r->hole_wait, true);
+                break;
+            }
+            h = &r->holes[r->hole_head % VFIFO_MAX_RESV];
+            h->pos = res->pos;
+            h->len = res->len;
+            smp_store_release(&r->hole_head, r->hole_head + 1);
+        }
+        head = res->pos + res->len;
+        vfifo_spans_pop(&r->wspans);
+    }
+    if (head == r->head)
+        return 0;
+    /* Order the producers' data stores (and the holes) before the new head */
+    smp_store_release(&r->head, head);
+    return 1;
+}
+
+/*
+ * Mark the reservation at @pos as filled, then publish every completed
+ * reservation at the front of the queue. A span only becomes visible once
+ * all spans reserved before it are finished too, so readers see data in
+ * reservation order even though producers finish in any order. Returns
+ * 1 if 'head' moved, 0 if not, -EINVAL if there is no such reservation.
+ */
+static inline int vfifo_ring_commit(struct vfifo_ring *r, u32 pos, const void *owner)
+{
+    struct vfifo_resv *res;
+
+    res = vfifo_spans_find(&r->wspans, pos, owner);
+    if (!res)
+        return -EINVAL;
+    res->busy = false;
+    return vfifo_ring_publish(r);
+}
+
+/*
+ * Give up the reservation at @pos. The newest one is simply handed back.
+ * Any other is already followed by later claims, so it retires in order
+ * like a commit, but as a hole: readers skip its bytes and never see them.
+ * Returns 1 if 'head' moved, 0 if not, -EINVAL if there is no such
+ * reservation.
+ */
+static inline int vfifo_ring_discard(struct vfifo_ring *r, u32 pos, const void *owner)
+{
+    struct vfifo_resv *res;
+
+    res = vfifo_spans_find(&r->wspans, pos, owner);
+    if (!res)
+        return -EINVAL;
+    if (vfifo_spans_is_newest(&r->wspans, res)) {
+        WRITE_ONCE(r->wspans.count, r->wspans.count - 1);
+        WRITE_ONCE(r->reserve, r->reserve - res->len);
+        return 0;
+    }
+    res->skip = true;
+    res->busy = false;
+    return vfifo_ring_publish(r);
+}
+
+/* --- Consumer Side (under the consumer lock) --- */
+
+/*
+ * Step 'cons' over the holes it has reached, then return how many bytes
+ * can be read from there: up to 'head' or the next hole. A skipped hole
+ * is released like a finished read claim, in claim order, so 'tail' can
+ * move here too.
+ */
+static inline u32 vfifo_ring_skip(struct vfifo_ring *r)
+{
+    struct vfifo_resv *res;
+    struct vfifo_hole *h;
+    u32 head, holes, tail;
+
+    /* Pairs with the release in vfifo_ring_publish(): data and holes are in */
+    head = smp_load_acquire(&r->head);
+    holes = smp_load_acquire(&r->hole_head);
+
+    while (r->hole_tail != holes) {
+        h = &r->holes[r->hole_tail % VFIFO_MAX_RESV];
+        /* Holes published after our 'head' was read are still ahead of it */
+        if (h->pos - r->cons >= head - r->cons)
+            break;
+        if (h->pos != r->cons)
+            return h->pos - r->cons;
+        if (r->rspans.count == VFIFO_MAX_RESV)
+            return 0;
+
+        res = vfifo_spans_push(&r->rspans, r->cons, h->len, NULL);
+        res->busy = false;
+        WRITE_ONCE(r->cons, r->cons + h->len);
+        /* Pairs with the acquire in vfifo_ring_publish(): the slot may be reused */
+        smp_store_release(&r->hole_tail, r->hole_tail + 1);
+        if (vfifo_spans_retire(&r->rspans, &tail))
+            smp_store_release(&r->tail, tail);
+    }
+    return head - r->cons;
+}
+
+/*
+ * Claim up to @len committed bytes for a reader (exactly @len unless
+ * @partial). Claims never span a hole. -EAGAIN if there is nothing (or not
+ * enough) to claim.
+ */
+static inline int vfifo_ring_claim(struct vfifo_ring *r, u32 len, bool partial,
+                                   struct vfifo_resv *out)
+{
+    u32 avail;
+
+    if (len == 0)
+        return -EINVAL;
+
+    avail = vfifo_ring_skip(r);
+    if (partial && avail > 0 && avail < len)
+        len = avail;
+
+    if (avail < len || r->rspans.count == VFIFO_MAX_RESV)
+        return -EAGAIN;
+
+    *out = *vfifo_spans_push(&r->rspans, r->cons, len, NULL);
+    WRITE_ONCE(r->cons, r->cons + len);
+    return 0;
+}
+
+/*
+ * Release the claim at @pos after reading @done of its bytes. A short read
+ * of the newest claim gives the unread rest back to other readers. Behind
+ * a later claim it cannot go back, so it is dropped and added to 'lost'.
+ * Space is returned to producers in claim order. Returns 1 if 'tail'
+ * moved, 0 if not, -EINVAL if there is no such claim.
+ */
+static inline int vfifo_ring_release(struct vfifo_ring *r, u32 pos, u32 done)
+{
+    struct vfifo_resv *res;
+    u32 tail;
+
+    res = vfifo_spans_find(&r->rspans, pos, NULL);
+    if (!res)
+        return -EINVAL;
+    if (done < res->len && vfifo_spans_is_newest(&r->rspans, res)) {
+        WRITE_ONCE(r->cons, r->cons - (res->len - done));
+        res->len = done;
+        /* Nothing read: drop it, so the claim before it is the newest again */
+        if (!done) {
+            WRITE_ONCE(r->rspans.count, r->rspans.count - 1);
+            return 0;
+        }
+    } else if (done < res->len) {
+        WRITE_ONCE(r->lost, r->lost + (res->len - done));
+    }
+    res->busy = false;
+
+    if (!vfifo_spans_retire(&r->rspans, &tail))
+        return 0;
+    /* Our reads of the data must complete before producers may reuse it */
+    smp_store_release(&r->tail, tail);
+    return 1;
+}
+
+/* First readable (unclaimed) byte and how many follow it, up to the next hole */
+static inline u32 vfifo_ring_peek(struct vfifo_ring *r, u32 *pos)
+{
+    u32 avail = vfifo_ring_skip(r);
+
+    *pos = r->cons;
+    return avail;
+}
+
+#endif /* VFIFO_RING_H */
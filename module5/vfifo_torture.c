@@ -0,0 +1,526 @@
+/*
+ * vfifo_torture.c - stress test for the vfifo data path
+ *
+ * In the spirit of rcutorture: load it next to vfifo.ko and it hammers one
+ * instance with producer and consumer kthreads through the exported API
+ * (vfifo.h). Every record carries its producer, a sequence number, a
+ * timestamp and a check word, so consumers can verify:
+ *   - ordering: each consumer sees each producer's records in order
+ *   - integrity: no torn or corrupted records
+ *   - no loss: everything committed is consumed exactly once (with
+ *     drop_on_full, the drops are accounted for instead)
+ * The result, ops/sec and latency percentiles are printed when the test
+ * ends ('duration' seconds, or rmmod), ending in SUCCESS or FAILURE.
+ *
+ * The instance must not be used by anyone else during the test.
+ *
+ *   sudo insmod vfifo.ko buffer_size=65536
+ *   sudo insmod vfifo_torture.ko nr_producers=64 nr_consumers=64 duration=60
+ *   dmesg | grep vfifo_torture
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/cpumask.h>
+#include <linux/sched.h>
+
+#include "vfifo.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("anonymous");
+MODULE_DESCRIPTION("Torture test for the vfifo data path");
+
+static char *instance = "vfifo0";
+module_param(instance, charp, 0444);
+MODULE_PARM_DESC(instance, "vfifo instance to torture");
+
+static int nr_producers = 4;
+module_param(nr_producers, int, 0444);
+MODULE_PARM_DESC(nr_producers, "Number of producer threads");
+
+static int nr_consumers = 4;
+module_param(nr_consumers, int, 0444);
+MODULE_PARM_DESC(nr_consumers, "Number of consumer threads");
+
+static char *mode = "copy";
+module_param(mode, charp, 0444);
+MODULE_PARM_DESC(mode, "Producer path: copy (vfifo_enqueue) or reserve (reserve/commit in place)");
+
+static int duration = 30;
+module_param(duration, int, 0444);
+MODULE_PARM_DESC(duration, "Seconds to run, 0 = until rmmod");
+
+static int stat_interval = 10;
+module_param(stat_interval, int, 0444);
+MODULE_PARM_DESC(stat_interval, "Seconds between progress reports, 0 = none");
+
+static int stutter = 100;
+module_param(stutter, int, 0444);
+MODULE_PARM_DESC(stutter, "Longest random sleep between operations in us, 0 = never sleep");
+
+static int shuffle_interval = 100;
+module_param(shuffle_interval, int, 0444);
+MODULE_PARM_DESC(shuffle_interval, "Milliseconds between moving threads to random CPUs, 0 = never");
+
+static bool drop_on_full;
+module_param(drop_on_full, bool, 0444);
+MODULE_PARM_DESC(drop_on_full, "Drop a record (and count it) when the ring is full instead of retrying");
+
+#define VT_MAX_THREADS  1024
+
+/* One in this many operations sleeps (stutter) or, in reserve mode, discards */
+#define VT_STUTTER_ODDS 64
+#define VT_DISCARD_ODDS 97
+
+/* Latency histogram: 4 sub-buckets per power of two, like a coarse HdrHistogram */
+#define VT_LAT_BUCKETS  256
+
+/* Fixed size, so every enqueue and dequeue moves exactly one record */
+struct vt_rec {
+    u32 producer;
+    u32 seq;
+    u64 stamp;      /* ktime_get_ns() when it was queued */
+    u32 check;      /* Never 0, so an all-zero record fails the check */
+    u32 pad[3];
+};
+
+struct vt_producer {
+    struct task_struct *task;
+    u32 id;
+    u64 sent;       /* Committed records */
+    u64 sent_sum;   /* Sum of their sequence numbers */
+    u64 dropped;    /* Records skipped: ring full (drop_on_full) or discarded */
+    u64 full;       /* -EAGAIN from the ring */
+};
+
+struct vt_consumer {
+    struct task_struct *task;
+    u32 id;
+    u64 records;
+    u64 order_errors;
+    u64 corrupt;
+    u32 *next_seq;  /* Per producer: lowest sequence number still acceptable */
+    u64 *recv;      /* Per producer: records received ... */
+    u64 *recv_sum;  /* ... and the sum of their sequence numbers */
+    u64 lat[VT_LAT_BUCKETS];
+};
+
+static struct vfifo_dev *vt_dev;
+static bool vt_reserve_mode;
+static struct vt_producer *vt_producers;
+static struct vt_consumer *vt_consumers;
+static struct task_struct *vt_control_task;
+static u64 vt_start_ns;
+static bool vt_finished;
+
+static u32 vt_check(const struct vt_rec *rec)
+{
+    return (rec->producer * 0x9e3779b1U ^ rec->seq ^ (u32)rec->stamp ^ (u32)(rec->stamp >> 32)) | 1;
+}
+
+static unsigned int vt_lat_bucket(u64 ns)
+{
+    unsigned int b;
+
+    if (ns < 4)
+        return ns;
+    b = fls64(ns) - 1;
+    return b * 4 + ((ns >> (b - 2)) & 3);
+}
+
+/* Largest value that falls in bucket @i */
+static u64 vt_lat_bucket_max(unsigned int i)
+{
+    unsigned int b = i / 4, sub = i % 4;
+
+    if (b < 2)
+        return i;
+    return ((u64)(4 + sub + 1) << (b - 2)) - 1;
+}
+
+static void vt_stutter(void)
+{
+    u32 us;
+
+    if (stutter <= 0 || get_random_u32() % VT_STUTTER_ODDS) {
+        cond_resched();
+        return;
+    }
+    us = get_random_u32() % stutter;
+    usleep_range(us, us + 1);
+}
+
+/* Queue one record; -EAGAIN if the ring is full */
+static int vt_produce(struct vt_producer *p, u32 seq)
+{
+    struct vt_rec rec = { .producer = p->id, .seq = seq }, *slot;
+    u32 pos;
+
+    if (!vt_reserve_mode) {
+        rec.stamp = ktime_get_ns();
+        rec.check = vt_check(&rec);
+        return vfifo_enqueue(vt_dev, &rec, sizeof(rec));
+    }
+
+    slot = vfifo_reserve(vt_dev, sizeof(*slot), &pos);
+    if (IS_ERR(slot))
+        return PTR_ERR(slot);
+    /* Exercise the discard path too: the record is skipped, not lost */
+    if (get_random_u32() % VT_DISCARD_ODDS == 0) {
+        vfifo_discard(vt_dev, pos);
+        return -ECANCELED;
+    }
+    rec.stamp = ktime_get_ns();
+    rec.check = vt_check(&rec);
+    memcpy(slot, &rec, sizeof(rec));
+    return vfifo_commit(vt_dev, pos);
+}
+
+static int vt_producer_fn(void *arg)
+{
+    struct vt_producer *p = arg;
+    u32 seq = 0;
+    int ret;
+
+    while (!kthread_should_stop()) {
+        ret = vt_produce(p, seq);
+        if (ret == -EAGAIN) {
+            WRITE_ONCE(p->full, p->full + 1);
+            if (!drop_on_full) {
+                vt_stutter();
+                continue;
+            }
+        }
+        if (ret) {
+            WRITE_ONCE(p->dropped, p->dropped + 1);
+        } else {
+            WRITE_ONCE(p->sent_sum, p->sent_sum + seq);
+            WRITE_ONCE(p->sent, p->sent + 1);
+        }
+        seq++;
+        vt_stutter();
+    }
+    return 0;
+}
+
+static void vt_consume(struct vt_consumer *c, const struct vt_rec *rec)
+{
+    u64 now = ktime_get_ns();
+
+    /* Readers skip discarded spans: any record that shows up was committed */
+    if (rec->producer >= nr_producers || rec->check != vt_check(rec)) {
+        c->corrupt++;
+        pr_err_ratelimited("consumer %u: corrupt record (producer %u seq %u)\n",
+                           c->id, rec->producer, rec->seq);
+        return;
+    }
+    if (rec->seq < c->next_seq[rec->producer]) {
+        c->order_errors++;
+        pr_err_ratelimited("consumer %u: producer %u seq %u after %u\n",
+                           c->id, rec->producer, rec->seq, c->next_seq[rec->producer] - 1);
+    }
+    c->next_seq[rec->producer] = rec->seq + 1;
+    c->recv[rec->producer]++;
+    c->recv_sum[rec->producer] += rec->seq;
+    c->lat[vt_lat_bucket(now > rec->stamp ? now - rec->stamp : 0)]++;
+    WRITE_ONCE(c->records, c->records + 1);
+}
+
+static int vt_consumer_fn(void *arg)
+{
+    struct vt_consumer *c = arg;
+    struct vt_rec rec;
+
+    while (!kthread_should_stop()) {
+        if (vfifo_dequeue(vt_dev, &rec, sizeof(rec), VFIFO_DEQUEUE_ALL) == sizeof(rec))
+            vt_consume(c, &rec);
+        vt_stutter();
+    }
+    return 0;
+}
+
+/* --- Control --- */
+
+static int vt_random_cpu(void)
+{
+    int n = get_random_u32() % num_online_cpus();
+    int cpu;
+
+    for_each_online_cpu(cpu)
+        if (n-- == 0)
+            return cpu;
+    return cpumask_first(cpu_online_mask);
+}
+
+/* Move every thread to a random CPU, so migration races get exercised */
+static void vt_shuffle(void)
+{
+    int i;
+
+    for (i = 0; i < nr_producers; i++)
+        set_cpus_allowed_ptr(vt_producers[i].task, cpumask_of(vt_random_cpu()));
+    for (i = 0; i < nr_consumers; i++)
+        set_cpus_allowed_ptr(vt_consumers[i].task, cpumask_of(vt_random_cpu()));
+}
+
+static u64 vt_total_sent(void)
+{
+    u64 n = 0;
+    int i;
+
+    for (i = 0; i < nr_producers; i++)
+        n += READ_ONCE(vt_producers[i].sent);
+    return n;
+}
+
+static u64 vt_total_consumed(void)
+{
+    u64 n = 0;
+    int i;
+
+    for (i = 0; i < nr_consumers; i++)
+        n += READ_ONCE(vt_consumers[i].records);
+    return n;
+}
+
+static void vt_print_stats(void)
+{
+    u64 ns = ktime_get_ns() - vt_start_ns;
+    u64 full = 0, consumed = vt_total_consumed();
+    int i;
+
+    for (i = 0; i < nr_producers; i++)
+        full += READ_ONCE(vt_producers[i].full);
+    pr_info("%llu ms: sent %llu consumed %llu (%llu ops/s), ring full %llu times\n",
+            div64_u64(ns, NSEC_PER_MSEC), vt_total_sent(), consumed,
+            div64_u64(consumed * NSEC_PER_SEC, max_t(u64, ns, 1)), full);
+}
+
+static void vt_print_latency(void)
+{
+    static const unsigned int permille[] = { 500, 900, 990, 999, 1000 };
+    static const char * const names[] = { "p50", "p90", "p99", "p99.9", "max" };
+    u64 *hist, total = 0, seen, target;
+    unsigned int b, i, c;
+
+    hist = kcalloc(VT_LAT_BUCKETS, sizeof(*hist), GFP_KERNEL);
+    if (!hist)
+        return;
+    for (c = 0; c < nr_consumers; c++)
+        for (b = 0; b < VT_LAT_BUCKETS; b++)
+            hist[b] += vt_consumers[c].lat[b];
+    for (b = 0; b < VT_LAT_BUCKETS; b++)
+        total += hist[b];
+
+    for (i = 0; i < ARRAY_SIZE(permille) && total; i++) {
+        target = max_t(u64, div64_u64(total * permille[i] + 999, 1000), 1);
+        for (b = 0, seen = 0; b < VT_LAT_BUCKETS; b++) {
+            seen += hist[b];
+            if (seen >= target)
+                break;
+        }
+        pr_info("latency %-5s <= %llu ns\n", names[i], vt_lat_bucket_max(b));
+    }
+    kfree(hist);
+}
+
+/*
+ * Stop the producers, give the consumers time to drain what was committed,
+ * stop them and check the books.
+ */
+static void vt_finish(void)
+{
+    u64 ns, consumed, sent = 0, dropped = 0, recv, recv_sum;
+    u64 order_errors = 0, corrupt = 0, mismatched = 0;
+    unsigned long deadline;
+    struct vt_rec rec;
+    int i, c;
+
+    if (vt_finished)
+        return;
+    vt_finished = true;
+
+    for (i = 0; i < nr_producers; i++)
+        kthread_stop(vt_producers[i].task);
+    ns = ktime_get_ns() - vt_start_ns;
+
+    deadline = jiffies + 10 * HZ;
+    while (vt_total_consumed() < vt_total_sent() && time_before(jiffies, deadline))
+        msleep(10);
+    for (i = 0; i < nr_consumers; i++)
+        kthread_stop(vt_consumers[i].task);
+
+    /* Anything left was never consumed; leave the ring empty */
+    while (vfifo_dequeue(vt_dev, &rec, sizeof(rec), VFIFO_DEQUEUE_ALL) == sizeof(rec))
+        ;
+
+    for (i = 0; i < nr_producers; i++) {
+        recv = recv_sum = 0;
+        for (c = 0; c < nr_consumers; c++) {
+            recv += vt_consumers[c].recv[i];
+            recv_sum += vt_consumers[c].recv_sum[i];
+        }
+        if (recv != vt_producers[i].sent || recv_sum != vt_producers[i].sent_sum) {
+            pr_err("producer %d: sent %llu (sum %llu), received %llu (sum %llu)\n", i,
+                   vt_producers[i].sent, vt_producers[i].sent_sum, recv, recv_sum);
+            mismatched++;
+        }
+        sent += vt_producers[i].sent;
+        dropped += vt_producers[i].dropped;
+    }
+    for (c = 0; c < nr_consumers; c++) {
+        order_errors += vt_consumers[c].order_errors;
+        corrupt += vt_consumers[c].corrupt;
+    }
+    consumed = vt_total_consumed();
+
+    pr_info("mode=%s producers=%d consumers=%d record=%zu bytes, %llu ms\n", mode,
+            nr_producers, nr_consumers, sizeof(rec), div64_u64(ns, NSEC_PER_MSEC));
+    pr_info("sent %llu consumed %llu dropped %llu, %llu ops/s\n",
+            sent, consumed, dropped, div64_u64(consumed * NSEC_PER_SEC, max_t(u64, ns, 1)));
+    vt_print_latency();
+    pr_info("order errors %llu, corrupt %llu, producers with lost or duplicated records %llu\n",
+            order_errors, corrupt, mismatched);
+    if (order_errors || corrupt || mismatched)
+        pr_err("End of test: FAILURE\n");
+    else
+        pr_info("End of test: SUCCESS\n");
+}
+
+static int vt_control_fn(void *arg)
+{
+    unsigned long end = jiffies + duration * HZ;
+    unsigned long next_stat = jiffies + stat_interval * HZ;
+    unsigned long tick = shuffle_interval > 0 ? msecs_to_jiffies(shuffle_interval) : HZ;
+
+    while (!kthread_should_stop()) {
+        schedule_timeout_interruptible(min_t(unsigned long, tick, HZ));
+        if (kthread_should_stop())
+            break;
+        if (shuffle_interval > 0)
+            vt_shuffle();
+        if (stat_interval > 0 && time_after_eq(jiffies, next_stat)) {
+            vt_print_stats();
+            next_stat = jiffies + stat_interval * HZ;
+        }
+        if (duration > 0 && time_after_eq(jiffies, end))
+            break;
+    }
+    vt_finish();
+
+    /* kthread_stop() from module exit expects us to still be around */
+    while (!kthread_should_stop())
+        schedule_timeout_interruptible(HZ);
+    return 0;
+}
+
+/* --- Init and Exit --- */
+
+static void vt_free(void)
+{
+    int i;
+
+    for (i = 0; vt_consumers && i < nr_consumers; i++) {
+        kfree(vt_consumers[i].next_seq);
+        kfree(vt_consumers[i].recv);
+        kfree(vt_consumers[i].recv_sum);
+    }
+    kvfree(vt_consumers);
+    kvfree(vt_producers);
+    vfifo_put(vt_dev);
+}
+
+static int __init vt_init(void)
+{
+    struct vt_rec rec;
+    int i, ret = -ENOMEM;
+
+    if (nr_producers < 1 || nr_producers > VT_MAX_THREADS ||
+        nr_consumers < 1 || nr_consumers > VT_MAX_THREADS)
+        return -EINVAL;
+    if (!strcmp(mode, "reserve"))
+        vt_reserve_mode = true;
+    else if (strcmp(mode, "copy"))
+        return -EINVAL;
+
+    vt_dev = vfifo_get(instance);
+    if (!vt_dev) {
+        pr_err("no vfifo instance '%s'\n", instance);
+        return -ENODEV;
+    }
+    /* Start from an empty ring, or stale data would look like corruption */
+    while (vfifo_dequeue(vt_dev, &rec, sizeof(rec), 0) > 0)
+        ;
+
+    vt_producers = kvcalloc(nr_producers, sizeof(*vt_producers), GFP_KERNEL);
+    vt_consumers = kvcalloc(nr_consumers, sizeof(*vt_consumers), GFP_KERNEL);
+    if (!vt_producers || !vt_consumers)
+        goto fail;
+    for (i = 0; i < nr_consumers; i++) {
+        vt_consumers[i].id = i;
+        vt_consumers[i].next_seq = kcalloc(nr_producers, sizeof(u32), GFP_KERNEL);
+        vt_consumers[i].recv = kcalloc(nr_producers, sizeof(u64), GFP_KERNEL);
+        vt_consumers[i].recv_sum = kcalloc(nr_producers, sizeof(u64), GFP_KERNEL);
+        if (!vt_consumers[i].next_seq || !vt_consumers[i].recv || !vt_consumers[i].recv_sum)
+            goto fail;
+    }
+
+    vt_start_ns = ktime_get_ns();
+
+    /* Consumers first, so nothing queues up before anyone reads */
+    for (i = 0; i < nr_consumers; i++) {
+        vt_consumers[i].task = kthread_run(vt_consumer_fn, &vt_consumers[i],
+                                           "vfifo_torture_c/%d", i);
+        if (IS_ERR(vt_consumers[i].task)) {
+            ret = PTR_ERR(vt_consumers[i].task);
+            goto fail_consumers;
+        }
+    }
+    for (i = 0; i < nr_producers; i++) {
+        vt_producers[i].id = i;
+        vt_producers[i].task = kthread_run(vt_producer_fn, &vt_producers[i],
+                                           "vfifo_torture_p/%d", i);
+        if (IS_ERR(vt_producers[i].task)) {
+            ret = PTR_ERR(vt_producers[i].task);
+            goto fail_producers;
+        }
+    }
+    vt_control_task = kthread_run(vt_control_fn, NULL, "vfifo_torture");
+    if (IS_ERR(vt_control_task)) {
+        ret = PTR_ERR(vt_control_task);
+        i = nr_producers;
+        goto fail_producers;
+    }
+
+    pr_info("started: %s, mode=%s producers=%d consumers=%d duration=%ds\n",
+            instance, mode, nr_producers, nr_consumers, duration);
+    return 0;
+
+fail_producers:
+    while (i--)
+        kthread_stop(vt_producers[i].task);
+    i = nr_consumers;
+fail_consumers:
+    while (i--)
+        kthread_stop(vt_consumers[i].task);
+fail:
+    vt_free();
+    return ret;
+}
+
+static void __exit vt_exit(void)
+{
+    kthread_stop(vt_control_task);
+    vt_free();
+}
+
+module_init(vt_init);
+module_exit(vt_exit);
@@ -0,0 +1,234 @@
+/*
+ * vfifo_uapi.h - ioctl interface shared by the driver and the test programs.
+ *
+ * Include this from both kernel and user space so the command numbers and
+ * argument layouts can never drift apart.
+ */
+#ifndef VFIFO_UAPI_H
+#define VFIFO_UAPI_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Reserve/commit protocol (multi-producer):
+ *   1. VFIFO_RESERVE claims 'len' bytes of the ring for the caller.
+ *   2. The caller fills the span in place through the mmap()ed buffer,
+ *      starting at 'offset'. The span may wrap: bytes past the end of the
+ *      buffer continue at offset 0.
+ *   3. VFIFO_COMMIT hands the span (identified by 'pos') to the readers.
+ * Readers only ever see committed spans, in reservation order.
+ */
+struct vfifo_reservation {
+    __u32 len;      /* in: bytes wanted, out: bytes granted */
+    __u32 flags;    /* in: VFIFO_RESERVE_* */
+    __u32 pos;      /* out: ring position, pass it to VFIFO_COMMIT */
+    __u32 offset;   /* out: byte offset of the span in the mapped buffer */
+};
+
+/* Accept a shorter span than requested instead of waiting for room */
+#define VFIFO_RESERVE_PARTIAL   (1 << 0)
+
+/*
+ * Zero-copy consumption:
+ *   1. VFIFO_PEEK reports where the readable data sits in the mapped
+ *      buffer. Nothing is consumed; peeking twice returns the same span.
+ *   2. The caller parses the data in place (it may wrap, as above).
+ *   3. VFIFO_CONSUME releases the first N bytes back to the producers.
+ * If the consumer crashes between 1 and 3, the data is still queued.
+ */
+struct vfifo_span {
+    __u32 pos;      /* ring position of the first readable byte */
+    __u32 offset;   /* byte offset of that byte in the mapped buffer */
+    __u32 len;      /* readable bytes */
+    __u32 reserved;
+};
+
+/*
+ * Readiness notification through an eventfd, for event loops that can only
+ * wait on eventfds. One registration per event; fd = -1 detaches.
+ *   VFIFO_EVENT_DATA:  readable bytes reached 'watermark'
+ *   VFIFO_EVENT_SPACE: free bytes reached 'watermark'
+ * Signals are coalesced: after one fires, the next comes only once the level
+ * has dropped below the watermark and crossed it again. Drain (or fill)
+ * past the watermark before waiting on the eventfd again.
+ */
+struct vfifo_eventfd {
+    __s32 fd;
+    __u32 event;        /* VFIFO_EVENT_* */
+    __u32 watermark;    /* In bytes; 0 is treated as 1 */
+    __u32 reserved;
+};
+
+#define VFIFO_EVENT_DATA    0
+#define VFIFO_EVENT_SPACE   1
+
+/*
+ * Multi-queue instances (nr_queues=M): writes are steered to one of the M
+ * queues by a hash of their flow key, so each flow stays in order. By
+ * default every fd is a flow of its own. VFIFO_SET_FLOW sets the key for
+ * the fd's writes; with VFIFO_FLOW_HEADER each write instead starts with
+ * a __u32 key, which is stripped. VFIFO_BIND_QUEUE makes the fd read only
+ * queue N (-1: all queues, the default).
+ */
+struct vfifo_flow {
+    __u32 key;
+    __u32 flags;        /* VFIFO_FLOW_* */
+};
+
+#define VFIFO_FLOW_HEADER   (1 << 0)
+
+/*
+ * Priority lanes (nr_lanes=N): lane 0 is read first. VFIFO_SET_LANE puts
+ * the fd's writes in a lane (by default the lowest, N-1); with
+ * VFIFO_LANE_HEADER each write instead starts with a __u32 lane number,
+ * which is stripped (past the last lane means the last lane).
+ */
+struct vfifo_lane {
+    __u32 lane;
+    __u32 flags;        /* VFIFO_LANE_* */
+};
+
+#define VFIFO_LANE_HEADER   (1 << 0)
+
+/*
+ * Streaming writes: write() copies spans of at least 'threshold' bytes
+ * into the ring with non-temporal stores, so bulk transfers do not evict
+ * other workloads' data from the CPU caches (0: always a cached copy).
+ * An fd follows the device's stream_threshold sysfs attribute until
+ * VFIFO_SET_STREAM gives it its own; VFIFO_STREAM_DEVICE goes back to
+ * following the device.
+ */
+struct vfifo_stream {
+    __u32 threshold;    /* In bytes */
+    __u32 flags;        /* VFIFO_STREAM_* */
+};
+#define VFIFO_STREAM_DEVICE (1 << 0)
+
+/*
+ * VFIFO_GET_STATUS: a snapshot of the device, taken without holding up
+ * its producers or consumers. Byte counts are of ring bytes (compressed
+ * bytes on a compressed instance, trefs on a tee sink) and run from the
+ * device's creation. Sharded, multi-queue and lane instances report the
+ * sums over their rings, with head and tail 0.
+ */
+struct vfifo_status {
+    __u32 capacity;
+    __u32 used;         /* Bytes queued, as the 'size' attribute counts them */
+    __u32 head;         /* Ring positions: free-running, wrap at 2^32 */
+    __u32 tail;
+    __u32 mode;         /* 1 while the generator runs */
+    __u32 reserved;
+    __u64 bytes_in;     /* Committed by producers */
+    __u64 bytes_out;    /* Released by consumers */
+    __u64 commits;      /* Writes (records, on record rings) */
+    __u64 releases;     /* Reads */
+};
+
+/*
+ * Control page: mmap() one page at VFIFO_CTRL_OFFSET (MAP_SHARED, read and
+ * write) for futex words, so processes handing data over through read()
+ * and write() (or the mmap span protocol) can sleep and wake each other
+ * without going through the driver:
+ *   data_seq   moves on whenever committed data grows
+ *   space_seq  moves on whenever room is freed
+ * Both are free-running; compare them for equality only. A consumer that
+ * found nothing to read does
+ *     add 1 to data_waiters; s = data_seq;
+ *     check for data again (a non-blocking read, or VFIFO_PEEK);
+ *     if there is still none, FUTEX_WAIT(&data_seq, s);
+ *     subtract 1 from data_waiters
+ * and a producer, once its write() or VFIFO_COMMIT has returned, does
+ *     if (data_waiters) FUTEX_WAKE(&data_seq, INT_MAX)
+ * (space_* likewise, with the roles swapped; use atomic operations). The
+ * driver moves the sequence words itself and never reads the rest.
+ *
+ * A kernel module cannot issue FUTEX_WAKE: data from kernel-side
+ * producers (the generator, vfifo_enqueue()) only reaches waiters that
+ * give FUTEX_WAIT a timeout, or that use poll() instead.
+ */
+struct vfifo_ctrl {
+    __u32 data_seq;
+    __u32 space_seq;
+    __u32 data_waiters;
+    __u32 space_waiters;
+};
+
+/* Past the largest possible buffer, so it never overlaps a data mapping */
+#define VFIFO_CTRL_OFFSET   0x10000000
+
+/*
+ * Sessions (sessions=fd or pgrp): every fd, or every process group, gets a
+ * private ring on the device, so tenants neither see each other's data
+ * nor contend on its locks. VFIFO_GET_SESSION names the fd's session; a
+ * process that is handed the id and token out of band passes them to
+ * VFIFO_JOIN_SESSION on its own fd to share that ring instead (-ENOENT if
+ * they do not match). An fd joins at most once (-EBUSY); the ring it
+ * leaves is kept until the fd is closed.
+ */
+struct vfifo_session {
+    __u32 id;
+    __u32 reserved;
+    __u64 token;
+};
+
+/*
+ * VFIFO_EXPORT_DMABUF takes VFIFO_DMABUF_* flags and returns a new dma-buf
+ * fd for the ring's pages ('capacity' bytes), for importing into other
+ * drivers. Offsets in it are those of the mmap() buffer, so a consumer can
+ * PEEK a span and pass its offset on with the fd. CPU access through the
+ * dma-buf should be bracketed with DMA_BUF_IOCTL_SYNC. Only a plain ring
+ * can be exported, and it cannot be resized (-EBUSY) while any export is
+ * alive.
+ */
+#define VFIFO_DMABUF_CLOEXEC (1 << 0)
+
+/*
+ * Rate shaping: VFIFO_SET_RATE limits the fd's write()s and VFIFO_RESERVEs
+ * to 'rate' bytes per second, in bursts of up to 'burst' bytes (0: one
+ * second's worth); rate 0 lifts the limit. The device's rate_limit and
+ * rate_burst sysfs attributes limit all of its fds together on top of
+ * that. A write may start whenever neither limit is in debt and then
+ * spends its whole length, so a large write is never starved, only
+ * followed by a longer wait. Over a limit, a blocking fd sleeps until the
+ * debt is paid off and an O_NONBLOCK one gets -EAGAIN.
+ *
+ * VFIFO_GET_BACKPRESSURE tells a producer how close it is to being held
+ * back, so it can shrink its batches before it is.
+ */
+struct vfifo_rate {
+    __u64 rate;         /* Bytes per second; 0: unlimited */
+    __u32 burst;        /* Bytes */
+    __u32 reserved;
+};
+
+struct vfifo_backpressure {
+    __u32 level;        /* 0..100: the highest of the three below */
+    __u32 fill;         /* Percent of the ring in use */
+    __u32 fd_rate;      /* Percent of the fd's burst spent (0: no limit) */
+    __u32 dev_rate;     /* Percent of the device's burst spent */
+    __u64 wait_ns;      /* How long a write would wait for its limits now */
+};
+
+#define VFIFO_IOC_MAGIC 'k'
+#define VFIFO_CLEAR     _IO(VFIFO_IOC_MAGIC, 1)
+#define VFIFO_SET_MODE  _IOW(VFIFO_IOC_MAGIC, 2, int)
+#define VFIFO_RESERVE   _IOWR(VFIFO_IOC_MAGIC, 3, struct vfifo_reservation)
+#define VFIFO_COMMIT    _IOW(VFIFO_IOC_MAGIC, 4, __u32)
+#define VFIFO_PEEK      _IOR(VFIFO_IOC_MAGIC, 5, struct vfifo_span)
+#define VFIFO_CONSUME   _IOW(VFIFO_IOC_MAGIC, 6, __u32)
+/* Resize the live ring; queued data is kept. Mappings must be redone. */
+#define VFIFO_RESIZE    _IOW(VFIFO_IOC_MAGIC, 7, __u32)
+#define VFIFO_SET_EVENTFD _IOW(VFIFO_IOC_MAGIC, 8, struct vfifo_eventfd)
+#define VFIFO_SET_FLOW  _IOW(VFIFO_IOC_MAGIC, 9, struct vfifo_flow)
+#define VFIFO_BIND_QUEUE _IOW(VFIFO_IOC_MAGIC, 10, int)
+#define VFIFO_SET_LANE  _IOW(VFIFO_IOC_MAGIC, 11, struct vfifo_lane)
+#define VFIFO_SET_STREAM _IOW(VFIFO_IOC_MAGIC, 12, struct vfifo_stream)
+#define VFIFO_GET_STATUS _IOR(VFIFO_IOC_MAGIC, 13, struct vfifo_status)
+#define VFIFO_EXPORT_DMABUF _IOW(VFIFO_IOC_MAGIC, 14, __u32)
+#define VFIFO_GET_SESSION _IOR(VFIFO_IOC_MAGIC, 15, struct vfifo_session)
+#define VFIFO_JOIN_SESSION _IOW(VFIFO_IOC_MAGIC, 16, struct vfifo_session)
+#define VFIFO_SET_RATE  _IOW(VFIFO_IOC_MAGIC, 17, struct vfifo_rate)
+#define VFIFO_GET_BACKPRESSURE _IOR(VFIFO_IOC_MAGIC, 18, struct vfifo_backpressure)
+
+#endif /* VFIFO_UAPI_H */